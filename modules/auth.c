@@ -4,6 +4,8 @@
 #include "auth.h"
 #include "../src/config.h"
 #include "../src/log.h"
+#include "../src/pool.h"
+#include "../src/stats.h"
 #include "../src/wire.h"
 #include <assert.h>
 #include <curl/curl.h>
@@ -11,6 +13,7 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
@@ -19,8 +22,68 @@
 /* TODO: from config */
 #define FROM "noreply@librecast.net"
 
+/* threads sending mail for each handler, and how long one may take over it */
+#define AUTH_MAIL_WORKERS 4
+#define AUTH_MAIL_QUEUE 64
+#define AUTH_MAIL_TIMEOUT_S 30
+
+/* counters in the core's stats segment, see lsdbd-stat */
+static void auth_count(int stat)
+{
+	if (config.api && config.api->count) config.api->count(stat, 1);
+}
+
+/* count and time an opcode's handler */
+static void auth_op(unsigned int op, void (*f)(lc_message_t *), lc_message_t *msg)
+{
+	struct timespec start, end;
+	if (!config.api || !config.api->count_op || !config.api->latency) {
+		f(msg);
+		return;
+	}
+	config.api->count_op(op);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	f(msg);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	config.api->latency(op, (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000
+			+ end.tv_nsec - start.tv_nsec);
+}
+
 lc_ctx_t *lctx;
 
+typedef struct auth_async_s auth_async_t;
+
+/* per handler state, returned by init() */
+typedef struct auth_ctx_s auth_ctx_t;
+struct auth_ctx_s {
+	handler_t *handler;
+	lc_ctx_t *lctx;
+	pool_t *mail;		/* workers for handle_async(), NULL in testmode */
+};
+
+/* a request handle_async() has queued for the mail workers */
+struct auth_async_s {
+	auth_ctx_t *ctx;
+	lc_message_t *msg;
+	module_req_t *req;
+};
+
+static pthread_once_t auth_curl_once = PTHREAD_ONCE_INIT;
+
+/* handler being served by this thread.  Outside of handle_msg(), as when the
+ * helpers are called directly, we use the first handler and the global lctx */
+static __thread auth_ctx_t *auth_ctx;
+
+static handler_t *auth_handler(void)
+{
+	return (auth_ctx) ? auth_ctx->handler : config.handlers;
+}
+
+static lc_ctx_t *auth_lctx(void)
+{
+	return (auth_ctx) ? auth_ctx->lctx : lctx;
+}
+
 void hash_field(unsigned char *hash, size_t hashlen,
 		const char *key, size_t keylen,
 		const char *fld, size_t fldlen)
@@ -32,17 +95,21 @@ void hash_field(unsigned char *hash, size_t hashlen,
 	crypto_generichash_final(&state, hash, hashlen);
 }
 
-lc_ctx_t *auth_init()
+static lc_ctx_t *auth_db_open(handler_t *h)
 {
-	lctx = lc_ctx_new();
-	handler_t *h = config.handlers;
-	if (h && h->dbpath) {
+	lc_ctx_t *ctx = lc_ctx_new();
+	if (ctx && h && h->dbpath) {
 		if (mkdir(h->dbpath, S_IRWXU) == -1 && errno != EEXIST) {
 			ERROR("can't create database path '%s': %s", h->dbpath, strerror(errno));
 		}
-		lc_db_open(lctx, h->dbpath);
+		lc_db_open(ctx, h->dbpath);
 	}
-	return lctx;
+	return ctx;
+}
+
+lc_ctx_t *auth_init()
+{
+	return (lctx = auth_db_open(config.handlers));
 }
 
 void auth_free()
@@ -55,7 +122,7 @@ int auth_field_del(char *key, size_t keylen, char *field, void *data, size_t dat
 	int ret = 0;
 	unsigned char hash[crypto_generichash_BYTES] = "";
 	hash_field(hash, sizeof hash, key, keylen, field, strlen(field));
-	if ((ret = lc_db_del(lctx, config.handlers->dbname, hash, sizeof hash, data, datalen))) {
+	if ((ret = lc_db_del(auth_lctx(), auth_handler()->dbname, hash, sizeof hash, data, datalen))) {
 		errno = ret;
 		ret = -1;
 	}
@@ -67,7 +134,7 @@ int auth_field_get(char *key, size_t keylen, char *field, void *data, size_t *da
 	int ret = 0;
 	unsigned char hash[crypto_generichash_BYTES] = "";
 	hash_field(hash, sizeof hash, key, keylen, field, strlen(field));
-	if ((ret = lc_db_get(lctx, config.handlers->dbname, hash, sizeof hash, data, datalen))) {
+	if ((ret = lc_db_get(auth_lctx(), auth_handler()->dbname, hash, sizeof hash, data, datalen))) {
 		errno = ret;
 		ret = -1;
 	}
@@ -88,7 +155,7 @@ int auth_field_set(char *key, size_t keylen, const char *field, void *data, size
 {
 	unsigned char hash[crypto_generichash_BYTES];
 	hash_field(hash, sizeof hash, key, keylen, field, strlen(field));
-	return lc_db_set(lctx, config.handlers->dbname, hash, sizeof hash, data, datalen);
+	return lc_db_set(auth_lctx(), auth_handler()->dbname, hash, sizeof hash, data, datalen);
 }
 
 int auth_user_pass_set(char *userid, struct iovec *pass)
@@ -168,6 +235,11 @@ int auth_valid_email(char *mail, size_t len)
 	return 1;
 }
 
+static void auth_curl_init(void)
+{
+	if (curl_global_init(CURL_GLOBAL_ALL)) ERROR("curl_global_init() failed");
+}
+
 static int auth_mail_token(char *subject, char *to, char *token)
 {
 	char filename[] = "/tmp/lsd-auth-mail-XXXXXX";
@@ -202,10 +274,8 @@ static int auth_mail_token(char *subject, char *to, char *token)
 	CURL *curl = NULL;
 	CURLcode res = CURLE_OK;
 	struct curl_slist *recipients = NULL;
-	if (curl_global_init(CURL_GLOBAL_ALL)) {
-		goto exit_err;
-		ret = -1;
-	}
+	/* mail may be sent from several threads at once, see handle_async() */
+	pthread_once(&auth_curl_once, auth_curl_init);
 	curl = curl_easy_init();
 	if (curl) {
 		curl_easy_setopt(curl, CURLOPT_URL, "smtp://smtp.gladserv.com:25"); /* FIXME config */
@@ -221,6 +291,9 @@ static int auth_mail_token(char *subject, char *to, char *token)
 		curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
 		curl_easy_setopt(curl, CURLOPT_READDATA, f);
 		curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+		/* a worker must come back to its queue, and to finit() */
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)AUTH_MAIL_TIMEOUT_S);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 		if (config.debug) curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 		if (curl_easy_perform(curl) != CURLE_OK) {
 			ERROR("curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
@@ -230,8 +303,6 @@ cleanup:
 		curl_slist_free_all(recipients);
 		curl_easy_cleanup(curl);
 	}
-	curl_global_cleanup();
-exit_err:
 	fclose(f);
 	close(fd);
 	unlink(filename);
@@ -260,7 +331,7 @@ int auth_decode_packet_key(lc_message_t *msg, auth_payload_t *payload, unsigned
 	/* outer fields are all required */
 	if ((outer[fld_key].iov_len != crypto_box_PUBLICKEYBYTES)
 	||  (outer[fld_nonce].iov_len != crypto_box_NONCEBYTES)
-	||  (outer[fld_payload].iov_len < 1)) {
+	||  (outer[fld_payload].iov_len <= crypto_box_MACBYTES)) {
 		ERROR("no payload");
 		errno = EBADMSG;
 		return -1;
@@ -271,7 +342,14 @@ int auth_decode_packet_key(lc_message_t *msg, auth_payload_t *payload, unsigned
 		return -1;
 	}
 
-	payload->data = malloc(outer[fld_payload].iov_len - crypto_box_MACBYTES);
+	/* decrypt into a core pool buffer where we can, saving a malloc() */
+	const size_t datalen = outer[fld_payload].iov_len - crypto_box_MACBYTES;
+	payload->data = NULL;
+	payload->pooled = 0;
+	if (config.api && config.api->buf_get && datalen <= config.api->buf_size())
+		payload->pooled = !!(payload->data = config.api->buf_get());
+	if (!payload->data && !(payload->data = malloc(datalen)))
+		return -1;
 	payload->senderkey = outer[fld_key];
 	unsigned char *nonce = outer[fld_nonce].iov_base;
 	if (crypto_box_open_easy(payload->data,
@@ -280,6 +358,7 @@ int auth_decode_packet_key(lc_message_t *msg, auth_payload_t *payload, unsigned
 				nonce, payload->senderkey.iov_base, sk) != 0)
 	{
 		ERROR("packet decryption failed");
+		auth_payload_free(payload);
 		errno = EBADMSG;
 		return -1;
 	}
@@ -289,9 +368,11 @@ int auth_decode_packet_key(lc_message_t *msg, auth_payload_t *payload, unsigned
 	DEBUG("auth module unpacking fields");
 	struct iovec clearpkt = {0};
 	clearpkt.iov_base = payload->data;
-	clearpkt.iov_len = outer[fld_payload].iov_len - crypto_box_MACBYTES;
-	if (payload->fieldcount && wire_unpack_pre(&clearpkt, payload->fields, payload->fieldcount, NULL, 0) == -1)
+	clearpkt.iov_len = datalen;
+	if (payload->fieldcount && wire_unpack_pre(&clearpkt, payload->fields, payload->fieldcount, NULL, 0) == -1) {
+		auth_payload_free(payload);
 		return -1;
+	}
 	DEBUG("wire_unpack() fieldcount: %i", payload->fieldcount);
 #if 0
 	DEBUG("wire_unpack() done, dumping fields...");
@@ -306,11 +387,23 @@ int auth_decode_packet_key(lc_message_t *msg, auth_payload_t *payload, unsigned
 	return 0;
 }
 
+void auth_payload_free(auth_payload_t *payload)
+{
+	if (payload->pooled) config.api->buf_put(payload->data);
+	else free(payload->data);
+	payload->data = NULL;
+	payload->pooled = 0;
+}
+
 int auth_decode_packet(lc_message_t *msg, auth_payload_t *payload)
 {
 	unsigned char sk[crypto_box_SECRETKEYBYTES];
-	auth_key_crypt_sk_bin(sk, config.handlers->key_private);
-	return auth_decode_packet_key(msg, payload, sk);
+	auth_key_crypt_sk_bin(sk, auth_handler()->key_private);
+	if (auth_decode_packet_key(msg, payload, sk) == -1) {
+		if (errno == EBADMSG) auth_count(STAT_ERRORS);
+		return -1;
+	}
+	return 0;
 }
 
 int auth_reply(struct iovec *repl, struct iovec *clientkey, struct iovec *data,
@@ -329,8 +422,8 @@ int auth_reply(struct iovec *repl, struct iovec *clientkey, struct iovec *data,
 	struct iovec payload[] = { iovkey, iovnon, crypted };
 	const size_t paylen = sizeof payload / sizeof payload[0];
 	struct iovec pkt = {0};
-	auth_key_crypt_pk_bin(authpubkey, config.handlers->key_public);
-	auth_key_crypt_sk_bin(authseckey, config.handlers->key_private);
+	auth_key_crypt_pk_bin(authpubkey, auth_handler()->key_public);
+	auth_key_crypt_sk_bin(authseckey, auth_handler()->key_private);
 	randombytes_buf(nonce, sizeof nonce);
 	if (crypto_box_easy(ciphertext, (unsigned char *)data->iov_base, data->iov_len,
 				nonce, clientkey->iov_base, authseckey) == -1)
@@ -345,9 +438,17 @@ int auth_reply(struct iovec *repl, struct iovec *clientkey, struct iovec *data,
 	lc_socket_t *sock = NULL;
 	lc_channel_t *chan = NULL;
 	lc_message_t response = {0};
+	int ret = 0;
 	DEBUG("response to requestor");
-	sock = lc_socket_new(lctx);
-	chan = lc_channel_nnew(lctx, repl->iov_base, repl->iov_len);
+	chan = lc_channel_nnew(auth_lctx(), repl->iov_base, repl->iov_len);
+	if (config.api && config.api->reply) {
+		/* let the server batch replies with others from this dispatch */
+		ret = config.api->reply(chan, pkt.iov_base, pkt.iov_len);
+		free(pkt.iov_base);
+		lc_channel_free(chan);
+		return ret;
+	}
+	sock = lc_socket_new(auth_lctx());
 	lc_channel_bind(sock, chan);
 	lc_msg_init_data(&response, pkt.iov_base, pkt.iov_len, NULL, NULL);
 	int opt = 1; /* set loopback in case we're on the same host as the sender */
@@ -356,7 +457,7 @@ int auth_reply(struct iovec *repl, struct iovec *clientkey, struct iovec *data,
 	free(pkt.iov_base);
 	lc_channel_free(chan);
 	lc_socket_close(sock);
-	return 0;
+	return ret;
 }
 
 static void auth_reply_code(struct iovec *repl, struct iovec *clientkey, uint8_t op, uint8_t code)
@@ -445,7 +546,7 @@ int auth_serv_token_new(struct iovec *tok, struct iovec *iov, size_t iovlen)
 	struct iovec pre[pre_count];
 	pre[0].iov_base = &expires;
 	pre[0].iov_len = sizeof expires;
-	expires = htobe64(time(NULL) + config.handlers->token_duration);
+	expires = htobe64(time(NULL) + auth_handler()->token_duration);
 	if (wire_pack_pre(&data, iov, iovlen, pre, pre_count) == -1) {
 		perror("wire_pack_pre()");
 		return -1;
@@ -457,7 +558,7 @@ int auth_serv_token_new(struct iovec *tok, struct iovec *iov, size_t iovlen)
 		return -1;
 	}
 	DEBUG("unsigned token is %zu bytes", data.iov_len);
-	auth_key_sign_sk_bin(sk, config.handlers->key_private);
+	auth_key_sign_sk_bin(sk, auth_handler()->key_private);
 	if (crypto_sign(cap_sig, &tok_len, data.iov_base, data.iov_len, sk)) {
 		ERROR("crypto_sign() failed");
 		free(cap_sig);
@@ -489,7 +590,7 @@ int auth_user_token_new(auth_user_token_t *token, auth_payload_t *payload)
 #endif
 		randombytes_buf(token->token, sizeof token->token);
 	sodium_bin2hex(token->hextoken, AUTH_HEXLEN, token->token, sizeof token->token);
-	token->expires = htobe64((uint64_t)time(NULL) + config.handlers->usertoken_expires);
+	token->expires = htobe64((uint64_t)time(NULL) + auth_handler()->usertoken_expires);
 	DEBUG("token created: %s", token->hextoken);
 	return 0;
 }
@@ -618,7 +719,7 @@ static void auth_op_user_add(lc_message_t *msg)
 	}
 reply_to_sender:
 	auth_reply_code(&fields[repl], &p.senderkey, AUTH_OP_USER_ADD, code);
-	free(p.data);
+	auth_payload_free(&p);
 }
 
 static void auth_op_user_unlock(lc_message_t *msg)
@@ -644,7 +745,7 @@ static void auth_op_user_unlock(lc_message_t *msg)
 		perror("wire_pack_pre()");
 	else
 		auth_reply_code(&fields[repl], &p.senderkey, AUTH_OP_USER_UNLOCK, code);
-	free(p.data);
+	auth_payload_free(&p);
 	free(data.iov_base);
 }
 
@@ -709,44 +810,114 @@ static void auth_op_auth_service(lc_message_t *msg)
 reply_to_sender:
 	if (code)
 		auth_reply_code(&fields[repl], &p.senderkey, AUTH_OP_AUTH_SERV, code);
-	free(p.data);
+	auth_payload_free(&p);
 	free(data.iov_base);
 	free(cap.iov_base);
 	if (!fields[user].iov_len) free(userid.iov_base);
 }
 
-void init(config_t *c)
+const int module_abi = MODULE_ABI_VERSION;
+
+void *init(config_t *c, handler_t *h)
 {
+	auth_ctx_t *ctx;
 	TRACE("auth.so %s()", __func__);
 	if (c) config = *c;
 	DEBUG("I am the very model of a modern auth module");
-	auth_init();
+	if (!(ctx = calloc(1, sizeof(auth_ctx_t)))) return NULL;
+	ctx->handler = h;
+	if (!(ctx->lctx = auth_db_open(h))) {
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
 }
 
-void finit(void)
+static void auth_async_run(void *arg);
+
+/* the mail workers are only started once there is mail to send */
+static pool_t *auth_mail_pool(auth_ctx_t *ctx)
 {
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pool_t *pool;
+	if ((pool = __atomic_load_n(&ctx->mail, __ATOMIC_ACQUIRE))) return pool;
+	pthread_mutex_lock(&lock);
+	if (!(pool = ctx->mail)) {
+		pool = pool_create(AUTH_MAIL_WORKERS, AUTH_MAIL_QUEUE, auth_async_run, NULL);
+		__atomic_store_n(&ctx->mail, pool, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&lock);
+	return pool;
+}
+
+/* the core has cancelled anything still queued, so the workers finish those
+ * at once, and one already sending gives up after AUTH_MAIL_TIMEOUT_S */
+void finit(void *ctx)
+{
+	auth_ctx_t *actx = ctx;
 	TRACE("auth.so %s()", __func__);
-	auth_free();
+	if (actx->mail) pool_free(actx->mail);
+	lc_ctx_free(actx->lctx);
+	free(actx);
 }
 
-void handle_msg(lc_message_t *msg)
+void handle_msg(void *ctx, lc_message_t *msg)
 {
+	auth_ctx_t *saved = auth_ctx;
 	TRACE("auth.so %s()", __func__);
 	DEBUG("%zu bytes received", msg->len);
 	uint8_t opcode = ((uint8_t *)msg->data)[0];
 	uint8_t flags = ((uint8_t *)msg->data)[1];
 	DEBUG("opcode read: %u", opcode);
 	DEBUG("flags read: %u", flags);
+	auth_ctx = ctx;
 	switch (opcode) {
 		AUTH_OPCODES(AUTH_OPCODE_FUN)
 	default:
+		auth_count(STAT_ERRORS);
 		ERROR("Invalid auth opcode received: %u", opcode);
 	}
+	auth_ctx = saved;
 	DEBUG("handle_msg() - handler exiting");
 }
 
-void handle_err(int err)
+/* a mail worker is counted and timed as the request's handler */
+static void auth_async_run(void *arg)
+{
+	auth_async_t *a = arg;
+	if (!config.api->cancelled(a->req)) {
+		if (config.api->enter) config.api->enter(a->req);
+		handle_msg(a->ctx, a->msg);
+	}
+	config.api->complete(a->req, 0);
+	free(a);
+}
+
+/* adding a user waits on the mail server, so is queued for one of a few
+ * workers rather than holding up the core's threads.  Everything else, and a
+ * user added with the queue full, is quick enough to do here */
+void handle_async(void *ctx, lc_message_t *msg, module_req_t *req)
+{
+	auth_ctx_t *actx = ctx;
+	auth_async_t *a;
+	pool_t *pool;
+	TRACE("auth.so %s()", __func__);
+	if (msg->len && ((uint8_t *)msg->data)[0] == AUTH_OP_USER_ADD && !config.testmode
+	&& (pool = auth_mail_pool(actx)) && (a = calloc(1, sizeof(auth_async_t))))
+	{
+		a->ctx = actx;
+		a->msg = msg;
+		a->req = req;
+		if (!pool_push(pool, a)) return;
+		free(a);
+	}
+	handle_msg(ctx, msg);
+	config.api->complete(req, 0);
+}
+
+void handle_err(void *ctx, int err)
 {
+	(void)ctx;
 	TRACE("auth.so %s()", __func__);
 	DEBUG("handle_err() err=%i", err);
 }
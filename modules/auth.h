@@ -29,7 +29,7 @@
 
 #define AUTH_OPCODE_ENUM(code, name, text, f) name = code,
 #define AUTH_OPCODE_TEXT(code, name, text, f) case code: return text;
-#define AUTH_OPCODE_FUN(code, name, text, f) case code: f(msg); break;
+#define AUTH_OPCODE_FUN(code, name, text, f) case code: auth_op(code, f, msg); break;
 typedef enum {
 	AUTH_OPCODES(AUTH_OPCODE_ENUM)
 } auth_opcode_t;
@@ -60,6 +60,7 @@ struct auth_payload_s {
 	int		pre_count;
 	int		fieldcount;
 	void		*data;
+	int		pooled; /* data is a core pool buffer */
 	struct iovec	*pre;
 	struct iovec	*fields;
 };
@@ -100,5 +101,6 @@ uint8_t auth_user_token_use(struct iovec *token, struct iovec *pass);
 int auth_user_token_valid(auth_user_token_t *token);
 int auth_decode_packet(lc_message_t *msg, auth_payload_t *payload);
 int auth_decode_packet_key(lc_message_t *msg, auth_payload_t *payload, unsigned char *sk);
+void auth_payload_free(auth_payload_t *payload);
 
 #endif /* _LSDM_AUTH_H */
@@ -34,10 +34,28 @@ void handle_msg(lc_message_t *msg)
 	 */
 
 	lc_channel_unbind(chan_repl);
+	lc_channel_free(chan_repl);
 
 	DEBUG("message says '%.*s'", (int)msg->len, (char *)msg->data);
 }
 
+/* a batch shares one reply channel */
+void handle_msgv(lc_message_t *msgs[], int n)
+{
+	TRACE("echo.so %s()", __func__);
+
+	lc_ctx_t *lctx = lc_channel_ctx(msgs[0]->chan);
+	lc_socket_t *sock = lc_channel_socket(msgs[0]->chan);
+	lc_channel_t *chan_repl = lc_channel_new(lctx, "repl");
+	lc_channel_bind(sock, chan_repl);
+	for (int i = 0; i < n; i++) {
+		lc_msg_send(chan_repl, msgs[i]);
+		DEBUG("message says '%.*s'", (int)msgs[i]->len, (char *)msgs[i]->data);
+	}
+	lc_channel_unbind(chan_repl);
+	lc_channel_free(chan_repl);
+}
+
 void handle_err(int err)
 {
 	TRACE("echo.so %s()", __func__);
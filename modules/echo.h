@@ -9,6 +9,7 @@
 void init(void);
 void finit(void);
 void handle_msg(lc_message_t *msg);
+void handle_msgv(lc_message_t *msgs[], int n);
 void handle_err(int err);
 
 #endif /* _LSDM_ECHO_H */
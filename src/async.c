@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "async.h"
+#include "stats.h"
+
+/* requests still due a timeout are listed oldest first.  Expired and
+ * cancelled requests are unlisted but remain in flight until completed */
+struct async_s {
+	pthread_mutex_t	lock;
+	module_req_t *	head;
+	module_req_t *	tail;
+	void (*		msgfree)(lc_message_t *);
+	uint64_t	timeout;
+	unsigned int	max;
+	unsigned int	inflight;
+	int		stat;
+	int		orphan;	/* freed, waiting for the last completion */
+};
+
+struct module_req_s {
+	module_req_t *	prev;
+	module_req_t *	next;
+	async_t *	async;
+	lc_message_t	msg;
+	uint64_t	start;
+	int		listed;
+	int		cancelled;
+	int		overdue;	/* reported by async_overdue() */
+	unsigned char	data[];
+};
+
+static uint64_t async_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* call with lock held */
+static void async_unlist(async_t *a, module_req_t *req)
+{
+	if (!req->listed) return;
+	if (req->prev) req->prev->next = req->next;
+	else a->head = req->next;
+	if (req->next) req->next->prev = req->prev;
+	else a->tail = req->prev;
+	req->prev = req->next = NULL;
+	req->listed = 0;
+}
+
+async_t *async_create(unsigned int max, uint64_t timeout, int stat,
+		void (*msgfree)(lc_message_t *))
+{
+	async_t *a;
+	if (!max || !msgfree) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!(a = calloc(1, sizeof(async_t)))) return NULL;
+	pthread_mutex_init(&a->lock, NULL);
+	a->msgfree = msgfree;
+	a->timeout = timeout;
+	a->max = max;
+	a->stat = stat;
+	return a;
+}
+
+module_req_t *async_start(async_t *a, lc_message_t *msg, int copy, uint64_t now)
+{
+	module_req_t *req;
+	if (__atomic_load_n(&a->inflight, __ATOMIC_RELAXED) >= a->max) {
+		errno = EBUSY;
+		return NULL;
+	}
+	if (!(req = calloc(1, sizeof(module_req_t) + ((copy) ? msg->len : 0)))) return NULL;
+	req->async = a;
+	req->msg = *msg;
+	req->start = now;
+	if (copy) req->msg.data = memcpy(req->data, msg->data, msg->len);
+	pthread_mutex_lock(&a->lock);
+	if (a->inflight >= a->max) {
+		pthread_mutex_unlock(&a->lock);
+		free(req);
+		errno = EBUSY;
+		return NULL;
+	}
+	a->inflight++;
+	req->prev = a->tail;
+	if (a->tail) a->tail->next = req;
+	else a->head = req;
+	a->tail = req;
+	req->listed = 1;
+	stats_inflight(a->stat, a->inflight);
+	pthread_mutex_unlock(&a->lock);
+	return req;
+}
+
+lc_message_t *async_msg(module_req_t *req)
+{
+	return &req->msg;
+}
+
+void async_complete(module_req_t *req, int err)
+{
+	async_t *a = req->async;
+	void (*msgfree)(lc_message_t *) = a->msgfree;
+	int last;
+	stats_time(a->stat, STATS_OP_MSG, async_now() - req->start);
+	if (err) stats_add(a->stat, STAT_ERRORS, 1);
+	pthread_mutex_lock(&a->lock);
+	async_unlist(a, req);
+	a->inflight--;
+	stats_inflight(a->stat, a->inflight);
+	last = (a->orphan && !a->inflight);
+	pthread_mutex_unlock(&a->lock);
+	msgfree(&req->msg);
+	free(req);
+	if (last) {
+		pthread_mutex_destroy(&a->lock);
+		free(a);
+	}
+}
+
+int async_cancelled(module_req_t *req)
+{
+	return __atomic_load_n(&req->cancelled, __ATOMIC_RELAXED);
+}
+
+void async_enter(module_req_t *req)
+{
+	stats_enter(req->async->stat);
+}
+
+int async_expire(async_t *a, uint64_t now)
+{
+	module_req_t *req;
+	int n = 0;
+	if (!a->timeout) return 0;
+	pthread_mutex_lock(&a->lock);
+	while ((req = a->head) && req->start + a->timeout < now) {
+		async_unlist(a, req);
+		__atomic_store_n(&req->cancelled, 1, __ATOMIC_RELAXED);
+		n++;
+	}
+	pthread_mutex_unlock(&a->lock);
+	if (n) stats_add(a->stat, STAT_DROPS, n);
+	return n;
+}
+
+int async_overdue(async_t *a, uint64_t now, uint64_t budget,
+		void (*report)(void *arg, lc_message_t *msg, uint64_t elapsed), void *arg)
+{
+	module_req_t *req;
+	int n = 0;
+	pthread_mutex_lock(&a->lock);
+	for (req = a->head; req && req->start + budget < now; req = req->next, n++) {
+		if (req->overdue) continue;
+		req->overdue = 1;
+		report(arg, &req->msg, now - req->start);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return n;
+}
+
+void async_cancel(async_t *a)
+{
+	module_req_t *req;
+	pthread_mutex_lock(&a->lock);
+	while ((req = a->head)) {
+		async_unlist(a, req);
+		__atomic_store_n(&req->cancelled, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+unsigned int async_inflight(async_t *a)
+{
+	unsigned int n;
+	pthread_mutex_lock(&a->lock);
+	n = a->inflight;
+	pthread_mutex_unlock(&a->lock);
+	return n;
+}
+
+void async_free(async_t *a)
+{
+	int inflight;
+	if (!a) return;
+	pthread_mutex_lock(&a->lock);
+	inflight = a->inflight;
+	a->orphan = 1;
+	pthread_mutex_unlock(&a->lock);
+	if (inflight) return;
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
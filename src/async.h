@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_ASYNC_H
+#define _LSDM_ASYNC_H 1
+
+#include <librecast/types.h>
+#include <stdint.h>
+#include "config.h"
+
+/* Requests a handler's module has accepted through handle_async() but not yet
+ * completed.  Each request holds its message until the module calls
+ * async_complete(), from any thread.  A request not completed within the
+ * timeout is expired: it is counted as a drop and marked cancelled, but the
+ * module must still complete it */
+typedef struct async_s async_t;
+
+/* track up to max requests for stats slot stat, expiring them after timeout
+ * nanoseconds (0 for never).  msgfree releases a request's message.  Returns
+ * NULL on error */
+async_t *async_create(unsigned int max, uint64_t timeout, int stat,
+		void (*msgfree)(lc_message_t *));
+
+/* start a request for msg, received at now, which now belongs to the request.
+ * If copy is set the payload is copied, as the caller will reuse its buffer.
+ * Returns NULL, with msg untouched, if max requests are in flight (EBUSY) or
+ * on error */
+module_req_t *async_start(async_t *a, lc_message_t *msg, int copy, uint64_t now);
+
+/* the request's message, valid until it is completed */
+lc_message_t *async_msg(module_req_t *req);
+
+/* finish req, err being 0 or an errno.  Exported to modules through config.api */
+void	async_complete(module_req_t *req, int err);
+
+/* non-zero once req has expired or been cancelled.  Exported to modules */
+int	async_cancelled(module_req_t *req);
+
+/* count and time the calling thread's work for req's handler.  Exported to
+ * modules */
+void	async_enter(module_req_t *req);
+
+/* expire requests started more than the timeout before now.  Returns the
+ * number expired */
+int	async_expire(async_t *a, uint64_t now);
+
+/* call report for each request started more than budget before now, and not
+ * yet expired, the first time it is found so.  The message is valid only for
+ * the call.  Returns the number over budget, reported before or not */
+int	async_overdue(async_t *a, uint64_t now, uint64_t budget,
+		void (*report)(void *arg, lc_message_t *msg, uint64_t elapsed), void *arg);
+
+/* cancel every request in flight */
+void	async_cancel(async_t *a);
+
+unsigned int async_inflight(async_t *a);
+
+/* free a.  If requests are still in flight it is freed by the last of them to
+ * complete instead */
+void	async_free(async_t *a);
+
+#endif /* _LSDM_ASYNC_H */
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "bufpool.h"
+#include "log.h"
+
+/* Free buffers form a lock-free stack threaded through next[].  The head
+ * packs a generation count above the index of the top buffer so a pop racing
+ * with a pop and push of the same buffer can't succeed (ABA) */
+#define BUFPOOL_NONE UINT32_MAX
+#define BUFPOOL_HEAD(gen, idx) (((uint64_t)(gen) << 32) | (idx))
+#define BUFPOOL_IDX(head) ((uint32_t)(head))
+#define BUFPOOL_GEN(head) ((uint32_t)((head) >> 32))
+
+struct bufpool_s {
+	uint64_t	head;
+	size_t		avail;
+	unsigned char *	base;
+	uint32_t *	next;
+	size_t		count;
+	size_t		size;
+	size_t		maplen;
+};
+
+void *bufpool_get(bufpool_t *pool)
+{
+	uint64_t head, newhead;
+	uint32_t idx;
+	head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	do {
+		if ((idx = BUFPOOL_IDX(head)) == BUFPOOL_NONE) return NULL;
+		newhead = BUFPOOL_HEAD(BUFPOOL_GEN(head) + 1,
+				__atomic_load_n(&pool->next[idx], __ATOMIC_RELAXED));
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, newhead, 1,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	__atomic_sub_fetch(&pool->avail, 1, __ATOMIC_RELAXED);
+	return pool->base + (size_t)idx * pool->size;
+}
+
+void bufpool_put(bufpool_t *pool, void *buf)
+{
+	uint64_t head, newhead;
+	uint32_t idx = ((unsigned char *)buf - pool->base) / pool->size;
+	head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	do {
+		__atomic_store_n(&pool->next[idx], BUFPOOL_IDX(head), __ATOMIC_RELAXED);
+		newhead = BUFPOOL_HEAD(BUFPOOL_GEN(head) + 1, idx);
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, newhead, 1,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	__atomic_add_fetch(&pool->avail, 1, __ATOMIC_RELAXED);
+}
+
+size_t bufpool_size(bufpool_t *pool)
+{
+	return pool->size;
+}
+
+size_t bufpool_avail(bufpool_t *pool)
+{
+	return __atomic_load_n(&pool->avail, __ATOMIC_RELAXED);
+}
+
+void bufpool_free(bufpool_t *pool)
+{
+	if (!pool) return;
+	munmap(pool->base, pool->maplen);
+	free(pool->next);
+	free(pool);
+}
+
+bufpool_t *bufpool_create(size_t count, size_t size, int flags)
+{
+	bufpool_t *pool;
+	const int prot = PROT_READ | PROT_WRITE;
+	const int mapflags = MAP_PRIVATE | MAP_ANONYMOUS;
+	if (!count || !size || count >= BUFPOOL_NONE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!(pool = calloc(1, sizeof(bufpool_t)))) return NULL;
+	if (!(pool->next = calloc(count, sizeof(uint32_t)))) {
+		free(pool);
+		return NULL;
+	}
+	pool->count = pool->avail = count;
+	pool->size = (size + BUFPOOL_ALIGN - 1) & ~(size_t)(BUFPOOL_ALIGN - 1);
+	pool->maplen = count * pool->size;
+	pool->base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (flags & BUFPOOL_HUGEPAGES) {
+		const size_t huge = 2 * 1024 * 1024;
+		size_t hugelen = (pool->maplen + huge - 1) & ~(huge - 1);
+		pool->base = mmap(NULL, hugelen, prot, mapflags | MAP_HUGETLB, -1, 0);
+		if (pool->base != MAP_FAILED) pool->maplen = hugelen;
+		else DEBUG("no hugetlb pages for buffer pool, using transparent hugepages");
+	}
+#endif
+	if (pool->base == MAP_FAILED) {
+		pool->base = mmap(NULL, pool->maplen, prot, mapflags, -1, 0);
+		if (pool->base == MAP_FAILED) {
+			free(pool->next);
+			free(pool);
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if (flags & BUFPOOL_HUGEPAGES) madvise(pool->base, pool->maplen, MADV_HUGEPAGE);
+#endif
+	}
+	for (size_t i = 0; i < count; i++) {
+		pool->next[i] = (i + 1 < count) ? (uint32_t)(i + 1) : BUFPOOL_NONE;
+	}
+	pool->head = BUFPOOL_HEAD(0, 0);
+	return pool;
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_BUFPOOL_H
+#define _LSDM_BUFPOOL_H 1
+
+#include <stddef.h>
+
+/* buffers are aligned to, and sized in multiples of, a cache line */
+#define BUFPOOL_ALIGN 64
+
+/* flags for bufpool_create() */
+#define BUFPOOL_HUGEPAGES 0x1
+
+typedef struct bufpool_s bufpool_t;
+
+/* create pool of count buffers of (at least) size bytes in one mapping.  With
+ * BUFPOOL_HUGEPAGES, try hugetlb pages first then transparent hugepages.
+ * Returns NULL on error */
+bufpool_t *bufpool_create(size_t count, size_t size, int flags);
+
+/* take a buffer from the pool, without locking.  Returns NULL if exhausted */
+void	*bufpool_get(bufpool_t *pool);
+
+/* return buf to the pool it came from */
+void	bufpool_put(bufpool_t *pool, void *buf);
+
+/* usable size of each buffer */
+size_t	bufpool_size(bufpool_t *pool);
+
+/* number of buffers not currently taken */
+size_t	bufpool_avail(bufpool_t *pool);
+
+/* unmap the pool.  All buffers must have been returned */
+void	bufpool_free(bufpool_t *pool);
+
+#endif /* _LSDM_BUFPOOL_H */
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chanidx.h"
+
+/* open addressing with linear probing, at most half full, so a lookup is a
+ * hash and a probe or two.  An empty slot has no handler */
+#define CHANIDX_MIN 16
+
+typedef struct chanidx_slot_s chanidx_slot_t;
+struct chanidx_slot_s {
+	struct in6_addr	grp;
+	void *		handler;
+	void *		chan;
+};
+
+struct chanidx_s {
+	chanidx_slot_t *slots;
+	size_t		mask;
+	size_t		count;
+	size_t		max;
+};
+
+/* group addresses are usually hashes already, but configured ones such as
+ * ff1e::1, ff1e::2 differ only in the last bits, so mix both halves */
+static size_t chanidx_hash(const struct in6_addr *grp)
+{
+	uint64_t w[2];
+	memcpy(w, grp, sizeof w);
+	w[0] ^= w[1] * UINT64_C(0x9e3779b97f4a7c15);
+	w[0] ^= w[0] >> 29;
+	w[0] *= UINT64_C(0xbf58476d1ce4e5b9);
+	return (size_t)(w[0] ^ (w[0] >> 32));
+}
+
+chanidx_t *chanidx_create(size_t n)
+{
+	chanidx_t *idx;
+	size_t size = CHANIDX_MIN;
+	while (size < n * 2) size <<= 1;
+	if (!(idx = calloc(1, sizeof(chanidx_t)))) return NULL;
+	if (!(idx->slots = calloc(size, sizeof(chanidx_slot_t)))) {
+		free(idx);
+		return NULL;
+	}
+	idx->mask = size - 1;
+	idx->max = size / 2;
+	return idx;
+}
+
+int chanidx_add(chanidx_t *idx, const struct in6_addr *grp, void *handler, void *chan)
+{
+	chanidx_slot_t *slot;
+	if (!handler) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (idx->count == idx->max) {
+		errno = ENOSPC;
+		return -1;
+	}
+	for (size_t i = chanidx_hash(grp); ; i++) {
+		slot = &idx->slots[i & idx->mask];
+		if (!slot->handler) break;
+		if (!memcmp(&slot->grp, grp, sizeof(struct in6_addr))) {
+			errno = EEXIST;
+			return -1;
+		}
+	}
+	slot->grp = *grp;
+	slot->handler = handler;
+	slot->chan = chan;
+	idx->count++;
+	return 0;
+}
+
+void *chanidx_get(const chanidx_t *idx, const struct in6_addr *grp, void **chan)
+{
+	const chanidx_slot_t *slot;
+	for (size_t i = chanidx_hash(grp); ; i++) {
+		slot = &idx->slots[i & idx->mask];
+		if (!slot->handler) return NULL;
+		if (!memcmp(&slot->grp, grp, sizeof(struct in6_addr))) break;
+	}
+	if (chan) *chan = slot->chan;
+	return slot->handler;
+}
+
+size_t chanidx_count(const chanidx_t *idx)
+{
+	return idx->count;
+}
+
+void chanidx_free(chanidx_t *idx)
+{
+	if (!idx) return;
+	free(idx->slots);
+	free(idx);
+}
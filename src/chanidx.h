@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_CHANIDX_H
+#define _LSDM_CHANIDX_H 1
+
+#include <netinet/in.h>
+#include <stddef.h>
+
+/* Maps the group address a datagram was sent to onto the handler and channel
+ * serving it, for sockets joined to more than one channel.  An index is built
+ * once and then only read, so lookups take no lock */
+typedef struct chanidx_s chanidx_t;
+
+/* create an index with room for n channels.  Returns NULL on error */
+chanidx_t *chanidx_create(size_t n);
+
+/* index channel chan of handler, on group grp.  Returns -1 on error, ENOSPC if
+ * the index is full or EEXIST if grp is already indexed */
+int	chanidx_add(chanidx_t *idx, const struct in6_addr *grp, void *handler, void *chan);
+
+/* handler serving grp, setting *chan to its channel, or NULL if none */
+void	*chanidx_get(const chanidx_t *idx, const struct in6_addr *grp, void **chan);
+
+/* channels indexed */
+size_t	chanidx_count(const chanidx_t *idx);
+
+void	chanidx_free(chanidx_t *idx);
+
+#endif /* _LSDM_CHANIDX_H */
@@ -1,9 +1,17 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 /* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
 
+#define _GNU_SOURCE /* dlmopen(), dlinfo(), mkostemp() */
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "config.h"
 #include "log.h"
@@ -14,13 +22,83 @@ config_t config = {
 	.loglevel = 0,
 	.modules = 0,
 };
+config_t *config_parsing = &config;
+extern int lineno;
 
-static void config_free_handlers(void) {
+/* handlers replaced by a reload.  Modules may still refer to them */
+static handler_t *retired;
+
+/* legacy modules may share globals, so their init() is never run in parallel */
+static pthread_mutex_t config_init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* nor is that of handlers sharing a context module's handle, and so its
+ * globals.  Locks are picked by handle, so unrelated modules rarely wait */
+#define CONFIG_INIT_LOCKS 16
+static pthread_mutex_t config_init_locks[CONFIG_INIT_LOCKS];
+static pthread_once_t config_init_once = PTHREAD_ONCE_INIT;
+
+static void config_init_locks_create(void)
+{
+	for (int i = 0; i < CONFIG_INIT_LOCKS; i++) pthread_mutex_init(&config_init_locks[i], NULL);
+}
+
+static uint64_t config_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define CONFIG_DROP_NAME(code, id, text) if (!strcmp(text, drop)) return code;
+int config_drop(const char *drop)
+{
+	CONFIG_DROPS(CONFIG_DROP_NAME)
+	return -1;
+}
+#undef CONFIG_DROP_NAME
+
+#define CONFIG_ENGINE_NAME(code, id, text) if (!strcmp(text, engine)) return code;
+int config_engine(const char *engine)
+{
+	CONFIG_ENGINES(CONFIG_ENGINE_NAME)
+	return -1;
+}
+#undef CONFIG_ENGINE_NAME
+
+#define CONFIG_POLLMODE_NAME(code, id, text) if (!strcmp(text, pollmode)) return code;
+int config_pollmode(const char *pollmode)
+{
+	CONFIG_POLLMODES(CONFIG_POLLMODE_NAME)
+	return -1;
+}
+#undef CONFIG_POLLMODE_NAME
+
+#define CONFIG_RATEKEY_NAME(code, id, text) if (!strcmp(text, ratekey)) return code;
+int config_ratekey(const char *ratekey)
+{
+	CONFIG_RATEKEYS(CONFIG_RATEKEY_NAME)
+	return -1;
+}
+#undef CONFIG_RATEKEY_NAME
+
+#define CONFIG_SCHED_NAME(code, id, text) if (!strcmp(text, sched)) return code;
+int config_sched(const char *sched)
+{
+	CONFIG_SCHEDS(CONFIG_SCHED_NAME)
+	return -1;
+}
+#undef CONFIG_SCHED_NAME
+
+void config_handlers_free(handler_t *handlers)
+{
 	handler_t *h, *p;
-	p = config.handlers;
+	p = handlers;
 	while (p) {
 		free(p->channel);
 		free(p->channelhash);
+		for (int i = 0; i < p->nchannels; i++) free(p->channels[i]);
+		free(p->channels);
+		free(p->cpuset);
 		free(p->dbname);
 		free(p->dbpath);
 		free(p->key_private);
@@ -31,7 +109,83 @@ static void config_free_handlers(void) {
 		p = p->next;
 		free(h);
 	}
-	config.handlers = NULL;
+}
+
+void config_handlers_swap(handler_t *handlers)
+{
+	handler_t *h = config.handlers;
+	while (h && h->next) h = h->next;
+	if (h) {
+		h->next = retired;
+		retired = config.handlers;
+	}
+	__atomic_store_n(&config.handlers, handlers, __ATOMIC_RELEASE);
+}
+
+void config_handlers_release(int (*inuse)(handler_t *h))
+{
+	handler_t **p = &retired, *h;
+	while ((h = *p)) {
+		if (inuse(h)) {
+			p = &h->next;
+			continue;
+		}
+		*p = h->next;
+		h->next = NULL;
+		config_handlers_free(h);
+	}
+}
+
+static int config_strcmp(const char *a, const char *b)
+{
+	if (!a || !b) return (a != b);
+	return strcmp(a, b);
+}
+
+static int config_channels_cmp(const handler_t *a, const handler_t *b)
+{
+	if (a->nchannels != b->nchannels) return 1;
+	for (int i = 0; i < a->nchannels; i++) {
+		if (config_strcmp(a->channels[i], b->channels[i])) return 1;
+	}
+	return 0;
+}
+
+int config_handler_cmp(const handler_t *a, const handler_t *b)
+{
+	return config_strcmp(a->channel, b->channel)
+		|| config_channels_cmp(a, b)
+		|| config_strcmp(a->channelhash, b->channelhash)
+		|| config_strcmp(a->cpuset, b->cpuset)
+		|| config_strcmp(a->dbname, b->dbname)
+		|| config_strcmp(a->dbpath, b->dbpath)
+		|| config_strcmp(a->key_private, b->key_private)
+		|| config_strcmp(a->key_public, b->key_public)
+		|| config_strcmp(a->module, b->module)
+		|| config_strcmp(a->scope, b->scope)
+		|| a->usertoken_expires != b->usertoken_expires
+		|| a->token_duration != b->token_duration
+		|| a->port != b->port
+		|| a->batch != b->batch
+		|| a->deadline_ms != b->deadline_ms
+		|| a->dedup_ms != b->dedup_ms
+		|| a->drop != b->drop
+		|| a->inflight != b->inflight
+		|| a->lazy != b->lazy
+		|| a->poll != b->poll
+		|| a->poll_window_us != b->poll_window_us
+		|| a->queue != b->queue
+		|| a->ratelimit != b->ratelimit
+		|| a->ratelimit_burst != b->ratelimit_burst
+		|| a->ratelimit_by != b->ratelimit_by
+		|| a->rcvbuf != b->rcvbuf
+		|| a->schedule != b->schedule
+		|| a->sndbuf != b->sndbuf
+		|| a->timeout_ms != b->timeout_ms
+		|| a->watchdog_ms != b->watchdog_ms
+		|| a->watchdog_shed != b->watchdog_shed
+		|| memcmp(a->weight, b->weight, sizeof a->weight)
+		|| memcmp(a->opclass, b->opclass, sizeof a->opclass);
 }
 
 void config_free(void)
@@ -40,7 +194,11 @@ void config_free(void)
 	free(config.configfile);
 	free(config.key);
 	free(config.modpath);
-	config_free_handlers();
+	free(config.latencyfile);
+	config_handlers_free(config.handlers);
+	config.handlers = NULL;
+	config_handlers_free(retired);
+	retired = NULL;
 }
 
 int config_include(char *configfile)
@@ -60,47 +218,337 @@ int config_include(char *configfile)
 	return ret;
 }
 
-int config_modules_load(void)
+static int config_module_legacy(module_t *mod, int fresh)
+{
+	void *handle;
+	/* percore handlers each get their own copy of the module's globals */
+	if (config.engine == ENGINE_PERCORE && !fresh) {
+		if ((handle = dlmopen(LM_ID_NEWLM, mod->name, RTLD_LAZY))) {
+			dlclose(mod->handle);
+			mod->handle = handle;
+		}
+		else {
+			ERROR("no namespace for %s, percore handlers share one instance: '%s'",
+				mod->name, dlerror());
+		}
+	}
+	*(void **)(&mod->handle_msg) = dlsym(mod->handle, "handle_msg");
+	if (!mod->handle_msg) return -1;
+	*(void **)(&mod->handle_msgv) = dlsym(mod->handle, "handle_msgv");
+	*(void **)(&mod->init) = dlsym(mod->handle, "init");
+	*(void **)(&mod->finit) = dlsym(mod->handle, "finit");
+	*(void **)(&mod->handle_err) = dlsym(mod->handle, "handle_err");
+	return 0;
+}
+
+/* a module with contexts keeps its state there, so one copy serves all */
+static int config_module_ctx(module_t *mod)
+{
+	*(void **)(&mod->handle_msg_ctx) = dlsym(mod->handle, "handle_msg");
+	if (!mod->handle_msg_ctx) return -1;
+	*(void **)(&mod->handle_msgv_ctx) = dlsym(mod->handle, "handle_msgv");
+	*(void **)(&mod->init_ctx) = dlsym(mod->handle, "init");
+	*(void **)(&mod->finit_ctx) = dlsym(mod->handle, "finit");
+	*(void **)(&mod->handle_err_ctx) = dlsym(mod->handle, "handle_err");
+	*(void **)(&mod->handle_async) = dlsym(mod->handle, "handle_async");
+	return 0;
+}
+
+static int config_module_init(module_t *mod, handler_t *h)
+{
+	pthread_mutex_t *lock;
+	if (mod->abi == MODULE_ABI_LEGACY) {
+		if (!mod->init) return 0;
+		pthread_mutex_lock(&config_init_lock);
+		mod->init(&config);
+		pthread_mutex_unlock(&config_init_lock);
+		return 0;
+	}
+	if (!mod->init_ctx) return 0;
+	pthread_once(&config_init_once, config_init_locks_create);
+	lock = &config_init_locks[((uintptr_t)mod->handle >> 4) % CONFIG_INIT_LOCKS];
+	pthread_mutex_lock(lock);
+	mod->ctx = mod->init_ctx(&config, h);
+	pthread_mutex_unlock(lock);
+	if (!mod->ctx) {
+		ERROR("%s failed to initialise for channel '%s'", mod->name, h->channel);
+		return -1;
+	}
+	return 0;
+}
+
+/* the path handle was loaded from, as found by the dynamic linker */
+static char *config_module_path(void *handle)
+{
+	struct link_map *lm;
+	if (dlinfo(handle, RTLD_DI_LINKMAP, &lm) == -1) return NULL;
+	return strdup(lm->l_name);
+}
+
+/* load the module at file again, as an object of its own.  The dynamic linker
+ * would hand back the loaded one for the same path, so it is copied to a
+ * temporary one first, unlinked once open.  The copy shares the process's
+ * libraries, unlike one in a namespace of its own */
+static void *config_module_copy(const char *file)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	char path[PATH_MAX], buf[BUFSIZ];
+	void *copy = NULL;
+	ssize_t len;
+	int in, out;
+	snprintf(path, sizeof path, "%s/lsdbd-module-XXXXXX", (tmpdir) ? tmpdir : P_tmpdir);
+	if ((in = open(file, O_RDONLY | O_CLOEXEC)) == -1) {
+		ERROR("unable to open '%s': %s", file, strerror(errno));
+		return NULL;
+	}
+	if ((out = mkostemp(path, O_CLOEXEC)) == -1) {
+		ERROR("unable to copy '%s': %s", file, strerror(errno));
+		close(in);
+		return NULL;
+	}
+	while ((len = read(in, buf, sizeof buf)) > 0 && write(out, buf, len) == len);
+	if (len) ERROR("unable to copy '%s' to '%s': %s", file, path, strerror(errno));
+	close(in);
+	if (!close(out) && !len) copy = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
+	unlink(path);
+	return copy;
+}
+
+/* open mod's module or, given from, a new copy of from's.  Given peer as well,
+ * a copy already made of the same module, that is shared instead */
+static void *config_module_dlopen(module_t *mod, module_t *peer, module_t *from)
+{
+	struct link_map *lm;
+	if (!from) return dlopen(mod->name, RTLD_LAZY);
+	if (!peer) return (from->path) ? config_module_copy(from->path) : NULL;
+	if (dlinfo(peer->handle, RTLD_DI_LINKMAP, &lm) == -1) return NULL;
+	return dlopen(lm->l_name, RTLD_LAZY | RTLD_NOLOAD);
+}
+
+static int config_module_open(module_t *mod, handler_t *h, module_t *peer, module_t *from)
+{
+	const uint64_t start = config_now();
+	uint64_t loaded;
+	int *abi, ret;
+	DEBUG("loading module '%s'", h->module);
+	memset(mod, 0, sizeof(module_t));
+	mod->name = h->module;
+	mod->handler = h;
+	if (!(mod->handle = config_module_dlopen(mod, peer, from))) {
+		DEBUG("failed to load %s: '%s'", mod->name, dlerror());
+		memset(mod, 0, sizeof(module_t));
+		return -1;
+	}
+	/* a copy is found at its original's path */
+	mod->path = (from) ? strdup(from->path) : config_module_path(mod->handle);
+	mod->abi = ((abi = dlsym(mod->handle, "module_abi"))) ? *abi : MODULE_ABI_LEGACY;
+	if (mod->abi == MODULE_ABI_LEGACY) ret = config_module_legacy(mod, (from != NULL));
+	else if (mod->abi == MODULE_ABI_VERSION) ret = config_module_ctx(mod);
+	else {
+		ERROR("%s has module ABI %i, expected %i", mod->name, mod->abi, MODULE_ABI_VERSION);
+		ret = -1;
+	}
+	loaded = config_now();
+	if (!ret) ret = config_module_init(mod, h);
+	__atomic_add_fetch(&config.timing.dlopen, loaded - start, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&config.timing.init, config_now() - loaded, __ATOMIC_RELAXED);
+	if (ret) {
+		dlclose(mod->handle);
+		free(mod->path);
+		memset(mod, 0, sizeof(module_t));
+		return -1;
+	}
+	DEBUG("%s loaded (ABI %i) for channel '%s' in %.1fms", mod->name, mod->abi,
+			h->channel, (config_now() - start) / 1e6);
+	return 0;
+}
+
+/* load module for handler h.  Returns -1 if it can't be loaded, has no
+ * handle_msg() or an ABI we don't know, leaving mod zeroed */
+int config_module_load(module_t *mod, handler_t *h)
+{
+	return config_module_open(mod, h, NULL, NULL);
+}
+
+module_t *config_module_swap(module_t *mod, module_t *peer)
+{
+	module_t *next;
+	if (!(next = malloc(sizeof(module_t)))) return NULL;
+	if (config_module_open(next, mod->handler, peer, mod) == -1) {
+		free(next);
+		return NULL;
+	}
+	next->prev = mod;
+	return next;
+}
+
+module_t *config_module_enter(module_t **slot)
 {
-	int i = 0;
 	module_t *mod;
+	for (;;) {
+		mod = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&mod->calls, 1, __ATOMIC_SEQ_CST);
+		/* a swap that missed our count has replaced it, try the new one */
+		if (__atomic_load_n(slot, __ATOMIC_SEQ_CST) == mod) return mod;
+		__atomic_sub_fetch(&mod->calls, 1, __ATOMIC_RELEASE);
+	}
+}
+
+void config_module_leave(module_t *mod)
+{
+	__atomic_sub_fetch(&mod->calls, 1, __ATOMIC_RELEASE);
+}
+
+void config_module_wait(module_t *mod)
+{
+	while (__atomic_load_n(&mod->calls, __ATOMIC_SEQ_CST)) usleep(100);
+}
+
+void config_module_free(module_t *mod)
+{
+	module_t *prev;
+	for (; mod && mod->prev; mod = prev) {
+		prev = mod->prev;
+		free(mod);
+	}
+}
+
+void config_module_defer(module_t *mod, handler_t *h)
+{
+	memset(mod, 0, sizeof(module_t));
+	mod->name = h->module;
+	mod->handler = h;
+	mod->lazy = 1;
+}
+
+/* unload mod.  A legacy module's finit() is only called if finit is set, as
+ * other handlers may share its globals.  A context always belongs to mod */
+void config_module_unload(module_t *mod, int finit)
+{
+	module_t *prev = mod->prev;
+	if (!mod->handle) return;
+	if (mod->abi == MODULE_ABI_LEGACY) {
+		if (finit && mod->finit) mod->finit();
+	}
+	else if (mod->finit_ctx) mod->finit_ctx(mod->ctx);
+	dlclose(mod->handle);
+	free(mod->path);
+	memset(mod, 0, sizeof(module_t));
+	mod->prev = prev;
+}
+
+void config_module_msg(module_t *mod, lc_message_t *msg)
+{
+	if (mod->abi == MODULE_ABI_LEGACY) mod->handle_msg(msg);
+	else mod->handle_msg_ctx(mod->ctx, msg);
+}
+
+int config_module_vectored(module_t *mod)
+{
+	return (mod->abi == MODULE_ABI_LEGACY) ? !!mod->handle_msgv : !!mod->handle_msgv_ctx;
+}
+
+void config_module_msgv(module_t *mod, lc_message_t *msgs[], int n)
+{
+	if (mod->abi == MODULE_ABI_LEGACY && mod->handle_msgv) mod->handle_msgv(msgs, n);
+	else if (mod->abi != MODULE_ABI_LEGACY && mod->handle_msgv_ctx)
+		mod->handle_msgv_ctx(mod->ctx, msgs, n);
+	else for (int i = 0; i < n; i++) config_module_msg(mod, msgs[i]);
+}
+
+void config_module_err(module_t *mod, int err)
+{
+	if (mod->abi == MODULE_ABI_LEGACY) {
+		if (mod->handle_err) mod->handle_err(err);
+	}
+	else if (mod->handle_err_ctx) mod->handle_err_ctx(mod->ctx, err);
+}
+
+/* modules left to load, shared by the loader threads */
+typedef struct config_loader_s config_loader_t;
+struct config_loader_s {
+	handler_t **	handlers;
+	int		count;
+	int		next;
+	int		loaded;
+	int		deferred;
+};
+
+static void *config_modules_loader(void *arg)
+{
+	config_loader_t *l = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED)) < l->count) {
+		if (l->handlers[i]->lazy) {
+			config_module_defer(&config.mods[i], l->handlers[i]);
+			__atomic_add_fetch(&l->deferred, 1, __ATOMIC_RELAXED);
+		}
+		else if (config_module_load(&config.mods[i], l->handlers[i]) == 0)
+			__atomic_add_fetch(&l->loaded, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* load every handler's module, on config.loadthreads threads (default one
+ * per cpu), into config.mods in handler order.  Lazy handlers are only set up
+ * to load later.  A module that fails leaves its slot zeroed.  Returns the
+ * number loaded or deferred */
+int config_modules_load(void)
+{
+	const uint64_t start = config_now();
+	config_loader_t l = {0};
+	pthread_t *threads = NULL;
+	int n = 0, eager = 0, nthreads;
 
 	TRACE("%s()", __func__);
 	if (!config.modules) return 0;
-	mod = config.mods = calloc(config.modules, sizeof(module_t));
-	for (handler_t *h = config.handlers; h; h = h->next) {
+	config.mods = calloc(config.modules, sizeof(module_t));
+	l.handlers = calloc(config.modules, sizeof(handler_t *));
+	if (!config.mods || !l.handlers) {
+		free(l.handlers);
+		return 0;
+	}
+	for (handler_t *h = config.handlers; h && n < config.modules; h = h->next) {
 		if (!h->module) continue;
-		DEBUG("loading module '%s'", h->module);
-		mod->name = h->module;
-		mod->handle = dlopen(mod->name, RTLD_LAZY);
-		if (mod->handle) {
-			DEBUG("%s loaded", mod->name);
-		}
-		else {
-			DEBUG("failed to load %s: '%s'", mod->name, dlerror());
-			continue;
+		l.handlers[n++] = h;
+		if (!h->lazy) eager++;
+	}
+	l.count = n;
+	nthreads = (config.loadthreads > 0) ? config.loadthreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > eager) nthreads = eager;
+	if (nthreads < 1) nthreads = 1;
+	/* this thread is one of them */
+	if (nthreads > 1 && (threads = calloc(nthreads - 1, sizeof(pthread_t)))) {
+		for (int i = 0; i < nthreads - 1; i++) {
+			if (!pthread_create(&threads[i], NULL, config_modules_loader, &l)) continue;
+			nthreads = i + 1;
+			break;
 		}
-		*(void **)(&mod->handle_msg) = dlsym(mod->handle, "handle_msg");
-		if (!mod->handle_msg) continue;
-		if ((*(void **)(&mod->init) = dlsym(mod->handle, "init"))) mod->init(&config);
-		*(void **)(&mod->finit) = dlsym(mod->handle, "finit");
-		*(void **)(&mod->handle_err) = dlsym(mod->handle, "handle_err");
-		mod++; i++;
 	}
-	return i;
+	else nthreads = 1;
+	config_modules_loader(&l);
+	for (int i = 0; i < nthreads - 1; i++) pthread_join(threads[i], NULL);
+	free(threads);
+	free(l.handlers);
+	config.timing.load = config_now() - start;
+	config.timing.loaded = l.loaded;
+	config.timing.deferred = l.deferred;
+	config.timing.threads = nthreads;
+	return l.loaded + l.deferred;
 }
 
 void config_modules_unload(void)
 {
-	for (int i = 0; i < config.modules && config.mods[i].handle; i++) {
-		if (config.mods[i].finit) config.mods[i].finit();
-		dlclose(config.mods[i].handle);
+	/* modules unloaded by a reload are zeroed */
+	for (int i = 0; i < config.modules; i++) {
+		config_module_unload(&config.mods[i], 1);
 	}
 	free(config.mods);
 }
 
 int config_parse(void)
 {
+	const uint64_t start = config_now();
 	int ret = 0;
 	if (!isatty(0)) {
 		ret = yyparse();
@@ -109,5 +557,34 @@ int config_parse(void)
 	if (config.configfile) {
 		ret = config_include(config.configfile);
 	}
+	config.timing.parse = config_now() - start;
 	return ret;
 }
+
+/* parse the config file again, returning its handlers.  The running config
+ * is read by every thread, so the file is parsed into one of its own */
+int config_reload(handler_t **handlers)
+{
+	config_t next = {0};
+	int ret;
+	if (!config.configfile) {
+		errno = ENOENT;
+		return -1;
+	}
+	config_parsing = &next;
+	lineno = 1;
+	ret = config_include(config.configfile);
+	config_parsing = &config;
+	*handlers = next.handlers;
+	/* globals need a restart, so throw away anything the file set */
+	free(next.cert);
+	free(next.key);
+	free(next.modpath);
+	free(next.latencyfile);
+	if (ret) {
+		config_handlers_free(*handlers);
+		*handlers = NULL;
+		return -1;
+	}
+	return 0;
+}
@@ -5,14 +5,75 @@
 #define _LSDM_CONFIG_H 1
 
 #include <librecast/types.h>
+#include <stdint.h>
+#include "wheel.h"
 
 #define CONFIG_LOGLEVEL_MAX 127
 
+#define CONFIG_ENGINES(X) \
+	X(0, ENGINE_LISTEN,	"listen") \
+	X(1, ENGINE_EPOLL,	"epoll") \
+	X(2, ENGINE_PERCORE,	"percore") \
+	X(3, ENGINE_URING,	"uring")
+#define CONFIG_ENGINE_ENUM(code, name, text) name = code,
+typedef enum {
+	CONFIG_ENGINES(CONFIG_ENGINE_ENUM)
+} engine_t;
+
+/* what a full ingress queue throws away */
+#define CONFIG_DROPS(X) \
+	X(0, DROP_NEWEST,	"newest") \
+	X(1, DROP_OLDEST,	"oldest")
+#define CONFIG_DROP_ENUM(code, name, text) name = code,
+typedef enum {
+	CONFIG_DROPS(CONFIG_DROP_ENUM)
+} drop_t;
+
+/* how a handler waits for datagrams: in the engine's event loop, spinning on
+ * a thread of its own, or spinning for poll_window_us after traffic and
+ * blocking once it goes quiet */
+#define CONFIG_POLLMODES(X) \
+	X(0, POLLMODE_BLOCK,	"block") \
+	X(1, POLLMODE_BUSY,	"busy") \
+	X(2, POLLMODE_ADAPTIVE,	"adaptive")
+#define CONFIG_POLLMODE_ENUM(code, name, text) name = code,
+typedef enum {
+	CONFIG_POLLMODES(CONFIG_POLLMODE_ENUM)
+} pollmode_t;
+
+/* how the workers choose between a handler's priority classes: always the
+ * first with messages waiting, or taking turns of each class's weight */
+#define CONFIG_SCHEDS(X) \
+	X(0, SCHED_STRICT,	"strict") \
+	X(1, SCHED_WEIGHTED,	"weighted")
+#define CONFIG_SCHED_ENUM(code, name, text) name = code,
+typedef enum {
+	CONFIG_SCHEDS(CONFIG_SCHED_ENUM)
+} sched_t;
+
+/* priority classes, 0 first, that a handler sorts messages into by opcode,
+ * the first byte of the message */
+#define CONFIG_CLASSES 4
+#define CONFIG_OPCODES 256
+
+/* what senders are rate limited by */
+#define CONFIG_RATEKEYS(X) \
+	X(0, RATEKEY_KEY,	"key") \
+	X(1, RATEKEY_ADDR,	"addr")
+#define CONFIG_RATEKEY_ENUM(code, name, text) name = code,
+typedef enum {
+	CONFIG_RATEKEYS(CONFIG_RATEKEY_ENUM)
+} ratekey_t;
+
+/* fields are compared by config_handler_cmp() when reloading */
 typedef struct handler_s handler_t;
 struct handler_s {
 	handler_t *	next;
 	char *		channel;
 	char *		channelhash;
+	char **		channels;	/* further channels, after channel */
+	int		nchannels;
+	char *		cpuset;
 	char *		dbname;
 	char *		dbpath;
 	char *		key_private;
@@ -22,39 +83,207 @@ struct handler_s {
 	time_t		usertoken_expires;
 	time_t		token_duration;
 	unsigned short  port;
+	int		batch;
+	int		deadline_ms;
+	int		dedup_ms;	/* drop repeats seen within, 0 for none */
+	int		drop;
+	int		inflight;
+	int		lazy;
+	int		poll;
+	int		poll_window_us;
+	int		queue;
+	int		ratelimit;
+	int		ratelimit_burst;
+	int		ratelimit_by;
+	int		rcvbuf;		/* socket buffer bytes, 0 for the default */
+	int		schedule;
+	int		sndbuf;
+	int		timeout_ms;
+	int		watchdog_ms;	/* budget per module call, 0 for none */
+	int		watchdog_shed;
+	int		weight[CONFIG_CLASSES];	/* 0 for the default */
+	unsigned char	opclass[CONFIG_OPCODES]; /* class + 1, 0 for the last */
 };
 
+typedef struct api_s api_t;
 typedef struct config_s config_t;
 typedef struct module_s module_t;
+typedef struct module_req_s module_req_t;
+typedef struct config_timing_s config_timing_t;
+
+/* core services made available to modules through config.api.  Modules are
+ * linked against their own copy of the core objects, so must call these
+ * through the table rather than directly */
+struct api_s {
+	int (*		reply)(lc_channel_t *chan, const void *data, size_t len);
+	/* receive buffer pool: buf_get() returns NULL if there is no pool or
+	 * it is exhausted, buf_size() is 0 if there is no pool */
+	void *(*	buf_get)(void);
+	void (*		buf_put)(void *buf);
+	size_t (*	buf_size)(void);
+	/* add to a STATS_COUNTERS counter, or count an opcode, for the handler
+	 * whose message is being handled */
+	void (*		count)(int stat, uint64_t n);
+	void (*		count_op)(unsigned int op);
+	/* record how long an opcode took to handle, in nanoseconds */
+	void (*		latency)(unsigned int op, uint64_t ns);
+	/* finish a request accepted by handle_async(), from any thread, err
+	 * being 0 or an errno.  Every accepted request is completed once, even
+	 * after it is cancelled */
+	void (*		complete)(module_req_t *req, int err);
+	/* non-zero once the core has given up on req, which may be abandoned
+	 * early.  It must still be completed */
+	int (*		cancelled)(module_req_t *req);
+	/* count and time the calling thread's work, through count(), count_op()
+	 * and latency(), for the handler of req, as on a module's own thread */
+	void (*		enter)(module_req_t *req);
+	/* call fn(arg) after ms, then every period_ms unless that is 0.  t is
+	 * the module's own, zeroed before first use, see wheel.h.  Callbacks
+	 * run one at a time on the thread handling signals, so should be
+	 * short.  A module cancels its timers in finit() */
+	int (*		timer_add)(wheel_timer_t *t, uint64_t ms, uint64_t period_ms,
+				void (*fn)(void *arg), void *arg);
+	int (*		timer_cancel)(wheel_timer_t *t);
+};
+
+/* A module exporting "module_abi", an int set to MODULE_ABI_VERSION, is loaded
+ * once and may serve any number of handlers, each with its own context:
+ *
+ *	void *init(config_t *c, handler_t *h);	context for h, NULL on error
+ *	void finit(void *ctx);
+ *	void handle_msg(void *ctx, lc_message_t *msg);
+ *	void handle_err(void *ctx, int err);
+ *
+ * and optionally, to return before a request is finished:
+ *
+ *	void handle_async(void *ctx, lc_message_t *msg, module_req_t *req);
+ *
+ * which owns req until it calls config.api->complete(req), from any thread.
+ * msg stays valid until then.  finit() is only called, and the module only
+ * unloaded, once every request is completed.  At exit a module with requests
+ * still in flight after a while is left loaded.
+ *
+ * or, to be handed messages a batch at a time:
+ *
+ *	void handle_msgv(void *ctx, lc_message_t *msgs[], int n);
+ *
+ * msgs and the messages in it are only valid for the call.  A module with
+ * handle_async() is never called this way.
+ *
+ * A module without module_abi has the legacy ABI: init(config_t *) is called
+ * once per handler, there is no context and handle_msgv(lc_message_t *msgs[],
+ * int n) drops the ctx argument.  Call either through config_module_msg(),
+ * config_module_msgv() and config_module_err() */
+#define MODULE_ABI_LEGACY 1
+#define MODULE_ABI_VERSION 2
 
 struct module_s {
 	char *          name;
+	char *		path;	/* file loaded, for config_module_swap() */
 	void *          handle;
+	handler_t *	handler;
+	void *		ctx;
+	int		abi;
+	int		lazy;	/* not loaded until first used */
+	unsigned int	calls;	/* in progress, see config_module_enter() */
+	module_t *	prev;	/* copy this one replaced, see config_module_swap() */
+	struct async_s *async;	/* its requests in flight, kept by the server */
 	int (*		init)(config_t *c);
 	void (*		finit)(void);
 	void (*		handle_msg)(lc_message_t *msg);
+	void (*		handle_msgv)(lc_message_t *msgs[], int n);
 	void (*		handle_err)(int);
+	void *(*	init_ctx)(config_t *c, handler_t *h);
+	void (*		finit_ctx)(void *ctx);
+	void (*		handle_msg_ctx)(void *ctx, lc_message_t *msg);
+	void (*		handle_msgv_ctx)(void *ctx, lc_message_t *msgs[], int n);
+	void (*		handle_err_ctx)(void *ctx, int err);
+	void (*		handle_async)(void *ctx, lc_message_t *msg, module_req_t *req);
+};
+
+/* where startup went, for the report logged once modules are loaded.  Times
+ * are in nanoseconds.  dlopen and init are summed over the loader threads,
+ * load is the time taken by config_modules_load() as a whole */
+struct config_timing_s {
+	uint64_t	parse;
+	uint64_t	dlopen;
+	uint64_t	init;
+	uint64_t	load;
+	uint64_t	join;
+	int		loaded;
+	int		deferred;
+	int		threads;
+	int		joined;
 };
 
 struct config_s {
+	int	buffers;
+	int	bufsize;
 	int	daemon;
 	int	debug;
+	int	engine;
+	int	hugepages;
+	int	loadthreads;
 	int	loglevel;
+	int	loopthreads;
 	int	modules;
+	int	mux;	/* one socket per loop for every channel */
+	int	processes;
 	int	testmode;
+	int	workers;
 	char *	configfile;
 	char *	key;
 	char *	cert;
 	char *	modpath;
+	char *	latencyfile;
 	module_t *mods;
 	handler_t *handlers;
+	api_t *	api;
+	config_timing_t timing;
 };
 extern config_t config;
+/* where the parser puts what it reads, &config but for config_reload() */
+extern config_t *config_parsing;
 
+int	config_drop(const char *drop);
+int	config_engine(const char *engine);
+int	config_pollmode(const char *pollmode);
+int	config_ratekey(const char *ratekey);
+int	config_sched(const char *sched);
 void	config_free(void);
+int	config_handler_cmp(const handler_t *a, const handler_t *b);
+void	config_handlers_free(handler_t *handlers);
+void	config_handlers_swap(handler_t *handlers);
+/* free the handlers retired by earlier swaps that inuse() says nothing refers
+ * to.  Only call once nothing can still be walking the lists they were in */
+void	config_handlers_release(int (*inuse)(handler_t *h));
 int	config_include(char *configfile);
+int	config_module_load(module_t *mod, handler_t *h);
+void	config_module_defer(module_t *mod, handler_t *h);
+void	config_module_unload(module_t *mod, int finit);
+/* load a new copy of mod's module from disk, alongside mod, for its handler.
+ * The file is copied to a temporary path under $TMPDIR, or /tmp, which must
+ * allow exec.  peer, a copy already made of the same module for another
+ * handler, is shared instead if given.  Returns NULL on error */
+module_t *config_module_swap(module_t *mod, module_t *peer);
+/* hold whichever module *slot points to, so it isn't unloaded by a swap
+ * until config_module_leave().  config_module_wait() waits for those holding
+ * mod to leave */
+module_t *config_module_enter(module_t **slot);
+void	config_module_leave(module_t *mod);
+void	config_module_wait(module_t *mod);
+/* free the copies made by config_module_swap() that led to mod, once
+ * unloaded, along with mod itself if it is one */
+void	config_module_free(module_t *mod);
+void	config_module_msg(module_t *mod, lc_message_t *msg);
+/* hand n messages to mod at once, or one by one if it has no handle_msgv() */
+void	config_module_msgv(module_t *mod, lc_message_t *msgs[], int n);
+/* non-zero if mod exports handle_msgv() */
+int	config_module_vectored(module_t *mod);
+void	config_module_err(module_t *mod, int err);
 int	config_modules_load(void);
 void	config_modules_unload(void);
 int	config_parse(void);
+int	config_reload(handler_t **handlers);
 
 #endif /* _LSDM_CONFIG_H */
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <sodium.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include "dedup.h"
+
+/* Each bucket is a single word holding a tag from the datagram's hash and
+ * when it was last seen, in milliseconds since the table was created.  A
+ * datagram may sit in any of DEDUP_PROBE buckets from its hash, and is a
+ * duplicate if one of them has its tag and was seen within the window.
+ * Otherwise it takes a bucket that is free, expired or its own, or if there
+ * is none the first, so memory is fixed and the oldest entries go first */
+#define DEDUP_PROBE 4
+#define DEDUP_TAG(b) ((b) >> 32)
+#define DEDUP_TIME(b) ((uint32_t)(b))
+#define DEDUP_BUCKET(tag, ms) (((uint64_t)(tag) << 32) | (ms))
+
+struct dedup_s {
+	uint64_t *	buckets;
+	uint64_t	mask;
+	unsigned char	key[crypto_shorthash_KEYBYTES];
+	uint32_t	window;		/* milliseconds */
+	struct timespec	epoch;
+	unsigned long	dropped;
+};
+
+/* SipHash, keyed per table, so senders can't craft datagrams that collide
+ * with someone else's */
+static uint64_t dedup_hash(dedup_t *d, const unsigned char *data, size_t len)
+{
+	unsigned char out[crypto_shorthash_BYTES];
+	uint64_t h;
+	crypto_shorthash(out, data, len, d->key);
+	memcpy(&h, out, sizeof h);
+	return h;
+}
+
+static uint32_t dedup_now(dedup_t *d)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((ts.tv_sec - d->epoch.tv_sec) * 1000
+		+ (ts.tv_nsec - d->epoch.tv_nsec) / 1000000);
+}
+
+int dedup_check(dedup_t *d, const void *data, size_t len)
+{
+	const uint32_t now = dedup_now(d);
+	const uint64_t hash = dedup_hash(d, data, len);
+	uint64_t tag = DEDUP_TAG(hash), old = 0, *bucket;
+	if (!tag) tag = 1; /* zero marks a bucket never used */
+	for (;;) {
+		bucket = NULL;
+		for (int i = 0; i < DEDUP_PROBE; i++) {
+			uint64_t *b = &d->buckets[(hash + i) & d->mask];
+			uint64_t v = __atomic_load_n(b, __ATOMIC_RELAXED);
+			const int live = (v && now - DEDUP_TIME(v) < d->window);
+			if (live && DEDUP_TAG(v) == tag) {
+				__atomic_add_fetch(&d->dropped, 1, __ATOMIC_RELAXED);
+				return -1;
+			}
+			if (!bucket && (!live || DEDUP_TAG(v) == tag)) {
+				bucket = b;
+				old = v;
+			}
+		}
+		if (!bucket) {
+			bucket = &d->buckets[hash & d->mask];
+			old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+		}
+		/* lost a race, perhaps with a copy of this datagram, so look again */
+		if (__atomic_compare_exchange_n(bucket, &old, DEDUP_BUCKET(tag, now), 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return 0;
+	}
+}
+
+unsigned long dedup_dropped(dedup_t *d)
+{
+	return __atomic_load_n(&d->dropped, __ATOMIC_RELAXED);
+}
+
+void dedup_free(dedup_t *d)
+{
+	if (!d) return;
+	free(d->buckets);
+	free(d);
+}
+
+dedup_t *dedup_create(size_t slots, unsigned int window_ms)
+{
+	dedup_t *d;
+	size_t n = 1;
+	if (!slots || !window_ms || window_ms > INT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (n < slots) n <<= 1;
+	if (!(d = calloc(1, sizeof(dedup_t)))) return NULL;
+	if (!(d->buckets = calloc(n, sizeof(uint64_t)))) {
+		free(d);
+		return NULL;
+	}
+	if (getrandom(d->key, sizeof d->key, 0) != (ssize_t)sizeof d->key) {
+		dedup_free(d);
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &d->epoch);
+	d->mask = n - 1;
+	d->window = window_ms;
+	return d;
+}
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_DEDUP_H
+#define _LSDM_DEDUP_H 1
+
+#include <stddef.h>
+
+/* buckets per table, rounded up to a power of two */
+#define DEDUP_SLOTS_DEFAULT 4096
+
+typedef struct dedup_s dedup_t;
+
+/* create table of slots buckets remembering each datagram for window_ms.
+ * Returns NULL on error */
+dedup_t *dedup_create(size_t slots, unsigned int window_ms);
+
+/* record datagram data.  Returns 0 if it is new, or -1 if the same bytes were
+ * seen within the window.  Safe to call from any number of threads */
+int	dedup_check(dedup_t *d, const void *data, size_t len);
+
+/* number of duplicates found so far */
+unsigned long dedup_dropped(dedup_t *d);
+
+void	dedup_free(dedup_t *d);
+
+#endif /* _LSDM_DEDUP_H */
@@ -4,6 +4,7 @@
 %{
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "config.h"
 #include "y.tab.h"
@@ -18,46 +19,90 @@ handler_t handler = {
 	.token_duration = 360
 };
 
+/* a handler may list several channels, the first is handler.channel */
+static void handler_channel_add(char *channel)
+{
+	char **channels = realloc(handler.channels, (handler.nchannels + 1) * sizeof(char *));
+	if (!channels) {
+		fprintf(stderr, "out of memory for channel on line: %i\n", lineno);
+		free(channel);
+		return;
+	}
+	handler.channels = channels;
+	handler.channels[handler.nchannels++] = channel;
+}
+
 %}
 %union
 {
 	int ival;
 	char *sval;
 }
+%token <ival> BATCH
 %token <sval> BRACECLOSE
 %token <sval> BRACEOPEN
 %token <sval> BRACKETCLOSE
 %token <sval> BRACKETOPEN
 %token <ival> BOOL
+%token <ival> BUFFERS
+%token <ival> BUFSIZE
 %token <sval> CERT
 %token <sval> CHANNEL
 %token <sval> COLON
 %token <sval> COMMENT
+%token <ival> CPU
+%token <sval> CPUSET
 %token <ival> DAEMON
+%token <ival> DEADLINE_MS
+%token <ival> DEDUP_MS
 %token <sval> DBNAME
 %token <sval> DBPATH
 %token <sval> DBLQUOTE
 %token <sval> DBLQUOTEDSTRING
 %token <ival> DEBUGMODE
+%token <sval> DROP
+%token <sval> ENGINE
 %token <sval> FILENAME
 %token <sval> HANDLER
+%token <ival> HUGEPAGES
+%token <ival> INFLIGHT
 %token <sval> KEY
 %token <sval> KEYPRIV
 %token <sval> KEYPUB
+%token <sval> LATENCY_FILE
+%token <ival> LAZY
+%token <ival> LOADTHREADS
 %token <ival> LOGLEVEL
+%token <ival> LOOPTHREADS
 %token <sval> MODPATH
 %token <sval> MODULE
+%token <ival> MUX
 %token <sval> NEWLINE
 %token <ival> NUMBER
+%token <sval> POLL
+%token <ival> POLL_WINDOW_US
 %token <ival> PORT
+%token <ival> PRIORITY
+%token <ival> PROCESSES
 %token <sval> PROTO
+%token <ival> QUEUE
+%token <ival> RATELIMIT
+%token <sval> RATELIMIT_BY
+%token <ival> RCVBUF
+%token <sval> SCHEDULE
 %token <sval> SCOPE
 %token <sval> SECTION
 %token <sval> SLASH
+%token <ival> SNDBUF
 %token <sval> TESTMODE
+%token <ival> TIMEOUT_MS
 %token <ival> TOKEN_DURATION
 %token <ival> USERTOKEN_EXPIRES
+%token <ival> WATCHDOG_MS
+%token <ival> WATCHDOG_SHED
+%token <ival> WEIGHT
 %token <sval> WORD
+%token <ival> WORKERS
 %token <sval> V6ADDR
 
 %%
@@ -73,8 +118,8 @@ global:
 	{
 		fprintf(stderr, "handler %i\n", ++handlers);
 		handler_t *h = malloc(sizeof(handler_t));
-		if (!config.handlers)
-			config.handlers = h;
+		if (!config_parsing->handlers)
+			config_parsing->handlers = h;
 		else
 			handler_last->next = h;
 		memcpy(h, &handler, sizeof(handler_t));
@@ -82,26 +127,78 @@ global:
 		memset(&handler, 0, sizeof(handler_t));
 	}
 	|
+	BUFFERS NUMBER
+	{
+		fprintf(stderr, "buffers = %i\n", $2);
+		config_parsing->buffers = $2;
+	}
+	|
+	BUFSIZE NUMBER
+	{
+		fprintf(stderr, "bufsize = %i\n", $2);
+		config_parsing->bufsize = $2;
+	}
+	|
 	DAEMON BOOL
 	{
 		if ($2) {
 			fprintf(stderr, "daemonizing\n");
-			config.daemon = 1;
+			config_parsing->daemon = 1;
 		}
 	}
 	|
 	DEBUGMODE BOOL
 	{
 		if ($2) {
-			config.debug = 1;
+			config_parsing->debug = 1;
 			fprintf(stderr, "debug mode enabled\n");
 		}
 	}
 	|
+	ENGINE WORD
+	{
+		int engine = config_engine($2);
+		if (engine == -1)
+			fprintf(stderr, "unknown engine '%s' on line: %i\n", $2, lineno);
+		else {
+			fprintf(stderr, "engine = %s\n", $2);
+			config_parsing->engine = engine;
+		}
+		free($2);
+	}
+	|
+	HUGEPAGES BOOL
+	{
+		if ($2) {
+			fprintf(stderr, "hugepages enabled\n");
+			config_parsing->hugepages = 1;
+		}
+	}
+	|
+	LOADTHREADS NUMBER
+	{
+		fprintf(stderr, "loadthreads = %i\n", $2);
+		config_parsing->loadthreads = $2;
+	}
+	|
+	LOOPTHREADS NUMBER
+	{
+		fprintf(stderr, "loopthreads = %i\n", $2);
+		config_parsing->loopthreads = $2;
+	}
+	|
+	MUX BOOL
+	{
+		if ($2) {
+			fprintf(stderr, "mux enabled\n");
+			config_parsing->mux = 1;
+		}
+	}
+	|
 	TESTMODE BOOL
 	{
 		if ($2) {
-			config.testmode = 1;
+			config_parsing->testmode = 1;
 			fprintf(stderr, "test mode enabled\n");
 		}
 	}
@@ -109,25 +206,43 @@ global:
 	LOGLEVEL NUMBER
 	{
 		fprintf(stderr, "loglevel set to %i\n", $2);
-		config.loglevel = $2;
+		config_parsing->loglevel = $2;
+	}
+	|
+	PROCESSES NUMBER
+	{
+		fprintf(stderr, "processes = %i\n", $2);
+		config_parsing->processes = $2;
+	}
+	|
+	WORKERS NUMBER
+	{
+		fprintf(stderr, "workers = %i\n", $2);
+		config_parsing->workers = $2;
 	}
 	|
 	KEY FILENAME
 	{
 		fprintf(stderr, "key = '%s'\n", $2);
-		config.key = $2;
+		config_parsing->key = $2;
 	}
 	|
 	CERT FILENAME
 	{
 		fprintf(stderr, "cert = '%s'\n", $2);
-		config.cert = $2;
+		config_parsing->cert = $2;
 	}
 	|
 	MODPATH FILENAME
 	{
 		fprintf(stderr, "modpath = '%s'\n", $2);
-		config.modpath = $2;
+		config_parsing->modpath = $2;
+	}
+	|
+	LATENCY_FILE FILENAME
+	{
+		fprintf(stderr, "latency_file = '%s'\n", $2);
+		config_parsing->latencyfile = $2;
 	}
 	;
 
@@ -139,18 +254,61 @@ handlers:
 handler:
 	COMMENT { /* skip comment */ }
 	|
+	BATCH NUMBER
+	{
+		fprintf(stderr, "handler batch = %i\n", $2);
+		handler.batch = $2;
+	}
+	|
 	CHANNEL	WORD BRACKETOPEN DBLQUOTEDSTRING BRACKETCLOSE
 	{
 		fprintf(stderr, "handler channel = %s(\"%s\")\n", $2, $4);
-		handler.channelhash = $2;
-		handler.channel = $4;
+		if (handler.channel) {
+			handler_channel_add($4);
+			free($2);
+		}
+		else {
+			handler.channelhash = $2;
+			handler.channel = $4;
+		}
 	}
 	|
 	CHANNEL	V6ADDR
 	{
 		fprintf(stderr, "handler channel = %s\n", $2);
-		handler.channelhash = NULL;
-		handler.channel = $2;
+		if (handler.channel)
+			handler_channel_add($2);
+		else {
+			handler.channelhash = NULL;
+			handler.channel = $2;
+		}
+	}
+	|
+	CPU NUMBER
+	{
+		fprintf(stderr, "handler cpu = %i\n", $2);
+		free(handler.cpuset);
+		handler.cpuset = malloc(sizeof(int) * 3 + 1);
+		if (handler.cpuset) sprintf(handler.cpuset, "%i", $2);
+	}
+	|
+	CPUSET DBLQUOTEDSTRING
+	{
+		fprintf(stderr, "handler cpuset = '%s'\n", $2);
+		free(handler.cpuset);
+		handler.cpuset = $2;
+	}
+	|
+	DEADLINE_MS NUMBER
+	{
+		fprintf(stderr, "handler deadline_ms = %i\n", $2);
+		handler.deadline_ms = $2;
+	}
+	|
+	DEDUP_MS NUMBER
+	{
+		fprintf(stderr, "handler dedup_ms = %i\n", $2);
+		handler.dedup_ms = $2;
 	}
 	|
 	DBNAME DBLQUOTEDSTRING
@@ -165,6 +323,18 @@ handler:
 		handler.dbpath = $2;
 	}
 	|
+	DROP WORD
+	{
+		int drop = config_drop($2);
+		if (drop == -1)
+			fprintf(stderr, "unknown drop policy '%s' on line: %i\n", $2, lineno);
+		else {
+			fprintf(stderr, "handler drop = %s\n", $2);
+			handler.drop = drop;
+		}
+		free($2);
+	}
+	|
 	KEYPRIV WORD
 	{
 		fprintf(stderr, "handler private key = %s\n", $2);
@@ -181,14 +351,32 @@ handler:
 	{
 		fprintf(stderr, "handler module = %s\n", $2);
 		handler.module = $2;
-		config.modules++;
+		config_parsing->modules++;
 	}
 	|
 	MODULE WORD
 	{
 		fprintf(stderr, "handler module = %s\n", $2);
 		handler.module = $2;
-		config.modules++;
+		config_parsing->modules++;
+	}
+	|
+	POLL WORD
+	{
+		int pollmode = config_pollmode($2);
+		if (pollmode == -1)
+			fprintf(stderr, "unknown poll mode '%s' on line: %i\n", $2, lineno);
+		else {
+			fprintf(stderr, "handler poll = %s\n", $2);
+			handler.poll = pollmode;
+		}
+		free($2);
+	}
+	|
+	POLL_WINDOW_US NUMBER
+	{
+		fprintf(stderr, "handler poll_window_us = %i\n", $2);
+		handler.poll_window_us = $2;
 	}
 	|
 	PORT NUMBER
@@ -200,12 +388,95 @@ handler:
 			handler.port = $2;
 	}
 	|
+	PRIORITY NUMBER NUMBER
+	{
+		fprintf(stderr, "handler priority opcode %i = class %i\n", $2, $3);
+		if ($2 < 0 || $2 >= CONFIG_OPCODES || $3 < 0 || $3 >= CONFIG_CLASSES)
+			fprintf(stderr, "invalid priority on line: %i\n", lineno);
+		else
+			handler.opclass[$2] = $3 + 1;
+	}
+	|
+	INFLIGHT NUMBER
+	{
+		fprintf(stderr, "handler inflight = %i\n", $2);
+		handler.inflight = $2;
+	}
+	|
+	LAZY BOOL
+	{
+		fprintf(stderr, "handler lazy = %i\n", $2);
+		handler.lazy = $2;
+	}
+	|
+	QUEUE NUMBER
+	{
+		fprintf(stderr, "handler queue = %i\n", $2);
+		handler.queue = $2;
+	}
+	|
+	RATELIMIT NUMBER
+	{
+		fprintf(stderr, "handler ratelimit = %i\n", $2);
+		handler.ratelimit = $2;
+		handler.ratelimit_burst = $2;
+	}
+	|
+	RATELIMIT NUMBER NUMBER
+	{
+		fprintf(stderr, "handler ratelimit = %i, burst %i\n", $2, $3);
+		handler.ratelimit = $2;
+		handler.ratelimit_burst = $3;
+	}
+	|
+	RATELIMIT_BY WORD
+	{
+		int ratekey = config_ratekey($2);
+		if (ratekey == -1)
+			fprintf(stderr, "unknown ratelimit_by '%s' on line: %i\n", $2, lineno);
+		else {
+			fprintf(stderr, "handler ratelimit_by = %s\n", $2);
+			handler.ratelimit_by = ratekey;
+		}
+		free($2);
+	}
+	|
+	RCVBUF NUMBER
+	{
+		fprintf(stderr, "handler rcvbuf = %i\n", $2);
+		handler.rcvbuf = $2;
+	}
+	|
+	SCHEDULE WORD
+	{
+		int sched = config_sched($2);
+		if (sched == -1)
+			fprintf(stderr, "unknown schedule '%s' on line: %i\n", $2, lineno);
+		else {
+			fprintf(stderr, "handler schedule = %s\n", $2);
+			handler.schedule = sched;
+		}
+		free($2);
+	}
+	|
 	SCOPE WORD
 	{
 		fprintf(stderr, "handler scope = %s\n", $2);
 		handler.scope = $2;
 	}
 	|
+	SNDBUF NUMBER
+	{
+		fprintf(stderr, "handler sndbuf = %i\n", $2);
+		handler.sndbuf = $2;
+	}
+	|
+	TIMEOUT_MS NUMBER
+	{
+		fprintf(stderr, "handler timeout_ms = %i\n", $2);
+		handler.timeout_ms = $2;
+	}
+	|
 	TOKEN_DURATION NUMBER
 	{
 		fprintf(stderr, "token_duration = %i\n", $2);
@@ -217,6 +488,27 @@ handler:
 		fprintf(stderr, "usertoken.duratin = %i\n", $2);
 		handler.usertoken_expires = $2;
 	}
+	|
+	WATCHDOG_MS NUMBER
+	{
+		fprintf(stderr, "handler watchdog_ms = %i\n", $2);
+		handler.watchdog_ms = $2;
+	}
+	|
+	WATCHDOG_SHED BOOL
+	{
+		fprintf(stderr, "handler watchdog_shed = %i\n", $2);
+		handler.watchdog_shed = $2;
+	}
+	|
+	WEIGHT NUMBER NUMBER
+	{
+		fprintf(stderr, "handler weight class %i = %i\n", $2, $3);
+		if ($2 < 0 || $2 >= CONFIG_CLASSES || $3 < 1)
+			fprintf(stderr, "invalid weight on line: %i\n", lineno);
+		else
+			handler.weight[$2] = $3;
+	}
 	;
 %%
 void yyerror(const char *str)
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "hist.h"
+
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+int hist_bucket(uint64_t value)
+{
+	int e;
+	if (value < HIST_SUB) return (int)value;
+	if (value >> HIST_MAX_BITS) value = (UINT64_C(1) << HIST_MAX_BITS) - 1;
+	e = 63 - __builtin_clzll(value);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+		| (int)((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+uint64_t hist_bucket_max(int bucket)
+{
+	const int e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	uint64_t lo;
+	if (bucket < HIST_SUB) return bucket;
+	lo = (UINT64_C(1) << e) | ((uint64_t)(bucket & (HIST_SUB - 1)) << (e - HIST_SUB_BITS));
+	return lo + (UINT64_C(1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_record(hist_t *hist, uint64_t value)
+{
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->bucket[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&hist->max, &max, value, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+	const uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		dst->bucket[i] += __atomic_load_n(&src->bucket[i], __ATOMIC_RELAXED);
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	if (max > dst->max) dst->max = max;
+}
+
+uint64_t hist_percentile(const hist_t *hist, double pct)
+{
+	uint64_t total = 0, target, seen = 0, v;
+	double rank;
+	/* sum the buckets rather than trust count, which a writer may be between */
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		total += __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+	if (!total) return 0;
+	if (pct > 100.0) pct = 100.0;
+	rank = pct / 100.0 * total;
+	target = (uint64_t)rank;
+	if (target < rank || !target) target++;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+		if (seen < target) continue;
+		v = hist_bucket_max(i);
+		return (v > hist->max && hist->max) ? hist->max : v;
+	}
+	return hist->max;
+}
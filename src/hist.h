@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_HIST_H
+#define _LSDM_HIST_H 1
+
+#include <stdint.h>
+
+/* Log-linear (HDR style) histogram.  Values below 2^HIST_SUB_BITS have a
+ * bucket each, above that every power of two is split into 2^HIST_SUB_BITS
+ * buckets, so a value is known to within about 3%.  Values from 2^HIST_MAX_BITS
+ * (about 68s in nanoseconds) are counted in the last bucket */
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/* recording is a relaxed atomic add, so a histogram owned by one thread can be
+ * read, or merged, by another at any time */
+typedef struct hist_s hist_t;
+struct hist_s {
+	uint64_t	count;
+	uint64_t	max;
+	uint64_t	bucket[HIST_BUCKETS];
+};
+
+void	hist_record(hist_t *hist, uint64_t value);
+
+/* add the counts of src to dst */
+void	hist_merge(hist_t *dst, const hist_t *src);
+
+/* value at or below which pct percent of recorded values fall, 0 if empty */
+uint64_t hist_percentile(const hist_t *hist, double pct);
+
+/* bucket of value, and the highest value counted in a bucket */
+int	hist_bucket(uint64_t value);
+uint64_t hist_bucket_max(int bucket);
+
+#endif /* _LSDM_HIST_H */
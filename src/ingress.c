@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ingress.h"
+#include "stats.h"
+
+/* take the oldest job of r.  Call with lock held */
+static ingress_job_t *ingress_ring_shift(ingress_t *q, ingress_ring_t *r)
+{
+	ingress_job_t *job;
+	if (!r->count) return NULL;
+	job = r->jobs[r->head];
+	r->head = (r->head + 1) % q->size;
+	r->count--;
+	q->count--;
+	return job;
+}
+
+/* take the newest job of r.  Call with lock held */
+static ingress_job_t *ingress_ring_pop(ingress_t *q, ingress_ring_t *r)
+{
+	if (!r->count) return NULL;
+	r->count--;
+	q->count--;
+	return r->jobs[(r->head + r->count) % q->size];
+}
+
+/* class of msg, by its opcode.  Opcodes not given one are in the last */
+static int ingress_class(ingress_t *q, lc_message_t *msg)
+{
+	int c;
+	if (q->nring == 1 || !msg->len) return q->nring - 1;
+	c = q->opclass[((unsigned char *)msg->data)[0]];
+	return (c) ? c - 1 : q->nring - 1;
+}
+
+/* the ring to serve next: the first with jobs, or with weights, each in turn
+ * for as many jobs as its weight.  Call with lock held and jobs queued */
+static ingress_ring_t *ingress_next(ingress_t *q)
+{
+	ingress_ring_t *r = q->ring;
+	if (!q->weight[0]) {
+		while (!r->count) r++;
+		return r;
+	}
+	if (!q->credit || !q->ring[q->turn].count) {
+		do q->turn = (q->turn + 1) % q->nring; while (!q->ring[q->turn].count);
+		q->credit = q->weight[q->turn];
+	}
+	q->credit--;
+	return &q->ring[q->turn];
+}
+
+/* take the next job by schedule.  Call with lock held */
+static ingress_job_t *ingress_shift(ingress_t *q)
+{
+	if (!q->count) return NULL;
+	return ingress_ring_shift(q, ingress_next(q));
+}
+
+/* drop jobs queued more than deadline ago.  Call with lock held */
+static void ingress_expire(ingress_t *q, uint64_t now)
+{
+	for (ingress_ring_t *r = q->ring; r < q->ring + q->nring; r++) {
+		while (r->count && r->jobs[r->head]->queued + q->deadline < now) {
+			q->drop(ingress_ring_shift(q, r));
+			q->dropped_expired++;
+			stats_add(q->stat, STAT_DROPS, 1);
+		}
+	}
+}
+
+int ingress_push(ingress_t *q, ingress_job_t *job, int drop)
+{
+	ingress_ring_t *r = &q->ring[ingress_class(q, &job->msg)], *last;
+	ingress_job_t *old = NULL;
+	int token = 0;
+	pthread_mutex_lock(&q->lock);
+	if (q->deadline) ingress_expire(q, job->queued);
+	if (q->count == q->size) {
+		stats_add(q->stat, STAT_DROPS, 1);
+		for (last = &q->ring[q->nring - 1]; !last->count; last--);
+		if (last < r || (last == r && drop == DROP_NEWEST)) {
+			q->dropped_newest++;
+			pthread_mutex_unlock(&q->lock);
+			q->drop(job);
+			return 0;
+		}
+		if (drop == DROP_NEWEST) {
+			old = ingress_ring_pop(q, last);
+			q->dropped_newest++;
+		}
+		else {
+			old = ingress_ring_shift(q, last);
+			q->dropped_oldest++;
+		}
+	}
+	r->jobs[(r->head + r->count++) % q->size] = job;
+	q->count++;
+	if (q->tokens < q->count) {
+		q->tokens++;
+		token = 1;
+	}
+	stats_depth(q->stat, q->count);
+	pthread_mutex_unlock(&q->lock);
+	if (old) q->drop(old);
+	return token;
+}
+
+int ingress_take(ingress_t *q, ingress_job_t *jobs[], int max, uint64_t now)
+{
+	int n = 0;
+	pthread_mutex_lock(&q->lock);
+	q->tokens--;
+	if (q->deadline) ingress_expire(q, now);
+	while (n < max && (jobs[n] = ingress_shift(q))) n++;
+	stats_depth(q->stat, q->count);
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+int ingress_busy(ingress_t *q)
+{
+	int busy;
+	if (!q->ring[0].jobs) return 0;
+	pthread_mutex_lock(&q->lock);
+	busy = q->tokens || q->count;
+	pthread_mutex_unlock(&q->lock);
+	return busy || __atomic_load_n(&q->inflight, __ATOMIC_ACQUIRE);
+}
+
+int ingress_classes(handler_t *h)
+{
+	for (int op = 0; op < CONFIG_OPCODES; op++) {
+		if (h->opclass[op]) return 1;
+	}
+	return 0;
+}
+
+void ingress_free(ingress_t *q)
+{
+	ingress_job_t *job;
+	if (!q->ring[0].jobs) return;
+	while ((job = ingress_shift(q))) q->drop(job);
+	pthread_mutex_destroy(&q->lock);
+	for (int c = 0; c < q->nring; c++) free(q->ring[c].jobs);
+	memset(q, 0, sizeof(ingress_t));
+}
+
+int ingress_init(ingress_t *q, handler_t *h, size_t size, int stat,
+		void (*drop)(ingress_job_t *job))
+{
+	q->size = size;
+	q->deadline = (uint64_t)h->deadline_ms * 1000000;
+	q->stat = stat;
+	q->drop = drop;
+	q->opclass = h->opclass;
+	q->nring = (ingress_classes(h)) ? CONFIG_CLASSES : 1;
+	/* unweighted classes get more the earlier they are */
+	if (q->nring > 1 && h->schedule == SCHED_WEIGHTED) {
+		for (int c = 0; c < q->nring; c++)
+			q->weight[c] = (h->weight[c] > 0) ? h->weight[c] : CONFIG_CLASSES - c;
+	}
+	q->turn = q->nring - 1;
+	for (int c = 0; c < q->nring; c++) {
+		if (!(q->ring[c].jobs = calloc(q->size, sizeof(ingress_job_t *)))) {
+			while (c--) free(q->ring[c].jobs);
+			memset(q->ring, 0, sizeof q->ring);
+			return -1;
+		}
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	return 0;
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_INGRESS_H
+#define _LSDM_INGRESS_H 1
+
+#include <librecast/types.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/* message queued for a worker, when it was queued, and a copy of the payload
+ * if it was received into a buffer that will be reused */
+typedef struct ingress_job_s ingress_job_t;
+struct ingress_job_s {
+	lc_message_t		msg;
+	uint64_t		queued;	/* nanoseconds */
+	unsigned char		data[];
+};
+
+/* jobs of one priority class, oldest first.  Each can hold the whole queue */
+typedef struct ingress_ring_s ingress_ring_t;
+struct ingress_ring_s {
+	ingress_job_t **	jobs;
+	size_t			head;
+	size_t			count;
+};
+
+/* bounded queue between the loop threads and the worker pool for one handler.
+ * The pool carries a token (the handler) rather than the job itself, so a full
+ * queue can evict its oldest job and workers can skip jobs past their deadline.
+ * We keep count <= tokens <= size, so no job is stranded and the pool, sized
+ * for every queue, never overflows.  A handler with priority classes has a
+ * ring for each, and which job a token gets is up to its schedule */
+typedef struct ingress_s ingress_t;
+struct ingress_s {
+	pthread_mutex_t		lock;
+	ingress_ring_t		ring[CONFIG_CLASSES];
+	int			nring;
+	const unsigned char *	opclass; /* the handler's */
+	int			weight[CONFIG_CLASSES]; /* all 0 for strict */
+	int			turn;	  /* class being served, weighted */
+	int			credit;	  /* jobs left in its turn */
+	size_t			count;	  /* in all rings */
+	size_t			size;
+	size_t			tokens;
+	unsigned int		inflight; /* workers holding a token */
+	uint64_t		deadline; /* nanoseconds, 0 for none */
+	int			stat;	  /* stats slot of the handler */
+	void			(*drop)(ingress_job_t *job);
+	unsigned long		dropped_newest;
+	unsigned long		dropped_oldest;
+	unsigned long		dropped_expired;
+};
+
+/* set up q to hold size jobs for handler h, counting in stats slot stat.
+ * Jobs the queue drops are handed to drop.  Returns -1 on error */
+int	ingress_init(ingress_t *q, handler_t *h, size_t size, int stat,
+		void (*drop)(ingress_job_t *job));
+
+/* drop any jobs left and free q */
+void	ingress_free(ingress_t *q);
+
+/* h sorts its messages into priority classes */
+int	ingress_classes(handler_t *h);
+
+/* queue job, applying drop, the handler's policy, if the queue is full.  With
+ * priority classes that is applied to the last class queued, and a job
+ * never makes way for one in a later class.  Jobs past the deadline at
+ * job->queued go first.  Returns 1 if the job needs a token pushing to the
+ * pool */
+int	ingress_push(ingress_t *q, ingress_job_t *job, int drop);
+
+/* spend a token on up to max jobs still within their deadline at now, in
+ * the order of the schedule, returning how many were taken.  Tokens left
+ * over by taking more than one find the queue empty, which is harmless */
+int	ingress_take(ingress_t *q, ingress_job_t *jobs[], int max, uint64_t now);
+
+/* a worker holds, or has a token queued for, the queue's handler */
+int	ingress_busy(ingress_t *q);
+
+#endif /* _LSDM_INGRESS_H */
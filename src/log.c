@@ -22,12 +22,12 @@ void logmsg(unsigned int level, const char *fmt, ...)
 
 	va_start(argp, fmt);
 	len = vsnprintf(buf, LOG_BUFSIZE, fmt, argp);
-	if (len > LOG_BUFSIZE) {
-		/* need a bigger buffer, resort to malloc */
-		mbuf = malloc(len + 1);
+	/* need a bigger buffer, resort to malloc, or if that fails log what
+	 * fitted.  vsnprintf() returns the length without the terminator */
+	if (len >= LOG_BUFSIZE && (mbuf = malloc(len + 1))) {
 		va_end(argp);
 		va_start(argp, fmt);
-		vsprintf(mbuf, fmt, argp);
+		vsnprintf(mbuf, len + 1, fmt, argp);
 		b = mbuf;
 	}
 	va_end(argp);
@@ -0,0 +1,178 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../modules/auth.h"
+#include "stats.h"
+
+/* attach to the stats segments of running lsdbd processes read-only and print
+ * per handler rates every interval, like top */
+
+#define SEGMENTS_MAX 64
+
+typedef struct sample_s sample_t;
+struct sample_s {
+	uint64_t	stat[STAT_COUNT];
+	uint64_t	op[STATS_OPS];
+};
+
+typedef struct segment_s segment_t;
+struct segment_s {
+	stats_head_t *	head;
+	sample_t *	last;
+	sample_t *	now;
+};
+
+#define STATS_COUNTER_TEXT(id, text) text,
+static const char *counter_text[] = { STATS_COUNTERS(STATS_COUNTER_TEXT) };
+
+static const char *op_text(unsigned int op)
+{
+	static char buf[16];
+	switch (op) {
+		AUTH_OPCODES(AUTH_OPCODE_TEXT)
+	}
+	snprintf(buf, sizeof buf, "op%u", op);
+	return buf;
+}
+
+static int alive(pid_t pid)
+{
+	return !kill(pid, 0) || errno == EPERM;
+}
+
+/* find every segment left by a live process */
+static int scan(segment_t *seg, int max)
+{
+	struct dirent *de;
+	DIR *dir;
+	int n = 0, pid;
+	char c;
+	if (!(dir = opendir("/dev/shm"))) return 0;
+	while (n < max && (de = readdir(dir))) {
+		if (sscanf(de->d_name, "lsdbd.%i%c", &pid, &c) != 1) continue;
+		if (!alive(pid)) continue;
+		if ((seg[n].head = stats_attach(pid))) n++;
+	}
+	closedir(dir);
+	return n;
+}
+
+/* sum every thread's counters for each handler */
+static void sample(segment_t *seg)
+{
+	stats_head_t *head = seg->head;
+	const uint32_t used = __atomic_load_n(&head->used, __ATOMIC_ACQUIRE);
+	memset(seg->now, 0, head->handlers * sizeof(sample_t));
+	for (uint32_t t = 0; t < head->threads; t++) {
+		for (uint32_t h = 0; h < used; h++) {
+			stats_counters_t *c = stats_counters(head, t, h);
+			for (int i = 0; i < STAT_COUNT; i++)
+				seg->now[h].stat[i] += __atomic_load_n(&c->stat[i], __ATOMIC_RELAXED);
+			for (int i = 0; i < STATS_OPS; i++)
+				seg->now[h].op[i] += __atomic_load_n(&c->op[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void print(segment_t *seg, double secs)
+{
+	stats_head_t *head = seg->head;
+	const uint32_t used = __atomic_load_n(&head->used, __ATOMIC_ACQUIRE);
+	const long up = (long)(time(NULL) - head->started);
+	int ops;
+	printf("pid %lli  up %lid %02li:%02li:%02li  %u handler(s)\n", (long long)head->pid,
+			up / 86400, up / 3600 % 24, up / 60 % 60, up % 60, used);
+	printf("%-24s %-16s", "CHANNEL", "MODULE");
+	for (int i = 0; i < STAT_COUNT; i++) printf(" %10s/s", counter_text[i]);
+	printf(" %8s %8s\n", "depth", "inflight");
+	for (uint32_t h = 0; h < used; h++) {
+		stats_handler_t *slot = stats_handler_slot(head, h);
+		const char *mod = strrchr(slot->module, '/');
+		if (__atomic_load_n(&slot->retired, __ATOMIC_RELAXED)) continue;
+		printf("%-24.24s %-16.16s", slot->channel, (mod) ? mod + 1 : slot->module);
+		for (int i = 0; i < STAT_COUNT; i++)
+			printf(" %12.1f", (seg->now[h].stat[i] - seg->last[h].stat[i]) / secs);
+		printf(" %8llu %8llu\n", (unsigned long long)__atomic_load_n(&slot->depth, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&slot->inflight, __ATOMIC_RELAXED));
+		ops = 0;
+		for (int i = 0; i < STATS_OPS; i++) {
+			const uint64_t d = seg->now[h].op[i] - seg->last[h].op[i];
+			if (d) printf("%s %s %.1f/s", (ops++) ? "" : "    ops:", op_text(i), d / secs);
+		}
+		if (ops) putchar('\n');
+	}
+	putchar('\n');
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-i seconds] [-n count] [pid...]\n", prog);
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+	segment_t seg[SEGMENTS_MAX] = {0};
+	struct timespec period, ts;
+	double interval = 1.0;
+	long count = -1;
+	int n = 0, tty = isatty(STDOUT_FILENO);
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--interval")) {
+			if (++i == argc || (interval = atof(argv[i])) <= 0) return usage(argv[0]);
+		}
+		else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--count")) {
+			if (++i == argc || (count = atol(argv[i])) <= 0) return usage(argv[0]);
+		}
+		else if (argv[i][0] == '-') return usage(argv[0]);
+		else if (n < SEGMENTS_MAX) {
+			if (!(seg[n].head = stats_attach(atoi(argv[i])))) {
+				fprintf(stderr, "no stats for pid %s: %s\n", argv[i], strerror(errno));
+				return EXIT_FAILURE;
+			}
+			n++;
+		}
+	}
+	if (!n && !(n = scan(seg, SEGMENTS_MAX))) {
+		fprintf(stderr, "no running lsdbd found\n");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < n; i++) {
+		seg[i].last = calloc(seg[i].head->handlers, sizeof(sample_t));
+		seg[i].now = calloc(seg[i].head->handlers, sizeof(sample_t));
+		if (!seg[i].last || !seg[i].now) return EXIT_FAILURE;
+		sample(&seg[i]);
+	}
+	period.tv_sec = (time_t)interval;
+	period.tv_nsec = (long)((interval - period.tv_sec) * 1000000000);
+	while (count) {
+		ts = period;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+		if (tty) printf("\033[H\033[2J");
+		for (int i = 0; i < n; i++) {
+			sample_t *tmp;
+			sample(&seg[i]);
+			print(&seg[i], interval);
+			tmp = seg[i].last;
+			seg[i].last = seg[i].now;
+			seg[i].now = tmp;
+		}
+		fflush(stdout);
+		if (count > 0) count--;
+	}
+	for (int i = 0; i < n; i++) {
+		free(seg[i].last);
+		free(seg[i].now);
+		stats_detach(seg[i].head);
+	}
+	return EXIT_SUCCESS;
+}
@@ -1,16 +1,145 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 /* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
 
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 #include "config.h"
+#include "log.h"
 #include "opts.h"
 #include "lsdbd.h"
 #include "server.h"
+#include "stats.h"
+
+static volatile sig_atomic_t stopping;
+static volatile sig_atomic_t dumping;
+static volatile sig_atomic_t swapping;
+
+static void sighandler(int sig)
+{
+	if (sig == SIGUSR1) dumping = 1;
+	else if (sig == SIGUSR2) swapping = 1;
+	else stopping = 1;
+}
+
+static pid_t spawn(void)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		signal(SIGTERM, SIG_DFL);
+		/* channels are joined on sockets shared with the supervisor and
+		 * our siblings, so exit without leaving them */
+		server_run();
+		_exit(EXIT_SUCCESS);
+	}
+	if (pid == -1) {
+		ERROR("fork(): %s", strerror(errno));
+	}
+	else {
+		DEBUG("worker process %i started", pid);
+	}
+	return pid;
+}
+
+/* Fork config.processes workers which all serve the sockets bound here.
+ * Each datagram is read by exactly one worker.  Dead workers are replaced
+ * until we are asked to stop */
+static int supervise(void)
+{
+	struct sigaction sa = { .sa_handler = sighandler };
+	const int n = config.processes;
+	time_t *started;
+	pid_t *pids;
+	pid_t pid;
+	int status;
+
+	pids = calloc(n, sizeof(pid_t));
+	started = calloc(n, sizeof(time_t));
+	if (!pids || !started) {
+		free(pids);
+		free(started);
+		return -1;
+	}
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	/* each worker has its own latency histograms and modules, so pass
+	 * SIGUSR1 and SIGUSR2 on */
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	/* workers share our sockets, so handler changes need a restart */
+	signal(SIGHUP, SIG_IGN);
+	for (int i = 0; i < n; i++) {
+		pids[i] = spawn();
+		started[i] = time(NULL);
+	}
+	while (!stopping) {
+		if ((pid = wait(&status)) == -1) {
+			if (errno != EINTR) break;
+			if (dumping) {
+				for (int i = 0; i < n; i++) {
+					if (pids[i] > 0) kill(pids[i], SIGUSR1);
+				}
+			}
+			if (swapping) {
+				for (int i = 0; i < n; i++) {
+					if (pids[i] > 0) kill(pids[i], SIGUSR2);
+				}
+			}
+			dumping = 0;
+			swapping = 0;
+			continue;
+		}
+		for (int i = 0; i < n; i++) {
+			if (pids[i] != pid) continue;
+			if (WIFSIGNALED(status)) {
+				ERROR("worker process %i killed by signal %i", pid, WTERMSIG(status));
+			}
+			else {
+				INFO("worker process %i exited (%i)", pid, WEXITSTATUS(status));
+			}
+			pids[i] = 0;
+			/* in case it died without removing its stats */
+			stats_remove(pid);
+			if (stopping) break;
+			/* don't spin if a worker dies as soon as it starts */
+			if (time(NULL) - started[i] < 1) sleep(1);
+			pids[i] = spawn();
+			started[i] = time(NULL);
+			break;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		if (pids[i] > 0) kill(pids[i], SIGINT);
+	}
+	for (int i = 0; i < n; i++) {
+		if (pids[i] > 0) waitpid(pids[i], NULL, 0);
+	}
+	free(started);
+	free(pids);
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
 	if (opts_parse(argc, argv) == -1 || config_parse()) return EXIT_FAILURE;
-	server_start();
+	if (config.daemon && daemon(1, 0) == -1) {
+		perror("daemon()");
+		return EXIT_FAILURE;
+	}
+	if (config.processes > 0) {
+		if (!server_bind()) {
+			supervise();
+			server_unbind();
+		}
+	}
+	else server_start();
 	config_free();
 	return EXIT_SUCCESS;
 }
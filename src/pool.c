@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "pool.h"
+
+/* Each worker owns a deque.  Producers append to the back of each deque in
+ * turn, the owner takes from the front and an idle worker steals from the
+ * back of its neighbours.  One counting semaphore tracks queued items, so a
+ * worker that wakes is guaranteed to find an item somewhere. */
+
+typedef struct pool_deque_s pool_deque_t;
+struct pool_deque_s {
+	pthread_mutex_t	lock;
+	void **		items;
+	size_t		head;
+	size_t		count;
+	pthread_t	thread;
+	pool_t *	pool;
+	int		id;
+	int		started;
+} __attribute__((aligned(64)));
+
+struct pool_s {
+	pool_deque_t *	deques;
+	pool_fn_t *	fn;
+	pool_fn_t *	idle;
+	sem_t		sem;
+	size_t		qlen;
+	unsigned int	next;
+	int		workers;
+	int		stop;
+};
+
+static int pool_deque_push(pool_deque_t *dq, void *arg)
+{
+	int ret = -1;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count < dq->pool->qlen) {
+		dq->items[(dq->head + dq->count++) % dq->pool->qlen] = arg;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return ret;
+}
+
+static int pool_deque_empty(pool_deque_t *dq)
+{
+	int empty;
+	pthread_mutex_lock(&dq->lock);
+	empty = !dq->count;
+	pthread_mutex_unlock(&dq->lock);
+	return empty;
+}
+
+/* owner takes oldest item from front */
+static void *pool_deque_pop(pool_deque_t *dq)
+{
+	void *arg = NULL;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		arg = dq->items[dq->head];
+		dq->head = (dq->head + 1) % dq->pool->qlen;
+		dq->count--;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return arg;
+}
+
+/* thieves take newest item from back, leaving the owner its cache-warm front */
+static void *pool_deque_steal(pool_deque_t *dq)
+{
+	void *arg = NULL;
+	if (pthread_mutex_trylock(&dq->lock)) return NULL;
+	if (dq->count) {
+		arg = dq->items[(dq->head + --dq->count) % dq->pool->qlen];
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return arg;
+}
+
+static void *pool_take(pool_deque_t *dq)
+{
+	pool_t *pool = dq->pool;
+	void *arg;
+	if ((arg = pool_deque_pop(dq))) return arg;
+	for (int i = 1; i < pool->workers; i++) {
+		if ((arg = pool_deque_steal(&pool->deques[(dq->id + i) % pool->workers])))
+			return arg;
+	}
+	return NULL;
+}
+
+static void *pool_worker(void *arg)
+{
+	pool_deque_t *dq = arg;
+	pool_t *pool = dq->pool;
+	void *item;
+	for (;;) {
+		while (sem_wait(&pool->sem) == -1 && errno == EINTR);
+		/* our item may be held by a thief mid-steal, so keep looking */
+		while (!(item = pool_take(dq))) {
+			if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) return NULL;
+			sched_yield();
+		}
+		pool->fn(item);
+		if (pool->idle && pool_deque_empty(dq)) pool->idle(NULL);
+	}
+	return NULL;
+}
+
+int pool_push(pool_t *pool, void *arg)
+{
+	unsigned int n;
+	if (!arg) {
+		errno = EINVAL;
+		return -1;
+	}
+	n = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < pool->workers; i++) {
+		if (!pool_deque_push(&pool->deques[(n + i) % pool->workers], arg)) {
+			sem_post(&pool->sem);
+			return 0;
+		}
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+void pool_free(pool_t *pool)
+{
+	void *item;
+	if (!pool) return;
+	__atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < pool->workers; i++) sem_post(&pool->sem);
+	for (int i = 0; i < pool->workers; i++) {
+		if (pool->deques[i].started) pthread_join(pool->deques[i].thread, NULL);
+	}
+	for (int i = 0; i < pool->workers; i++) {
+		while ((item = pool_deque_pop(&pool->deques[i]))) pool->fn(item);
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].items);
+	}
+	sem_destroy(&pool->sem);
+	free(pool->deques);
+	free(pool);
+}
+
+pool_t *pool_create(int workers, size_t qlen, pool_fn_t *fn, pool_fn_t *idle)
+{
+	pool_t *pool;
+	pool_deque_t *dq;
+	if (workers < 1 || !qlen || !fn) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!(pool = calloc(1, sizeof(pool_t)))) return NULL;
+	pool->fn = fn;
+	pool->idle = idle;
+	pool->qlen = qlen;
+	sem_init(&pool->sem, 0, 0);
+	/* deques are cache-line aligned so owners and thieves don't false share */
+	if (!(pool->deques = aligned_alloc(64, workers * sizeof(pool_deque_t)))) {
+		sem_destroy(&pool->sem);
+		free(pool);
+		return NULL;
+	}
+	memset(pool->deques, 0, workers * sizeof(pool_deque_t));
+	for (int i = 0; i < workers; i++) {
+		dq = &pool->deques[i];
+		dq->pool = pool;
+		dq->id = i;
+		pthread_mutex_init(&dq->lock, NULL);
+		if (!(dq->items = calloc(qlen, sizeof(void *)))) {
+			pool_free(pool);
+			return NULL;
+		}
+		pool->workers++;
+	}
+	for (int i = 0; i < workers; i++) {
+		dq = &pool->deques[i];
+		if (pthread_create(&dq->thread, NULL, pool_worker, dq)) {
+			ERROR("unable to create worker thread %i", i);
+			pool_free(pool);
+			return NULL;
+		}
+		dq->started = 1;
+	}
+	DEBUG("worker pool started with %i workers", workers);
+	return pool;
+}
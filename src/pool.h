@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_POOL_H
+#define _LSDM_POOL_H 1
+
+#include <stddef.h>
+
+/* default capacity of each worker deque */
+#define POOL_QLEN_DEFAULT 1024
+
+typedef struct pool_s pool_t;
+typedef void pool_fn_t(void *arg);
+
+/* create pool of workers, each with a deque of qlen items, calling fn for
+ * every item pushed.  If idle is not NULL, a worker calls idle(NULL) whenever
+ * it has emptied its own deque.  Returns NULL on error */
+pool_t *pool_create(int workers, size_t qlen, pool_fn_t *fn, pool_fn_t *idle);
+
+/* queue arg (which must not be NULL) for processing by the next worker in
+ * turn.  Returns -1 and sets errno to EAGAIN if every deque is full */
+int	pool_push(pool_t *pool, void *arg);
+
+/* stop workers, process anything still queued and free pool */
+void	pool_free(pool_t *pool);
+
+#endif /* _LSDM_POOL_H */
@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <sodium.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include "ratelimit.h"
+
+/* Each bucket is a single word holding a tag from the key's hash and the
+ * bucket's theoretical arrival time (GCRA, equivalent to a token bucket) in
+ * microseconds since the table was created.  A bucket is updated with one
+ * compare-and-swap, and one whose time has passed is full, so can be handed
+ * to another key.  If every bucket a key may use is busy, the key takes over
+ * the first along with its debt, so a flood of new keys can't escape limits.
+ * Times are RATELIMIT_TIMEBITS wide, wrapping after about 203 days, so are
+ * only ever compared by how far one runs ahead of the other */
+#define RATELIMIT_PROBE 4
+#define RATELIMIT_TAGBITS 20
+#define RATELIMIT_TIMEBITS (64 - RATELIMIT_TAGBITS)
+#define RATELIMIT_TIMEMASK ((UINT64_C(1) << RATELIMIT_TIMEBITS) - 1)
+#define RATELIMIT_TAG(b) ((b) >> RATELIMIT_TIMEBITS)
+#define RATELIMIT_TAT(b) ((b) & RATELIMIT_TIMEMASK)
+#define RATELIMIT_BUCKET(tag, tat) (((uint64_t)(tag) << RATELIMIT_TIMEBITS) | (tat))
+
+struct ratelimit_s {
+	uint64_t *	buckets;
+	uint64_t	mask;
+	unsigned char	key[crypto_shorthash_KEYBYTES];
+	uint64_t	interval;	/* microseconds per token */
+	uint64_t	tolerance;	/* how far ahead of now a bucket may run */
+	struct timespec	epoch;
+	uint64_t	offset;		/* added to the clock, see ratelimit_clock() */
+	unsigned long	limited;
+};
+
+/* SipHash, keyed per table, so senders can't choose keys that collide */
+static uint64_t ratelimit_hash(ratelimit_t *rl, const unsigned char *key, size_t len)
+{
+	unsigned char out[crypto_shorthash_BYTES];
+	uint64_t h;
+	crypto_shorthash(out, key, len, rl->key);
+	memcpy(&h, out, sizeof h);
+	return h;
+}
+
+static uint64_t ratelimit_elapsed(ratelimit_t *rl)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)(ts.tv_sec - rl->epoch.tv_sec) * 1000000
+		+ (ts.tv_nsec - rl->epoch.tv_nsec) / 1000;
+}
+
+static uint64_t ratelimit_now(ratelimit_t *rl)
+{
+	return (ratelimit_elapsed(rl) + rl->offset) & RATELIMIT_TIMEMASK;
+}
+
+/* how far bucket b's time runs ahead of now.  No bucket gets further ahead
+ * than tolerance + interval, so one that seems to is from before a wrap and
+ * is long past */
+static uint64_t ratelimit_lead(ratelimit_t *rl, uint64_t b, uint64_t now)
+{
+	const uint64_t lead = (RATELIMIT_TAT(b) - now) & RATELIMIT_TIMEMASK;
+	if (!b) return 0; /* never used */
+	return (lead <= rl->tolerance + rl->interval) ? lead : 0;
+}
+
+int ratelimit_check(ratelimit_t *rl, const void *key, size_t keylen)
+{
+	const uint64_t now = ratelimit_now(rl);
+	const uint64_t hash = ratelimit_hash(rl, key, keylen);
+	uint64_t tag = RATELIMIT_TAG(hash), lead, old, *bucket;
+	if (!tag) tag = 1; /* zero marks a bucket never used */
+	for (;;) {
+		bucket = NULL;
+		for (int i = 0; i < RATELIMIT_PROBE; i++) {
+			uint64_t *b = &rl->buckets[(hash + i) & rl->mask];
+			uint64_t v = __atomic_load_n(b, __ATOMIC_RELAXED);
+			if (RATELIMIT_TAG(v) == tag) {
+				bucket = b;
+				old = v;
+				break;
+			}
+			if (!bucket && !ratelimit_lead(rl, v, now)) {
+				bucket = b;
+				old = v;
+			}
+		}
+		if (!bucket) {
+			bucket = &rl->buckets[hash & rl->mask];
+			old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+		}
+		lead = ratelimit_lead(rl, old, now);
+		if (lead > rl->tolerance) {
+			__atomic_add_fetch(&rl->limited, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+		if (__atomic_compare_exchange_n(bucket, &old,
+				RATELIMIT_BUCKET(tag, (now + lead + rl->interval) & RATELIMIT_TIMEMASK), 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return 0;
+	}
+}
+
+void ratelimit_clock(ratelimit_t *rl, uint64_t us)
+{
+	rl->offset = us - ratelimit_elapsed(rl);
+}
+
+unsigned long ratelimit_limited(ratelimit_t *rl)
+{
+	return __atomic_load_n(&rl->limited, __ATOMIC_RELAXED);
+}
+
+void ratelimit_free(ratelimit_t *rl)
+{
+	if (!rl) return;
+	free(rl->buckets);
+	free(rl);
+}
+
+ratelimit_t *ratelimit_create(size_t slots, unsigned int rate, unsigned int burst)
+{
+	ratelimit_t *rl;
+	size_t n = 1;
+	if (!slots || !rate || rate > 1000000) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (n < slots) n <<= 1;
+	if (!(rl = calloc(1, sizeof(ratelimit_t)))) return NULL;
+	if (!(rl->buckets = calloc(n, sizeof(uint64_t)))) {
+		free(rl);
+		return NULL;
+	}
+	if (getrandom(rl->key, sizeof rl->key, 0) != (ssize_t)sizeof rl->key) {
+		ratelimit_free(rl);
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &rl->epoch);
+	rl->mask = n - 1;
+	rl->interval = 1000000 / rate;
+	rl->tolerance = rl->interval * ((burst > 1) ? burst - 1 : 0);
+	/* a bucket's lead must be well inside the clock's range */
+	if (rl->tolerance + rl->interval > RATELIMIT_TIMEMASK >> 2) {
+		ratelimit_free(rl);
+		errno = EINVAL;
+		return NULL;
+	}
+	return rl;
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_RATELIMIT_H
+#define _LSDM_RATELIMIT_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* buckets per table, rounded up to a power of two */
+#define RATELIMIT_SLOTS_DEFAULT 4096
+
+typedef struct ratelimit_s ratelimit_t;
+
+/* create table of slots token buckets, each refilling at rate tokens per
+ * second up to burst.  Returns NULL on error */
+ratelimit_t *ratelimit_create(size_t slots, unsigned int rate, unsigned int burst);
+
+/* take a token from the bucket for key.  Returns 0 if one was available, or
+ * -1 if key is over its rate.  Safe to call from any number of threads */
+int	ratelimit_check(ratelimit_t *rl, const void *key, size_t keylen);
+
+/* set rl's clock, in microseconds and wrapping at 2^44, to read us now.
+ * For testing */
+void	ratelimit_clock(ratelimit_t *rl, uint64_t us);
+
+/* number of checks refused so far */
+unsigned long ratelimit_limited(ratelimit_t *rl);
+
+void	ratelimit_free(ratelimit_t *rl);
+
+#endif /* _LSDM_RATELIMIT_H */
@@ -0,0 +1,232 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#define _GNU_SOURCE /* sendmmsg() */
+#include <endian.h>
+#include <errno.h>
+#include <librecast.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "reply.h"
+#include "wheel.h"
+#include "wire.h"
+
+/* A thread's queue is only touched by the thread, and by its timer, which
+ * flushes deferred replies that have waited REPLY_DELAY while the thread is
+ * busy elsewhere, so lock stays uncontended */
+typedef struct reply_queue_s reply_queue_t;
+struct reply_queue_s {
+	pthread_mutex_t		lock;
+	wheel_timer_t		timer;
+	wheel_t *		armed;	/* wheel the timer is pending on */
+	struct mmsghdr		mmsg[REPLY_BATCH];
+	struct iovec		iov[REPLY_BATCH][2];
+	wire_msghead_t		head[REPLY_BATCH];
+	struct sockaddr_in6	dst[REPLY_BATCH];
+	unsigned char		arena[REPLY_ARENA];
+	struct timespec		first;
+	uint64_t		seq;
+	size_t			used;
+	int			count;
+	int			sock;
+	int			defer;
+};
+
+static pthread_key_t reply_key;
+static pthread_once_t reply_once = PTHREAD_ONCE_INIT;
+static __thread reply_queue_t *queue;
+
+/* send buffer for new queues' sockets, see reply_sndbuf() */
+static int reply_bufsize;
+
+/* wheel for the queues' timers, see reply_timers() */
+static wheel_t *reply_wheel;
+static pthread_rwlock_t reply_wheel_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* call with q's lock held, or from its thread once the timer is stopped */
+static int reply_queue_flush(reply_queue_t *q)
+{
+	int sent = 0, n;
+	if (!q->count) return 0;
+	while (sent < q->count) {
+		if ((n = sendmmsg(q->sock, &q->mmsg[sent], q->count - sent, 0)) == -1) {
+			if (errno == EINTR) continue;
+			ERROR("sendmmsg(): %s, dropping %i replies", strerror(errno), q->count - sent);
+			break;
+		}
+		sent += n;
+	}
+	q->count = 0;
+	q->used = 0;
+	return (sent) ? sent : -1;
+}
+
+static void reply_queue_free(void *arg)
+{
+	reply_queue_t *q = arg;
+	wheel_t *w;
+	pthread_mutex_lock(&q->lock);
+	w = q->armed;
+	pthread_mutex_unlock(&q->lock);
+	/* not holding q's lock, which a running timer may be waiting for */
+	pthread_rwlock_rdlock(&reply_wheel_lock);
+	if (w && w == reply_wheel) wheel_cancel(w, &q->timer);
+	pthread_rwlock_unlock(&reply_wheel_lock);
+	reply_queue_flush(q);
+	close(q->sock);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+	queue = NULL;
+}
+
+/* q's oldest deferred reply has waited REPLY_DELAY.  Anything queued since a
+ * flush by its thread goes early, which only costs a smaller batch */
+static void reply_expire(void *arg)
+{
+	reply_queue_t *q = arg;
+	pthread_mutex_lock(&q->lock);
+	q->armed = NULL;
+	reply_queue_flush(q);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* start q's timer, if it isn't pending.  Call with q's lock held */
+static void reply_arm(reply_queue_t *q)
+{
+	pthread_rwlock_rdlock(&reply_wheel_lock);
+	if (reply_wheel && q->armed != reply_wheel
+	&& !wheel_add(reply_wheel, &q->timer, (REPLY_DELAY + 999999) / 1000000, 0, reply_expire, q))
+		q->armed = reply_wheel;
+	pthread_rwlock_unlock(&reply_wheel_lock);
+}
+
+static void reply_key_create(void)
+{
+	pthread_key_create(&reply_key, reply_queue_free);
+}
+
+static reply_queue_t *reply_queue(void)
+{
+	int opt = 1, size;
+	if (queue) return queue;
+	pthread_once(&reply_once, reply_key_create);
+	if (!(queue = calloc(1, sizeof(reply_queue_t)))) return NULL;
+	pthread_mutex_init(&queue->lock, NULL);
+	if ((queue->sock = socket(AF_INET6, SOCK_DGRAM, 0)) == -1) {
+		ERROR("unable to create reply socket: %s", strerror(errno));
+		pthread_mutex_destroy(&queue->lock);
+		free(queue);
+		return (queue = NULL);
+	}
+	/* set loopback in case we're on the same host as the sender */
+	setsockopt(queue->sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &opt, sizeof opt);
+	if ((size = __atomic_load_n(&reply_bufsize, __ATOMIC_RELAXED))
+	&& setsockopt(queue->sock, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof size) == -1
+	&& setsockopt(queue->sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof size) == -1)
+	{
+		ERROR("unable to set sndbuf on reply socket: %s", strerror(errno));
+	}
+	pthread_setspecific(reply_key, queue);
+	return queue;
+}
+
+static uint64_t reply_age(const struct timespec *ts)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - ts->tv_sec) * 1000000000 + now.tv_nsec - ts->tv_nsec;
+}
+
+int reply_flush(void)
+{
+	reply_queue_t *q = queue;
+	int ret;
+	if (!q) return 0;
+	pthread_mutex_lock(&q->lock);
+	ret = reply_queue_flush(q);
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+int reply_enqueue(lc_channel_t *chan, const void *data, size_t len)
+{
+	reply_queue_t *q;
+	struct sockaddr_in6 *sa;
+	struct timespec ts;
+	int i, ret = 0;
+
+	if (!chan || (!data && len)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len > REPLY_ARENA) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (!(q = reply_queue())) return -1;
+	if (!(sa = lc_channel_sockaddr(chan))) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&q->lock);
+	if (q->count == REPLY_BATCH || q->used + len > REPLY_ARENA) reply_queue_flush(q);
+	i = q->count;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	q->head[i].timestamp = htobe64((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+	q->head[i].seq = htobe64(++q->seq);
+	q->head[i].rnd = htobe64(((uint64_t)random() << 32) | (uint64_t)random());
+	q->head[i].op = 0;
+	q->head[i].len = htobe64(len);
+	q->dst[i] = *sa;
+	memcpy(q->arena + q->used, data, len);
+	q->iov[i][0].iov_base = &q->head[i];
+	q->iov[i][0].iov_len = sizeof(wire_msghead_t);
+	q->iov[i][1].iov_base = q->arena + q->used;
+	q->iov[i][1].iov_len = len;
+	memset(&q->mmsg[i], 0, sizeof(struct mmsghdr));
+	q->mmsg[i].msg_hdr.msg_name = &q->dst[i];
+	q->mmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+	q->mmsg[i].msg_hdr.msg_iov = q->iov[i];
+	q->mmsg[i].msg_hdr.msg_iovlen = 2;
+	q->used += len;
+	if (!q->count++) clock_gettime(CLOCK_MONOTONIC, &q->first);
+	if (!q->defer || reply_age(&q->first) >= REPLY_DELAY)
+		ret = (reply_queue_flush(q) == -1) ? -1 : 0;
+	else if (q->count == 1)
+		reply_arm(q);
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+void reply_sndbuf(int size)
+{
+	int cur = __atomic_load_n(&reply_bufsize, __ATOMIC_RELAXED);
+	while (size > cur && !__atomic_compare_exchange_n(&reply_bufsize, &cur, size, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void reply_defer(int on)
+{
+	reply_queue_t *q = reply_queue();
+	if (q) q->defer = on;
+}
+
+void reply_timers(wheel_t *w)
+{
+	pthread_rwlock_wrlock(&reply_wheel_lock);
+	reply_wheel = w;
+	pthread_rwlock_unlock(&reply_wheel_lock);
+}
+
+void reply_free(void)
+{
+	if (!queue) return;
+	pthread_setspecific(reply_key, NULL);
+	reply_queue_free(queue);
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_REPLY_H
+#define _LSDM_REPLY_H 1
+
+#include <librecast/types.h>
+#include <stddef.h>
+#include "wheel.h"
+
+/* replies queued per thread before a flush is forced */
+#define REPLY_BATCH 64
+
+/* bytes of reply payload buffered per thread */
+#define REPLY_ARENA 65536
+
+/* longest a queued reply waits for the rest of its batch (nanoseconds) */
+#define REPLY_DELAY 1000000
+
+/* queue a copy of data for sending to chan.  If the calling thread has
+ * deferred replies, they are sent together with sendmmsg() when reply_flush()
+ * is called, the queue fills or REPLY_DELAY has passed.  Otherwise the reply
+ * is sent immediately.  Returns 0 on success, -1 on error */
+int	reply_enqueue(lc_channel_t *chan, const void *data, size_t len);
+
+/* send everything queued by the calling thread.  Returns the number of
+ * datagrams sent, or -1 on error */
+int	reply_flush(void);
+
+/* give reply sockets a send buffer of at least size bytes.  The largest size
+ * asked for applies to each thread's socket when its queue is created, so call
+ * before threads reply */
+void	reply_sndbuf(int size);
+
+/* hold replies queued by this thread until reply_flush() (on != 0) */
+void	reply_defer(int on);
+
+/* flush deferred replies from a timer on w once REPLY_DELAY has passed (to
+ * within a tick), even if their thread has moved on to a long call.  Without
+ * a wheel, they wait for the thread's next reply or reply_flush().  Set NULL
+ * once w is no longer run, before freeing it */
+void	reply_timers(wheel_t *w);
+
+/* flush and free the calling thread's queue */
+void	reply_free(void);
+
+#endif /* _LSDM_REPLY_H */
@@ -1,62 +1,2124 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 /* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
 
+#define _GNU_SOURCE /* recvmmsg(), pthread_attr_setaffinity_np() */
+#include <endian.h>
 #include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
 #include <librecast.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <time.h>
 #include <unistd.h>
+#include "async.h"
+#include "bufpool.h"
+#include "chanidx.h"
 #include "config.h"
+#include "dedup.h"
+#include "ingress.h"
 #include "log.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "reply.h"
 #include "server.h"
+#include "stats.h"
+#include "uring.h"
+#include "watchdog.h"
+#include "wheel.h"
 #include "wire.h"
 
+/* events fetched per epoll_wait() and messages read per wakeup */
+#define SERVER_EVENTS 8
+#define SERVER_RECV_BUDGET 64
+
+/* longest a loop thread waits in epoll_wait() before completing a pass */
+#define SERVER_QUIESCE_MS 100
+
+/* largest datagram payload read by the batched receive path */
+#define SERVER_MSGMAX 65536
+
+/* datagrams per recvmmsg() on a mux socket, which carries every channel */
+#define SERVER_MUX_BATCH 32
+
+/* most messages handed to a module's handle_msgv() in one call */
+#define SERVER_MSGV_MAX 64
+
+/* poll adaptive spins this long after the last datagram, unless the handler
+ * sets poll_window_us.  Busy poll asks the driver to spin SERVER_BUSY_POLL_US */
+#define SERVER_POLL_WINDOW_US 1000
+#define SERVER_BUSY_POLL_US 50
+
+/* submission slots and provided receive buffers per uring loop thread */
+#define SERVER_URING_ENTRIES 256
+#define SERVER_URING_BUFFERS 256
+
+/* a uring receive that ends in error is posted again after this, doubling
+ * each time, until it has failed SERVER_URING_RETRIES times in a row */
+#define SERVER_URING_RETRY_MS 10
+#define SERVER_URING_RETRIES 8
+
+/* ingress queue capacity for handlers that don't set one */
+#define SERVER_QUEUE_DEFAULT 1024
+
+/* asynchronous requests in flight for handlers that don't set inflight, and
+ * how long a retired module has to complete them before we complain, or at
+ * exit give up on them */
+#define SERVER_INFLIGHT_DEFAULT 1024
+#define SERVER_DRAIN_MS 5000
+
+/* resolution of the timers modules set through config.api */
+#define SERVER_TIMER_TICK_MS 1
+
+/* latency histograms are written to <latency_file>.<pid> on SIGUSR1 */
+#define SERVER_LATENCY_FILE "/tmp/lsdbd-latency"
+
+/* room for the SO_RXQ_OVFL drop count and IPV6_PKTINFO destination that come
+ * with a datagram */
+#define SERVER_CMSG_SPACE (CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct in6_pktinfo)))
+
+/* preallocated recvmmsg() state, batch datagrams at a time (one if unset), for
+ * every handler of the event loop engines.  Reading the msghdr ourselves gets
+ * us the kernel's drop count.  With a pool, each datagram is read into its own
+ * pool buffer (slot) which is handed on with the message, and buf is a single
+ * scratch buffer for reads made while the pool is exhausted */
+typedef struct server_batch_s server_batch_t;
+struct server_batch_s {
+	struct mmsghdr *	mmsg;
+	struct iovec *		iov;
+	wire_msghead_t *	head;
+	struct sockaddr_in6 *	addr;
+	struct in6_addr *	grp;	/* destination, from IPV6_PKTINFO */
+	unsigned char *		ctrl;
+	unsigned char *		buf;
+	void **			slot;
+	int			count;
+};
+
+
+typedef struct server_handler_s server_handler_t;
+struct server_handler_s {
+	handler_t *		handler;
+	module_t *		mod;
+	lc_ctx_t *		lctx;
+	lc_socket_t *		sock;
+	lc_channel_t *		chan;
+	lc_channel_t **		chans;	/* handler->channels, joined on the same socket */
+	int			nchans;
+	chanidx_t *		idx;	/* routes by group, if the socket has several */
+	server_handler_t *	mux;	/* whose socket we share, see server_mux() */
+	server_batch_t		batch;
+	ingress_t		ingress;
+	ratelimit_t *		limit;
+	dedup_t *		dedup;
+	module_t		module; /* loaded on reload, see mod */
+	pthread_t		listener; /* listen engine, for modules with a context */
+	int			listening;
+	pthread_t		poller;	  /* poll busy or adaptive */
+	int			polling;  /* cleared to stop the poller */
+	int			ready;	/* module loaded: 0 not yet (lazy), 2 loading, -1 failed */
+	uint32_t		kdrops;	/* kernel drop total last seen */
+	uint64_t		rearm;	/* uring: when to post the receive again, 0 if posted */
+	int			rxerrs;	/* uring: receives failed in a row */
+	int			stalled; /* calls over watchdog_ms, still running */
+	int			overdue; /* async requests over watchdog_ms, as last seen */
+	int			stat;	/* stats slot, -1 if not counted */
+	int			fd;
+	int			epfd;
+	int			loop;
+};
+
+/* an epoll set and the threads serving it.  The epoll engine has one loop
+ * shared by all handlers, percore has one single-threaded loop per group */
+typedef struct server_loop_s server_loop_t;
+struct server_loop_s {
+	const char *	cpuset;
+	int		epfd;
+	int		threads;
+};
+
+/* a module copy retired, by a reload or swap, with asynchronous requests still
+ * in flight.  Its code stays mapped until they have completed, when the
+ * signal thread unloads it, see server_linger_run() */
+typedef struct server_linger_s server_linger_t;
+struct server_linger_s {
+	server_linger_t *	next;
+	module_t		mod;	/* moved out of the handler's */
+	async_t *		async;
+	uint64_t		since;
+	int			finit;
+	int			warned;
+};
+
+/* a loop thread.  passes counts trips round the loop, between which the
+ * thread holds no handler, so a reload knows when a removed one is unused */
+typedef struct server_thread_s server_thread_t;
+struct server_thread_s {
+	pthread_t	thread;
+	server_loop_t *	loop;
+	uint64_t	passes;
+	int		done;
+} __attribute__((aligned(64)));
+
 static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t reload;
+static volatile sig_atomic_t dump;
+static volatile sig_atomic_t swap;
+static lc_ctx_t *lctx;
+static server_handler_t **handlers;
+static int nhandlers;
+static server_handler_t **muxes;
+static int nmuxes;
+static char server_mux_channel[] = "mux";
+static server_loop_t *loops;
+static int nloops;
+static server_thread_t *threads;
+static int nthreads;
+static int stopfd = -1;
+static pool_t *pool;
+static bufpool_t *bufpool;
+static wheel_t *wheel;
+static server_linger_t *lingering;	/* signal thread only */
+
+static void *server_buf_get(void)
+{
+	return (bufpool) ? bufpool_get(bufpool) : NULL;
+}
+
+static void server_buf_put(void *buf)
+{
+	if (buf) bufpool_put(bufpool, buf);
+}
+
+static size_t server_buf_size(void)
+{
+	return (bufpool) ? bufpool_size(bufpool) : 0;
+}
+
+static int server_timer_add(wheel_timer_t *t, uint64_t ms, uint64_t period_ms,
+		void (*fn)(void *arg), void *arg)
+{
+	if (!wheel) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return wheel_add(wheel, t, ms, period_ms, fn, arg);
+}
+
+static int server_timer_cancel(wheel_timer_t *t)
+{
+	if (!wheel) {
+		errno = ENOENT;
+		return -1;
+	}
+	return wheel_cancel(wheel, t);
+}
+
+static api_t server_api = {
+	.reply = reply_enqueue,
+	.buf_get = server_buf_get,
+	.buf_put = server_buf_put,
+	.buf_size = server_buf_size,
+	.count = stats_count,
+	.count_op = stats_count_op,
+	.latency = stats_time_op,
+	.complete = async_complete,
+	.cancelled = async_cancelled,
+	.enter = async_enter,
+	.timer_add = server_timer_add,
+	.timer_cancel = server_timer_cancel,
+};
+
+/* the signals the server acts on */
+static void server_sigset(sigset_t *mask)
+{
+	sigemptyset(mask);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGHUP);
+	sigaddset(mask, SIGUSR1);
+	sigaddset(mask, SIGUSR2);
+}
 
 static void sighandler(int sig)
 {
-	(void)sig;
-	running = 0;
+	if (sig == SIGHUP) reload = 1;
+	else if (sig == SIGUSR1) dump = 1;
+	else if (sig == SIGUSR2) swap = 1;
+	else running = 0;
 }
 
 void server_stop(void)
 {
+	uint64_t u = 1;
 	DEBUG("Stopping server");
-	kill(getpid(), SIGINT);
+	/* the event loop blocks signals in its own threads, so wake it directly */
+	if (stopfd == -1 || write(stopfd, &u, sizeof u) != sizeof u)
+		kill(getpid(), SIGINT);
 }
 
-void server_start(void)
+static int server_arm(server_handler_t *sh, int op)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = sh };
+	return epoll_ctl(sh->epfd, op, sh->fd, &ev);
+}
+
+/* free function for messages whose data lives in a batch buffer */
+static void server_msg_keep(void *msg, void *hint)
+{
+	(void)msg; (void)hint;
+}
+
+/* free function for messages whose data is a pool buffer, passed as hint */
+static void server_msg_release(void *msg, void *hint)
+{
+	(void)msg;
+	bufpool_put(bufpool, hint);
+}
+
+static void server_msg_free(lc_message_t *msg)
+{
+	if (msg->free == server_msg_keep) return;
+	if (msg->free == server_msg_release) server_msg_release(msg, msg->hint);
+	else lc_msg_free(msg);
+}
+
+static uint64_t server_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* request tracking for mod, one of sh's, if it has handle_async() */
+static async_t *server_async_new(server_handler_t *sh, module_t *mod)
+{
+	handler_t *h = sh->handler;
+	async_t *a = NULL;
+	if (mod->handle_async
+	&& !(a = async_create((h->inflight > 0) ? (unsigned int)h->inflight : SERVER_INFLIGHT_DEFAULT,
+			(uint64_t)h->timeout_ms * 1000000, sh->stat, server_msg_free)))
+		ERROR("unable to track requests for channel '%s', handling synchronously", h->channel);
+	return a;
+}
+
+static void server_async_init(server_handler_t *sh)
+{
+	__atomic_store_n(&sh->mod->async, server_async_new(sh, sh->mod), __ATOMIC_RELEASE);
+}
+
+/* load a lazy handler's module on its first message.  Other threads with a
+ * message for it wait.  Returns -1 if it couldn't be loaded */
+static int server_module_ready(server_handler_t *sh)
+{
+	int ready = __atomic_load_n(&sh->ready, __ATOMIC_ACQUIRE), expect = 0;
+	if (ready == 1) return 0;
+	if (!ready && __atomic_compare_exchange_n(&sh->ready, &expect, 2, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	{
+		if (config_module_load(sh->mod, sh->handler) == -1) {
+			ERROR("unable to load module '%s' for channel '%s'", sh->handler->module,
+					sh->handler->channel);
+			ready = -1;
+		}
+		else {
+			server_async_init(sh);
+			INFO("loaded '%s' for channel '%s' on first message", sh->handler->module,
+					sh->handler->channel);
+			ready = 1;
+		}
+		__atomic_store_n(&sh->ready, ready, __ATOMIC_RELEASE);
+		return (ready == 1) ? 0 : -1;
+	}
+	while ((ready = __atomic_load_n(&sh->ready, __ATOMIC_ACQUIRE)) == 2) usleep(100);
+	return (ready == 1) ? 0 : -1;
+}
+
+/* a module call for sh has run past watchdog_ms.  Runs on the watchdog
+ * thread, which server_quiesce() waits for before sh can go */
+static void server_stall(watchdog_stall_t *st)
+{
+	server_handler_t *sh = st->arg;
+	char **sym;
+	stats_add(sh->stat, STAT_STALLS, 1);
+	__atomic_add_fetch(&sh->stalled, 1, __ATOMIC_RELEASE);
+	ERROR("channel '%s' stuck in opcode %u for %lums, over watchdog_ms %i%s",
+			sh->handler->channel, st->op, (unsigned long)(st->elapsed / 1000000),
+			sh->handler->watchdog_ms, (st->nframes) ? ":" : ", no stack");
+	if (!st->nframes || !(sym = backtrace_symbols(st->frames, st->nframes))) return;
+	for (int i = 0; i < st->nframes; i++) ERROR("  #%i %s", i, sym[i]);
+	free(sym);
+}
+
+/* an asynchronous request of sh's has been in flight past watchdog_ms.  Runs
+ * on the signal thread, see server_async_check().  No thread is in the
+ * module for it, so there is no stack to take */
+static void server_overdue(void *arg, lc_message_t *msg, uint64_t elapsed)
+{
+	server_handler_t *sh = arg;
+	stats_add(sh->stat, STAT_STALLS, 1);
+	ERROR("channel '%s' request in opcode %u open for %lums, over watchdog_ms %i",
+			sh->handler->channel, (msg->len) ? ((unsigned char *)msg->data)[0] : 0,
+			(unsigned long)(elapsed / 1000000), sh->handler->watchdog_ms);
+}
+
+/* time the module call about to be made for n messages from msg, if sh has a
+ * budget, which is for each */
+static void server_watch(server_handler_t *sh, lc_message_t *msg, int n)
+{
+	if (sh->handler->watchdog_ms > 0)
+		watchdog_enter(sh, (uint64_t)sh->handler->watchdog_ms * 1000000 * n,
+				(msg->len) ? ((unsigned char *)msg->data)[0] : 0);
+}
+
+static void server_unwatch(server_handler_t *sh)
+{
+	if (sh->handler->watchdog_ms > 0 && watchdog_leave())
+		__atomic_sub_fetch(&sh->stalled, 1, __ATOMIC_RELEASE);
+}
+
+static void server_dispatch(server_handler_t *sh, lc_message_t *msg)
+{
+	const uint64_t start = server_now();
+	module_req_t *req;
+	module_t *mod;
+	async_t *async;
+	stats_enter(sh->stat);
+	if (server_module_ready(sh) == -1) {
+		stats_add(sh->stat, STAT_DROPS, 1);
+		server_msg_free(msg);
+		return;
+	}
+	/* held, so a swap waits for us before unloading it.  A request is
+	 * tracked with the copy that starts it */
+	mod = config_module_enter(&sh->mod);
+	if ((async = __atomic_load_n(&mod->async, __ATOMIC_ACQUIRE)) && mod->handle_async) {
+		/* the request takes the message, copying it out of a batch
+		 * buffer or job, and is timed until it completes.  The watchdog
+		 * here only covers handing it over, server_async_check() looks
+		 * for requests left open too long */
+		if ((req = async_start(async, msg, (msg->free == server_msg_keep), start))) {
+			server_watch(sh, async_msg(req), 1);
+			mod->handle_async(mod->ctx, async_msg(req), req);
+			server_unwatch(sh);
+			config_module_leave(mod);
+			return;
+		}
+		config_module_leave(mod);
+		stats_add(sh->stat, STAT_DROPS, 1);
+		server_msg_free(msg);
+		return;
+	}
+	server_watch(sh, msg, 1);
+	config_module_msg(mod, msg);
+	server_unwatch(sh);
+	config_module_leave(mod);
+	stats_time(sh->stat, STATS_OP_MSG, server_now() - start);
+	server_msg_free(msg);
+}
+
+/* tell sh's module about a receive error */
+static void server_module_err(server_handler_t *sh, int err)
 {
-	struct sigaction sa = { .sa_handler = sighandler };
-	lc_ctx_t *lctx;
-	lc_socket_t *sock;
-	lc_channel_t *chan;
 	module_t *mod;
+	if (!sh->mod) return;
+	mod = config_module_enter(&sh->mod);
+	config_module_err(mod, err);
+	config_module_leave(mod);
+}
 
-	DEBUG("Starting server");
+/* the handler's module takes batches.  Until a lazy module is loaded we can't
+ * tell, so its first messages go one at a time */
+static int server_vectored(server_handler_t *sh)
+{
+	module_t *mod = __atomic_load_n(&sh->mod, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&sh->ready, __ATOMIC_ACQUIRE) == 1
+		&& !__atomic_load_n(&mod->async, __ATOMIC_ACQUIRE)
+		&& config_module_vectored(mod);
+}
+
+/* hand n messages to sh's module in one call.  Each is timed as an equal
+ * share of the call */
+static void server_dispatchv(server_handler_t *sh, lc_message_t *msgs[], int n)
+{
+	const uint64_t start = server_now();
+	module_t *mod;
+	uint64_t each;
+	if (n == 1 || !server_vectored(sh)) {
+		for (int i = 0; i < n; i++) server_dispatch(sh, msgs[i]);
+		return;
+	}
+	stats_enter(sh->stat);
+	mod = config_module_enter(&sh->mod);
+	server_watch(sh, msgs[0], n);
+	config_module_msgv(mod, msgs, n);
+	server_unwatch(sh);
+	config_module_leave(mod);
+	each = (server_now() - start) / (uint64_t)n;
+	for (int i = 0; i < n; i++) {
+		stats_time(sh->stat, STATS_OP_MSG, each);
+		server_msg_free(msgs[i]);
+	}
+}
+
+/* messages for a vectored handler with no worker pool, held by the loop
+ * thread until the end of the receive so they go to the module together */
+typedef struct server_pending_s server_pending_t;
+struct server_pending_s {
+	server_handler_t *	sh;
+	int			count;
+	lc_message_t		msg[SERVER_MSGV_MAX];
+};
+static __thread server_pending_t pending;
+
+/* call before the buffers of held messages are reused */
+static void server_flush(void)
+{
+	lc_message_t *msgs[SERVER_MSGV_MAX];
+	if (!pending.count) return;
+	for (int i = 0; i < pending.count; i++) msgs[i] = &pending.msg[i];
+	server_dispatchv(pending.sh, msgs, pending.count);
+	pending.count = 0;
+}
+
+static void server_hold(server_handler_t *sh, lc_message_t *msg)
+{
+	if (!server_vectored(sh)) {
+		server_dispatch(sh, msg);
+		return;
+	}
+	if (pending.count && (pending.sh != sh || pending.count == SERVER_MSGV_MAX))
+		server_flush();
+	pending.sh = sh;
+	pending.msg[pending.count++] = *msg;
+}
+
+/* a job dropped by the ingress queue */
+static void server_job_drop(ingress_job_t *job)
+{
+	server_msg_free(&job->msg);
+	free(job);
+}
+
+static void server_ingress_free(server_handler_t *sh)
+{
+	ingress_t *q = &sh->ingress;
+	if (q->dropped_newest || q->dropped_oldest || q->dropped_expired) {
+		INFO("channel '%s' dropped %lu newest, %lu oldest, %lu expired",
+				sh->handler->channel, q->dropped_newest,
+				q->dropped_oldest, q->dropped_expired);
+	}
+	ingress_free(q);
+}
+
+/* worker has been handed a token for sh */
+static void server_job(void *arg)
+{
+	server_handler_t *sh = arg;
+	ingress_job_t *jobs[SERVER_MSGV_MAX];
+	lc_message_t *msgs[SERVER_MSGV_MAX];
+	int n;
+	__atomic_add_fetch(&sh->ingress.inflight, 1, __ATOMIC_ACQ_REL);
+	/* a vectored module takes whatever has queued up behind this token */
+	n = ingress_take(&sh->ingress, jobs, (server_vectored(sh)) ? SERVER_MSGV_MAX : 1,
+			(sh->ingress.deadline) ? server_now() : 0);
+	if (n) {
+		reply_defer(1);
+		for (int i = 0; i < n; i++) msgs[i] = &jobs[i]->msg;
+		server_dispatchv(sh, msgs, n);
+		for (int i = 0; i < n; i++) free(jobs[i]);
+	}
+	__atomic_sub_fetch(&sh->ingress.inflight, 1, __ATOMIC_RELEASE);
+}
+
+/* worker has run out of jobs, send any replies it has queued */
+static void server_idle(void *arg)
+{
+	(void)arg;
+	reply_flush();
+}
+
+/* limit by sender key, the first field of the packet as in the auth module,
+ * or the source address if there isn't one or the handler asks for it */
+static int server_ratelimit(server_handler_t *sh, lc_message_t *msg)
+{
+	struct iovec pkt = { .iov_base = msg->data, .iov_len = msg->len };
+	struct iovec key = {0};
+	uint8_t op, flags;
+	if (sh->handler->ratelimit_by == RATEKEY_KEY && wire_unpack(&pkt, &key, 1, &op, &flags) == -1)
+		key.iov_len = 0;
+	if (!key.iov_len) {
+		key.iov_base = &msg->src;
+		key.iov_len = sizeof msg->src;
+	}
+	return ratelimit_check(sh->limit, key.iov_base, key.iov_len);
+}
+
+/* queue message for the worker pool, or process it here if there is no pool,
+ * or the handler's queue couldn't be allocated */
+static void server_queue(server_handler_t *sh, lc_message_t *msg)
+{
+	ingress_job_t *job;
+	size_t copy = (msg->free == server_msg_keep) ? msg->len : 0;
+	stats_add(sh->stat, STAT_PACKETS, 1);
+	stats_add(sh->stat, STAT_BYTES, msg->len);
+	/* while a call is stuck, anything more would only wait behind it */
+	if (sh->handler->watchdog_shed
+	&& (__atomic_load_n(&sh->stalled, __ATOMIC_ACQUIRE) > 0
+	 || __atomic_load_n(&sh->overdue, __ATOMIC_ACQUIRE) > 0))
+	{
+		stats_add(sh->stat, STAT_DROPS, 1);
+		server_msg_free(msg);
+		return;
+	}
+	/* repeats go before costing a rate limit token or a queue slot */
+	if (sh->dedup && dedup_check(sh->dedup, msg->data, msg->len) == -1) {
+		stats_add(sh->stat, STAT_DUPS, 1);
+		server_msg_free(msg);
+		return;
+	}
+	if (sh->limit && server_ratelimit(sh, msg) == -1) {
+		stats_add(sh->stat, STAT_DROPS, 1);
+		server_msg_free(msg);
+		return;
+	}
+	if (pool && sh->ingress.ring[0].jobs && (job = malloc(sizeof(ingress_job_t) + copy))) {
+		job->msg = *msg;
+		job->queued = (sh->ingress.deadline) ? server_now() : 0;
+		/* batch buffers are reused on the next read, so take a copy.
+		 * Pool buffers belong to the message and are passed as is */
+		if (copy) job->msg.data = memcpy(job->data, msg->data, copy);
+		if (!ingress_push(&sh->ingress, job, sh->handler->drop)) return;
+		if (!pool_push(pool, sh)) return;
+		/* the pool is sized for every queue so this shouldn't happen, but
+		 * don't leave a job without a token */
+		if (ingress_take(&sh->ingress, &job, 1, (sh->ingress.deadline) ? server_now() : 0)) {
+			server_dispatch(sh, &job->msg);
+			free(job);
+		}
+		return;
+	}
+	server_hold(sh, msg);
+}
+
+static void server_batch_free(server_batch_t *b)
+{
+	for (int i = 0; b->slot && i < b->count; i++) server_buf_put(b->slot[i]);
+	free(b->slot);
+	free(b->mmsg);
+	free(b->iov);
+	free(b->head);
+	free(b->addr);
+	free(b->grp);
+	free(b->ctrl);
+	free(b->buf);
+	memset(b, 0, sizeof(server_batch_t));
+}
+
+static int server_batch_init(server_batch_t *b, int batch)
+{
+	const size_t bufsize = (bufpool) ? bufpool_size(bufpool) : SERVER_MSGMAX;
+	b->mmsg = calloc(batch, sizeof(struct mmsghdr));
+	b->iov = calloc(batch * 2, sizeof(struct iovec));
+	b->head = calloc(batch, sizeof(wire_msghead_t));
+	b->addr = calloc(batch, sizeof(struct sockaddr_in6));
+	b->grp = calloc(batch, sizeof(struct in6_addr));
+	b->ctrl = calloc(batch, SERVER_CMSG_SPACE);
+	b->buf = malloc((bufpool) ? bufsize : (size_t)batch * bufsize);
+	if (bufpool) b->slot = calloc(batch, sizeof(void *));
+	if (!b->mmsg || !b->iov || !b->head || !b->addr || !b->grp || !b->ctrl || !b->buf || (bufpool && !b->slot)) {
+		server_batch_free(b);
+		return -1;
+	}
+	b->count = batch;
+	for (int i = 0; i < batch; i++) {
+		b->iov[i * 2].iov_base = &b->head[i];
+		b->iov[i * 2].iov_len = sizeof(wire_msghead_t);
+		b->iov[i * 2 + 1].iov_base = b->buf + ((bufpool) ? 0 : (size_t)i * bufsize);
+		b->iov[i * 2 + 1].iov_len = bufsize;
+		b->mmsg[i].msg_hdr.msg_name = &b->addr[i];
+		b->mmsg[i].msg_hdr.msg_iov = &b->iov[i * 2];
+		b->mmsg[i].msg_hdr.msg_iovlen = 2;
+		b->mmsg[i].msg_hdr.msg_control = b->ctrl + (size_t)i * SERVER_CMSG_SPACE;
+	}
+	return 0;
+}
+
+/* give every empty slot a pool buffer to read into.  If the pool has run dry
+ * the slot reads into scratch and the datagram is dropped, which keeps memory
+ * bounded and the socket drained */
+static void server_batch_fill(server_batch_t *b)
+{
+	for (int i = 0; i < b->count; i++) {
+		if (!b->slot[i] && (b->slot[i] = bufpool_get(bufpool)))
+			b->iov[i * 2 + 1].iov_base = b->slot[i];
+		else if (!b->slot[i])
+			b->iov[i * 2 + 1].iov_base = b->buf;
+	}
+}
+
+/* count what the kernel dropped on sh's socket since we last looked, from the
+ * SO_RXQ_OVFL total that comes with a datagram once there have been drops */
+static void server_kdrops(server_handler_t *sh, uint32_t total)
+{
+	uint32_t last = __atomic_load_n(&sh->kdrops, __ATOMIC_RELAXED);
+	/* the total wraps, and only ever moves forward */
+	while ((int32_t)(total - last) > 0) {
+		if (__atomic_compare_exchange_n(&sh->kdrops, &last, total, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			stats_add(sh->stat, STAT_KDROPS, total - last);
+			break;
+		}
+	}
+}
+
+/* read a datagram's control messages, setting grp to the group it was sent
+ * to.  Returns 0 if there was no IPV6_PKTINFO to say */
+static int server_cmsg(server_handler_t *sh, struct msghdr *hdr, struct in6_addr *grp)
+{
+	struct in6_pktinfo pi;
+	struct cmsghdr *cmsg;
+	uint32_t total;
+	int found = 0;
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&total, CMSG_DATA(cmsg), sizeof total);
+			server_kdrops(sh, total);
+		}
+		else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+			memcpy(&pi, CMSG_DATA(cmsg), sizeof pi);
+			*grp = pi.ipi6_addr;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+/* queue msg, read from sh's socket, for the handler serving the group it was
+ * sent to.  A socket joined to one channel needs no lookup.  The index is
+ * replaced on reload, so is loaded once per datagram */
+static void server_route(server_handler_t *sh, lc_message_t *msg, int dst)
+{
+	chanidx_t *idx = __atomic_load_n(&sh->idx, __ATOMIC_ACQUIRE);
+	server_handler_t *to = sh;
+	void *chan = sh->chan;
+	if (idx) to = (dst) ? chanidx_get(idx, &msg->dst, &chan) : NULL;
+	if (!to || !to->mod) {
+		stats_add(sh->stat, STAT_DROPS, 1);
+		server_msg_free(msg);
+		return;
+	}
+	msg->chan = chan;
+	server_queue(to, msg);
+}
+
+/* read up to batch datagrams per syscall into preallocated buffers, returning
+ * the number read.  lc_msg_recv() strips the librecast header for us, here we
+ * do it ourselves */
+static int server_recv_batch(server_handler_t *sh)
+{
+	server_batch_t *b = &sh->batch;
+	const int batch = b->count;
+	lc_message_t msg;
+	size_t len;
+	int n, total, dst;
+	for (total = 0; total < SERVER_RECV_BUDGET; total += n) {
+		if (b->slot) server_batch_fill(b);
+		for (int i = 0; i < batch; i++) {
+			b->mmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+			b->mmsg[i].msg_hdr.msg_controllen = SERVER_CMSG_SPACE;
+		}
+		if ((n = recvmmsg(sh->fd, b->mmsg, batch, MSG_DONTWAIT, NULL)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			ERROR("recvmmsg on channel '%s': %s", sh->handler->channel, strerror(errno));
+			stats_add(sh->stat, STAT_ERRORS, 1);
+			server_module_err(sh, errno);
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			dst = server_cmsg(sh, &b->mmsg[i].msg_hdr, &b->grp[i]);
+			if (b->mmsg[i].msg_len < sizeof(wire_msghead_t)
+			|| (b->mmsg[i].msg_hdr.msg_flags & MSG_TRUNC))
+			{
+				stats_add(sh->stat, STAT_ERRORS, 1);
+				CONTINUE(LOG_ERROR, "dropping malformed datagram on channel '%s'",
+						sh->handler->channel);
+			}
+			len = b->mmsg[i].msg_len - sizeof(wire_msghead_t);
+			if (be64toh(b->head[i].len) < len) len = be64toh(b->head[i].len);
+			if (!b->slot) {
+				lc_msg_init_data(&msg, b->iov[i * 2 + 1].iov_base, len, server_msg_keep, NULL);
+			}
+			else if (b->slot[i]) {
+				/* the buffer now belongs to the message */
+				lc_msg_init_data(&msg, b->slot[i], len, server_msg_release, b->slot[i]);
+				b->slot[i] = NULL;
+			}
+			else {
+				stats_add(sh->stat, STAT_DROPS, 1);
+				CONTINUE(LOG_DEBUG, "buffer pool exhausted, dropping datagram on channel '%s'",
+						sh->handler->channel);
+			}
+			msg.src = b->addr[i].sin6_addr;
+			msg.dst = b->grp[i];
+			server_route(sh, &msg, dst);
+		}
+		/* the next read reuses the batch buffers */
+		server_flush();
+		if (n < batch) {
+			total += n;
+			break;
+		}
+	}
+	return total;
+}
+
+/* read what is waiting on sh's socket, up to SERVER_RECV_BUDGET messages.
+ * Returns the number read */
+static int server_drain(server_handler_t *sh)
+{
+	lc_message_t msg;
+	int i;
+	if (sh->batch.mmsg) return server_recv_batch(sh);
+	for (i = 0; i < SERVER_RECV_BUDGET; i++) {
+		if (lc_msg_recv(sh->sock, &msg) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			ERROR("recv on channel '%s': %s", sh->handler->channel, strerror(errno));
+			stats_add(sh->stat, STAT_ERRORS, 1);
+			server_module_err(sh, errno);
+			break;
+		}
+		server_route(sh, &msg, !IN6_IS_ADDR_UNSPECIFIED(&msg.dst));
+	}
+	server_flush();
+	return i;
+}
+
+static void server_recv(server_handler_t *sh)
+{
+	server_drain(sh);
+	reply_flush();
+	/* sockets are oneshot so only one loop thread reads each at a time */
+	if (server_arm(sh, EPOLL_CTL_MOD) == -1)
+		ERROR("unable to rearm channel '%s': %s", sh->handler->channel, strerror(errno));
+}
+
+static void *server_loop_thread(void *arg)
+{
+	server_thread_t *t = arg;
+	struct epoll_event ev[SERVER_EVENTS];
+	int n;
+	reply_defer(1);
+	while (running) {
+		if ((n = epoll_wait(t->loop->epfd, ev, SERVER_EVENTS, SERVER_QUIESCE_MS)) == -1) {
+			if (errno != EINTR) {
+				ERROR("epoll_wait(): %s", strerror(errno));
+				break;
+			}
+			n = 0;
+		}
+		for (int i = 0; i < n; i++) {
+			/* stopfd carries no handler, and is never read, so every
+			 * loop thread sees it and exits */
+			if (!ev[i].data.ptr) {
+				running = 0;
+				break;
+			}
+			server_recv(ev[i].data.ptr);
+		}
+		__atomic_add_fetch(&t->passes, 1, __ATOMIC_RELEASE);
+	}
+	reply_free();
+	__atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+	return arg;
+}
+
+/* post a multishot receive on sh's socket into the provided buffers.  hdr
+ * only tells the kernel how much room to leave for the source address and
+ * control messages */
+static int server_uring_arm(uring_t *r, server_handler_t *sh, struct msghdr *hdr)
+{
+	struct io_uring_sqe *sqe;
+	if (!(sqe = uring_sqe(r))) {
+		ERROR("unable to receive on channel '%s': %s", sh->handler->channel, strerror(errno));
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sh->fd;
+	sqe->addr = (uint64_t)(uintptr_t)hdr;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (uint64_t)(uintptr_t)sh;
+	return 0;
+}
+
+/* post sh's receive again now it has ended with res.  Running out of buffers
+ * isn't an error, as they are handed back before the receive is submitted.
+ * Other errors would only end it again at once, so back off, and give up on
+ * a socket that keeps failing.  Returns 1 if a retry is waiting */
+static int server_uring_rearm(uring_t *r, server_handler_t *sh, struct msghdr *hdr, int res)
+{
+	if (res >= 0 || res == -ENOBUFS) {
+		server_uring_arm(r, sh, hdr);
+		return 0;
+	}
+	if (++sh->rxerrs > SERVER_URING_RETRIES) {
+		ERROR("not receiving on channel '%s' after %i errors", sh->handler->channel,
+				SERVER_URING_RETRIES);
+		return 0;
+	}
+	sh->rearm = server_now() + ((uint64_t)SERVER_URING_RETRY_MS * 1000000 << (sh->rxerrs - 1));
+	return 1;
+}
+
+/* post the receives whose backoff is over, of every step-th of the count
+ * handlers in hs from first.  Returns how many are still waiting */
+static int server_uring_retry(uring_t *r, server_handler_t **hs, int count, int first, int step,
+		struct msghdr *hdr)
+{
+	const uint64_t now = server_now();
+	int waiting = 0;
+	for (int i = first; i < count; i += step) {
+		if (!hs[i]->rearm) continue;
+		if (hs[i]->rearm > now) {
+			waiting++;
+			continue;
+		}
+		hs[i]->rearm = 0;
+		server_uring_arm(r, hs[i], hdr);
+	}
+	return waiting;
+}
+
+/* buffers read from since the last flush, returned once held messages are
+ * handled */
+typedef struct server_uring_held_s server_uring_held_t;
+struct server_uring_held_s {
+	int		count;
+	unsigned short	bid[SERVER_MSGV_MAX];
+};
+
+static void server_uring_flush(uring_t *r, server_uring_held_t *held)
+{
+	server_flush();
+	for (int i = 0; i < held->count; i++) uring_buf_put(r, held->bid[i]);
+	held->count = 0;
+}
+
+/* a datagram, or error, from sh's multishot receive.  The buffer holds a
+ * struct io_uring_recvmsg_out, the source address and then the payload.  As
+ * with batch buffers, jobs take a copy.  The buffer goes back to the kernel
+ * once any message held for a vectored handler is handled */
+static void server_uring_recv(uring_t *r, server_handler_t *sh, struct io_uring_cqe *cqe,
+		struct msghdr *hdr, server_uring_held_t *held)
+{
+	struct io_uring_recvmsg_out *out;
+	struct msghdr ctrl = {0};
+	struct in6_addr grp;
+	wire_msghead_t *head;
+	lc_message_t msg;
+	unsigned short bid;
+	size_t len;
+	int dst;
+	if (cqe->res < 0) {
+		/* out of buffers ends the receive, leaving datagrams queued on
+		 * the socket until it is posted again */
+		if (cqe->res == -ENOBUFS) return;
+		ERROR("recv on channel '%s': %s", sh->handler->channel, strerror(-cqe->res));
+		stats_add(sh->stat, STAT_ERRORS, 1);
+		server_module_err(sh, -cqe->res);
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER)) return;
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	out = uring_buf(r, bid);
+	ctrl.msg_control = (char *)(out + 1) + hdr->msg_namelen;
+	ctrl.msg_controllen = out->controllen;
+	dst = server_cmsg(sh, &ctrl, &grp);
+	head = (wire_msghead_t *)((char *)(out + 1) + hdr->msg_namelen + hdr->msg_controllen);
+	if (out->payloadlen < sizeof(wire_msghead_t) || (out->flags & MSG_TRUNC)) {
+		stats_add(sh->stat, STAT_ERRORS, 1);
+		ERROR("dropping malformed datagram on channel '%s'", sh->handler->channel);
+	}
+	else {
+		len = out->payloadlen - sizeof(wire_msghead_t);
+		if (be64toh(head->len) < len) len = be64toh(head->len);
+		lc_msg_init_data(&msg, head + 1, len, server_msg_keep, NULL);
+		msg.src = ((struct sockaddr_in6 *)(out + 1))->sin6_addr;
+		msg.dst = grp;
+		server_route(sh, &msg, dst);
+	}
+	if (held->count == SERVER_MSGV_MAX) server_uring_flush(r, held);
+	held->bid[held->count++] = bid;
+}
+
+/* Loop thread of the uring engine.  Each thread has its own ring and serves
+ * every nth handler with a multishot receive that keeps filling provided
+ * buffers, so a busy thread enters the kernel once per batch of completions,
+ * plus a sendmmsg() for the replies queued meanwhile */
+static void *server_uring_thread(void *arg)
+{
+	server_thread_t *t = arg;
+	const int id = t - threads, count = t->loop->threads;
+	const size_t msgmax = (config.bufsize > 0) ? (size_t)config.bufsize : SERVER_MSGMAX;
+	struct msghdr hdr = {
+		.msg_namelen = sizeof(struct sockaddr_in6),
+		.msg_controllen = SERVER_CMSG_SPACE,
+	};
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	server_uring_held_t held = {0};
+	server_handler_t *sh;
+	uring_t ring;
+	int waiting = 0;
+	reply_defer(1);
+	if (uring_init(&ring, SERVER_URING_ENTRIES) == -1
+	|| uring_bufs(&ring, SERVER_URING_BUFFERS, sizeof(struct io_uring_recvmsg_out)
+			+ sizeof(struct sockaddr_in6) + SERVER_CMSG_SPACE + sizeof(wire_msghead_t)
+			+ msgmax) == -1)
+	{
+		ERROR("unable to set up io_uring: %s", strerror(errno));
+		server_stop();
+		goto exit_thread;
+	}
+	/* stopfd carries no handler, and is never read, so every thread sees it */
+	if ((sqe = uring_sqe(&ring))) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = stopfd;
+		sqe->poll32_events = POLLIN;
+	}
+	for (int i = id; i < nhandlers; i += count) {
+		server_handler_t *p = handlers[i];
+		if (p->mod && !p->polling && !p->mux) server_uring_arm(&ring, p, &hdr);
+	}
+	for (int i = id; i < nmuxes; i += count) server_uring_arm(&ring, muxes[i], &hdr);
+	while (running) {
+		if (uring_wait(&ring, (waiting) ? SERVER_URING_RETRY_MS : SERVER_QUIESCE_MS) == -1
+		&& errno != ETIME && errno != EINTR)
+		{
+			ERROR("io_uring_enter(): %s", strerror(errno));
+			break;
+		}
+		while ((cqe = uring_cqe(&ring))) {
+			if (!(sh = (server_handler_t *)(uintptr_t)cqe->user_data)) {
+				running = 0;
+			}
+			else {
+				server_uring_recv(&ring, sh, cqe, &hdr, &held);
+				if (cqe->res >= 0 && sh->rxerrs) sh->rxerrs = 0;
+				if (!(cqe->flags & IORING_CQE_F_MORE) && running)
+					waiting += server_uring_rearm(&ring, sh, &hdr, cqe->res);
+			}
+			uring_cqe_seen(&ring);
+		}
+		if (waiting) {
+			waiting = server_uring_retry(&ring, handlers, nhandlers, id, count, &hdr)
+				+ server_uring_retry(&ring, muxes, nmuxes, id, count, &hdr);
+		}
+		server_uring_flush(&ring, &held);
+		reply_flush();
+		__atomic_add_fetch(&t->passes, 1, __ATOMIC_RELEASE);
+	}
+exit_thread:
+	uring_free(&ring);
+	reply_free();
+	__atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+	return arg;
+}
+
+/* parse a cpu list such as "0-3,8" */
+static int server_cpuset(const char *spec, cpu_set_t *set)
+{
+	char *end;
+	long lo, hi;
+	CPU_ZERO(set);
+	while (*spec) {
+		lo = hi = strtol(spec, &end, 10);
+		if (end == spec) return -1;
+		if (*end == '-') {
+			spec = end + 1;
+			hi = strtol(spec, &end, 10);
+			if (end == spec) return -1;
+		}
+		if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) return -1;
+		while (lo <= hi) CPU_SET(lo++, set);
+		if (*end == ',') end++;
+		else if (*end) return -1;
+		spec = end;
+	}
+	return (CPU_COUNT(set)) ? 0 : -1;
+}
+
+static int server_loop_thread_create(server_thread_t *t)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int ret;
+	pthread_attr_init(&attr);
+	if (t->loop->cpuset) {
+		if (server_cpuset(t->loop->cpuset, &set) == -1) {
+			ERROR("invalid cpuset '%s', not pinning", t->loop->cpuset);
+		}
+		else pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+	}
+	ret = pthread_create(&t->thread, &attr,
+			(config.engine == ENGINE_URING) ? server_uring_thread : server_loop_thread, t);
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+/* Receive for a poll busy or adaptive handler, on a thread of its own, so a
+ * datagram is picked up without waiting for a wakeup.  Busy spins on a
+ * non-blocking read for as long as we run.  Adaptive spins for the window after
+ * the last datagram, then blocks in poll() until the next */
+static void *server_poll_thread(void *arg)
+{
+	server_handler_t *sh = arg;
+	const int busy = (sh->handler->poll == POLLMODE_BUSY);
+	const uint64_t window = (uint64_t)((sh->handler->poll_window_us > 0)
+			? sh->handler->poll_window_us : SERVER_POLL_WINDOW_US) * 1000;
+	struct pollfd pfd = { .fd = sh->fd, .events = POLLIN };
+	uint64_t last = server_now();
+	reply_defer(1);
+	while (running && __atomic_load_n(&sh->polling, __ATOMIC_ACQUIRE)) {
+		if (server_drain(sh)) {
+			reply_flush();
+			last = server_now();
+			continue;
+		}
+		if (busy || server_now() - last < window) continue;
+		if (poll(&pfd, 1, SERVER_QUIESCE_MS) > 0) last = server_now();
+	}
+	reply_free();
+	return arg;
+}
+
+/* start sh's poller, pinned to the handler's cpuset if it has one.  SO_BUSY_POLL
+ * has the kernel spin on the device queue as well, which needs CAP_NET_ADMIN
+ * above net.core.busy_read */
+static int server_poll_start(server_handler_t *sh)
+{
+	handler_t *h = sh->handler;
+	int us = (h->poll == POLLMODE_BUSY) ? SERVER_BUSY_POLL_US
+		: (h->poll_window_us > 0) ? h->poll_window_us : SERVER_POLL_WINDOW_US;
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int ret;
+	if (setsockopt(sh->fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof us) == -1)
+		DEBUG("SO_BUSY_POLL on channel '%s': %s", h->channel, strerror(errno));
+	pthread_attr_init(&attr);
+	if (h->cpuset && server_cpuset(h->cpuset, &set) == 0)
+		pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+	sh->polling = 1;
+	if ((ret = pthread_create(&sh->poller, &attr, server_poll_thread, sh))) {
+		ERROR("unable to start poller for channel '%s'", h->channel);
+		sh->polling = 0;
+	}
+	pthread_attr_destroy(&attr);
+	return (ret) ? -1 : 0;
+}
+
+static void server_poll_stop(server_handler_t *sh)
+{
+	if (!sh->polling) return;
+	__atomic_store_n(&sh->polling, 0, __ATOMIC_RELEASE);
+	pthread_join(sh->poller, NULL);
+}
+
+static size_t server_queue_size(handler_t *h)
+{
+	return (h->queue > 0) ? (size_t)h->queue : SERVER_QUEUE_DEFAULT;
+}
+
+/* set up a handler's limiter, buffers and queue, then watch its socket */
+static int server_handler_start(server_handler_t *sh)
+{
+	handler_t *h = sh->handler;
+	if (!sh->mod) return 0;
+	sh->stat = stats_handler(h->channel, h->module);
+	sh->epfd = loops[sh->loop].epfd;
+	if (h->ratelimit > 0
+	&& !(sh->limit = ratelimit_create(RATELIMIT_SLOTS_DEFAULT, h->ratelimit, h->ratelimit_burst)))
+		ERROR("invalid ratelimit for channel '%s', not limiting", h->channel);
+	if (h->dedup_ms > 0 && !(sh->dedup = dedup_create(DEDUP_SLOTS_DEFAULT, h->dedup_ms)))
+		ERROR("invalid dedup_ms for channel '%s', not suppressing duplicates", h->channel);
+	if (h->watchdog_ms > 0 && watchdog_start(server_stall) == -1)
+		ERROR("unable to start watchdog for channel '%s': %s", h->channel, strerror(errno));
+	/* lc_msg_recv() is only the fallback, as it hides the kernel's drops */
+	if (config.engine != ENGINE_URING && !sh->mux
+	&& server_batch_init(&sh->batch, (h->batch > 1) ? h->batch : 1) == -1)
+		ERROR("unable to allocate batch buffers for channel '%s'", h->channel);
+	sh->ready = !sh->mod->lazy;
+	if (sh->ready) server_async_init(sh);
+	if (pool && ingress_init(&sh->ingress, h, server_queue_size(h), sh->stat,
+				server_job_drop) == -1)
+	{
+		ERROR("unable to allocate ingress queue for channel '%s', dispatching from loop threads",
+				h->channel);
+	}
+	/* the mux reads for us */
+	if (sh->mux) return 0;
+	fcntl(sh->fd, F_SETFL, fcntl(sh->fd, F_GETFL) | O_NONBLOCK);
+	/* a handler that polls isn't watched by the loop threads.  If its
+	 * poller can't start it falls back to them */
+	if (h->poll != POLLMODE_BLOCK && server_poll_start(sh) == 0) return 0;
+	/* uring loop threads post their own receives */
+	if (config.engine == ENGINE_URING) return 0;
+	if (server_arm(sh, EPOLL_CTL_ADD) == -1) {
+		ERROR("unable to watch channel '%s': %s", h->channel, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* unload mod, cancelling its asynchronous requests.  If any are still in
+ * flight mod is moved to the lingering list instead, so the signal thread is
+ * never held up waiting for them */
+static void server_module_retire(module_t *mod, int finit)
+{
+	module_t *prev = mod->prev;
+	async_t *a = mod->async;
+	server_linger_t *l;
+	if (a) async_cancel(a);
+	mod->async = NULL;
+	if (!a || !async_inflight(a)) {
+		async_free(a);
+		config_module_unload(mod, finit);
+		return;
+	}
+	if ((l = calloc(1, sizeof(server_linger_t)))) {
+		l->mod = *mod;
+		l->mod.prev = NULL;
+		l->async = a;
+		l->since = server_now();
+		l->finit = finit;
+		l->next = lingering;
+		lingering = l;
+	}
+	else {
+		ERROR("unable to retire '%s' with requests in flight, leaving it loaded", mod->name);
+		async_free(a);
+	}
+	memset(mod, 0, sizeof(module_t));
+	mod->prev = prev;
+}
+
+/* unload lingering modules whose requests have all completed, and complain
+ * once about any still waiting after SERVER_DRAIN_MS.  The module's threads
+ * may only just have returned from completing the last, which its finit()
+ * waits out.  Returns the number left */
+static int server_linger_run(void)
+{
+	server_linger_t **p = &lingering, *l;
+	unsigned int inflight;
+	int n = 0;
+	while ((l = *p)) {
+		if (!(inflight = async_inflight(l->async))) {
+			*p = l->next;
+			async_free(l->async);
+			config_module_unload(&l->mod, l->finit);
+			free(l);
+			continue;
+		}
+		if (!l->warned && server_now() - l->since > (uint64_t)SERVER_DRAIN_MS * 1000000) {
+			ERROR("retired '%s' of channel '%s' has %u request(s) still in flight",
+					l->mod.name, l->mod.handler->channel, inflight);
+			l->warned = 1;
+		}
+		p = &l->next;
+		n++;
+	}
+	return n;
+}
+
+/* at exit, give lingering modules a while, then leave any with requests
+ * still in flight loaded rather than unmap the code running them */
+static void server_linger_stop(void)
+{
+	server_linger_t *l;
+	for (int ms = 0; server_linger_run() && ms < SERVER_DRAIN_MS; ms++) usleep(1000);
+	while ((l = lingering)) {
+		lingering = l->next;
+		ERROR("leaving '%s' loaded, %u request(s) still in flight", l->mod.name,
+				async_inflight(l->async));
+		async_free(l->async);
+		free(l);
+	}
+}
+
+/* cancel the asynchronous requests tracked by a and give the module a while to
+ * complete them.  Returns the number it hasn't */
+static unsigned int server_async_drain(async_t *a)
+{
+	unsigned int inflight;
+	async_cancel(a);
+	for (int ms = 0; (inflight = async_inflight(a)) && ms < SERVER_DRAIN_MS; ms++)
+		usleep(1000);
+	return inflight;
+}
+
+/* at exit, give sh's module a while to complete its requests.  Any still in
+ * flight keep it loaded: clearing the handle stops it being unloaded */
+static void server_handler_drain(server_handler_t *sh)
+{
+	unsigned int inflight;
+	if (!sh->mod || !sh->mod->async) return;
+	if ((inflight = server_async_drain(sh->mod->async))) {
+		ERROR("channel '%s' has %u request(s) still in flight, leaving '%s' loaded",
+				sh->handler->channel, inflight, sh->mod->name);
+		sh->mod->handle = NULL;
+	}
+	async_free(sh->mod->async);
+	sh->mod->async = NULL;
+}
+
+static void server_handler_release(server_handler_t *sh)
+{
+	server_ingress_free(sh);
+	server_batch_free(&sh->batch);
+	if (sh->limit && ratelimit_limited(sh->limit))
+		INFO("channel '%s' rate limited %lu messages", sh->handler->channel,
+				ratelimit_limited(sh->limit));
+	ratelimit_free(sh->limit);
+	sh->limit = NULL;
+	if (sh->dedup && dedup_dropped(sh->dedup))
+		INFO("channel '%s' suppressed %lu duplicates", sh->handler->channel,
+				dedup_dropped(sh->dedup));
+	dedup_free(sh->dedup);
+	sh->dedup = NULL;
+}
+
+/* set one of sh's socket buffers to size bytes.  The forced option gets past
+ * net.core.[rw]mem_max with CAP_NET_ADMIN, otherwise the kernel caps it */
+static void server_sockbuf(server_handler_t *sh, const char *name, int opt, int force, int size)
+{
+	socklen_t len = sizeof(int);
+	int got;
+	if (setsockopt(sh->fd, SOL_SOCKET, force, &size, sizeof size) == -1
+	&& setsockopt(sh->fd, SOL_SOCKET, opt, &size, sizeof size) == -1)
+	{
+		ERROR("unable to set %s on channel '%s': %s", name, sh->handler->channel, strerror(errno));
+	}
+	/* the kernel doubles what it is given, for its own overhead */
+	else if (!getsockopt(sh->fd, SOL_SOCKET, opt, &got, &len) && got / 2 < size) {
+		INFO("%s on channel '%s' capped at %i bytes", name, sh->handler->channel, got / 2);
+	}
+}
+
+/* size sh's buffers and ask for the kernel's drop count with each datagram.  A
+ * socket joined to several channels needs to know which a datagram was for */
+static void server_sockopts(server_handler_t *sh, int pktinfo)
+{
+	const int on = 1;
+	if (sh->handler->rcvbuf > 0)
+		server_sockbuf(sh, "rcvbuf", SO_RCVBUF, SO_RCVBUFFORCE, sh->handler->rcvbuf);
+	if (sh->handler->sndbuf > 0)
+		server_sockbuf(sh, "sndbuf", SO_SNDBUF, SO_SNDBUFFORCE, sh->handler->sndbuf);
+	if (setsockopt(sh->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof on) == -1)
+		DEBUG("SO_RXQ_OVFL on channel '%s': %s", sh->handler->channel, strerror(errno));
+	if (pktinfo && setsockopt(sh->fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof on) == -1)
+		ERROR("IPV6_RECVPKTINFO on channel '%s': %s", sh->handler->channel, strerror(errno));
+}
+
+/* index sh's channels in idx */
+static void server_index_add(chanidx_t *idx, server_handler_t *sh)
+{
+	for (int i = -1; i < sh->nchans; i++) {
+		lc_channel_t *chan = (i < 0) ? sh->chan : sh->chans[i];
+		const char *name = (i < 0) ? sh->handler->channel : sh->handler->channels[i];
+		if (chanidx_add(idx, &lc_channel_sockaddr(chan)->sin6_addr, sh, chan) == -1)
+			ERROR("channel '%s' is served twice on one socket, ignoring", name);
+	}
+}
+
+/* index the channels of every handler in table that shares mx's socket */
+static chanidx_t *server_mux_index(server_handler_t *mx, server_handler_t **table, int n)
+{
+	chanidx_t *idx;
+	size_t count = 0;
+	for (int i = 0; i < n; i++) {
+		if (table[i]->mux == mx) count += 1 + table[i]->nchans;
+	}
+	if (!(idx = chanidx_create(count))) return NULL;
+	for (int i = 0; i < n; i++) {
+		if (table[i]->mux == mx) server_index_add(idx, table[i]);
+	}
+	return idx;
+}
+
+/* the mux for sh's context, created on first use.  With mux set, every handler
+ * of a loop joins its channels on the one socket, read by the mux, which hands
+ * each datagram to its handler through an index of group addresses.  The
+ * socket takes the largest rcvbuf and sndbuf of the handlers sharing it */
+static server_handler_t *server_mux(server_handler_t *sh)
+{
+	handler_t *h = sh->handler;
+	server_handler_t *mx = NULL, **tmp;
+	for (int i = 0; i < nmuxes && !mx; i++) {
+		if (muxes[i]->lctx == sh->lctx) mx = muxes[i];
+	}
+	if (!mx) {
+		if (!(tmp = realloc(muxes, (nmuxes + 1) * sizeof(server_handler_t *)))) return NULL;
+		muxes = tmp;
+		if (!(mx = calloc(1, sizeof(server_handler_t)))) return NULL;
+		if (!(mx->handler = calloc(1, sizeof(handler_t)))) {
+			free(mx);
+			return NULL;
+		}
+		mx->handler->channel = server_mux_channel;
+		mx->lctx = sh->lctx;
+		mx->loop = sh->loop;
+		mx->stat = -1;
+		mx->sock = lc_socket_new(mx->lctx);
+		mx->fd = lc_socket_raw(mx->sock);
+		server_sockopts(mx, 1);
+		muxes[nmuxes++] = mx;
+	}
+	if (h->rcvbuf > mx->handler->rcvbuf) {
+		mx->handler->rcvbuf = h->rcvbuf;
+		server_sockbuf(mx, "rcvbuf", SO_RCVBUF, SO_RCVBUFFORCE, h->rcvbuf);
+	}
+	if (h->sndbuf > mx->handler->sndbuf) {
+		mx->handler->sndbuf = h->sndbuf;
+		server_sockbuf(mx, "sndbuf", SO_SNDBUF, SO_SNDBUFFORCE, h->sndbuf);
+	}
+	return mx;
+}
+
+/* watch a mux socket, as server_handler_start() does a handler's own */
+static void server_mux_start(server_handler_t *mx)
+{
+	mx->stat = stats_handler(mx->handler->channel, NULL);
+	mx->epfd = loops[mx->loop].epfd;
+	if (config.engine != ENGINE_URING && server_batch_init(&mx->batch, SERVER_MUX_BATCH) == -1)
+		ERROR("unable to allocate batch buffers for mux");
+	fcntl(mx->fd, F_SETFL, fcntl(mx->fd, F_GETFL) | O_NONBLOCK);
+	if (config.engine != ENGINE_URING && server_arm(mx, EPOLL_CTL_ADD) == -1)
+		ERROR("unable to watch mux: %s", strerror(errno));
+}
+
+/* create handler for h and join its channel.  Percore handlers with the same
+ * cpuset share a loop and context.  A new group is only created if grow is set,
+ * as loop threads can't be added once running */
+static server_handler_t *server_handler_new(handler_t *h, int grow)
+{
+	server_handler_t *sh;
+	if (!(sh = calloc(1, sizeof(server_handler_t)))) return NULL;
+	sh->handler = h;
+	/* module replies go out on the threads' own sockets */
+	if (h->sndbuf > 0) reply_sndbuf(h->sndbuf);
+	sh->lctx = lctx;
+	sh->stat = -1;
+	if (config.engine == ENGINE_PERCORE) {
+		for (int i = 0; h->cpuset && i < nhandlers; i++) {
+			server_handler_t *p = handlers[i];
+			if (p->handler->cpuset && !strcmp(h->cpuset, p->handler->cpuset)) {
+				sh->lctx = p->lctx;
+				sh->loop = p->loop;
+				break;
+			}
+		}
+		if (!sh->lctx && grow) {
+			sh->lctx = lc_ctx_new();
+			sh->loop = nloops++;
+		}
+		if (!sh->lctx) {
+			ERROR("no loop for cpuset of channel '%s', restart to add it", h->channel);
+			free(sh);
+			return NULL;
+		}
+	}
+	if (h->nchannels && !(sh->chans = calloc(h->nchannels, sizeof(lc_channel_t *)))) {
+		free(sh);
+		return NULL;
+	}
+	if (config.mux && config.engine != ENGINE_LISTEN && !(sh->mux = server_mux(sh))) {
+		ERROR("unable to create mux for channel '%s'", h->channel);
+		free(sh->chans);
+		free(sh);
+		return NULL;
+	}
+	if (sh->mux) sh->fd = -1;
+	else sh->sock = lc_socket_new(sh->lctx);
+	sh->chan = lc_channel_new(sh->lctx, h->channel);
+	lc_channel_bind((sh->mux) ? sh->mux->sock : sh->sock, sh->chan);
+	lc_channel_join(sh->chan);
+	for (sh->nchans = 0; sh->nchans < h->nchannels; sh->nchans++) {
+		lc_channel_t *chan = lc_channel_new(sh->lctx, h->channels[sh->nchans]);
+		lc_channel_bind((sh->mux) ? sh->mux->sock : sh->sock, chan);
+		lc_channel_join(chan);
+		sh->chans[sh->nchans] = chan;
+	}
+	if (sh->mux) return sh;
+	sh->fd = lc_socket_raw(sh->sock);
+	server_sockopts(sh, (sh->nchans > 0));
+	if (sh->nchans && (sh->idx = chanidx_create(1 + sh->nchans)))
+		server_index_add(sh->idx, sh);
+	else if (sh->nchans)
+		ERROR("unable to index channels of '%s', replying on the first", h->channel);
+	return sh;
+}
+
+/* wait until no loop thread, worker or the watchdog can still be using the
+ * handlers in gone */
+static void server_quiesce(server_handler_t **gone, int ngone)
+{
+	uint64_t *seen = calloc(nthreads, sizeof(uint64_t));
+	for (int i = 0; seen && i < nthreads; i++) {
+		seen[i] = __atomic_load_n(&threads[i].passes, __ATOMIC_ACQUIRE);
+	}
+	for (int i = 0; seen && i < nthreads; i++) {
+		while (__atomic_load_n(&threads[i].passes, __ATOMIC_ACQUIRE) == seen[i]
+		&& !__atomic_load_n(&threads[i].done, __ATOMIC_ACQUIRE))
+			usleep(1000);
+	}
+	if (!seen) usleep(SERVER_QUIESCE_MS * 2000);
+	free(seen);
+	for (int i = 0; i < ngone; i++) {
+		while (ingress_busy(&gone[i]->ingress)) usleep(1000);
+	}
+	watchdog_sync();
+}
+
+/* leave a removed handler's channel and unload its module, unless the module
+ * or context is still used by a handler in the table or later in gone */
+static void server_handler_drop(server_handler_t **gone, int ngone, int i)
+{
+	server_handler_t *sh = gone[i];
+	int sharemod = 0, sharectx = (sh->lctx == lctx);
+	for (int j = 0; j < nhandlers + ngone; j++) {
+		server_handler_t *p = (j < nhandlers) ? handlers[j] : gone[j - nhandlers];
+		if (j >= nhandlers && j - nhandlers <= i) continue;
+		if (p->lctx == sh->lctx) sharectx = 1;
+		if (sh->mod && p->mod && sh->mod->handle && p->mod->handle == sh->mod->handle)
+			sharemod = 1;
+	}
+	for (int j = 0; j < nmuxes; j++) {
+		if (muxes[j]->lctx == sh->lctx) sharectx = 1;
+	}
+	INFO("removing handler on channel '%s'", sh->handler->channel);
+	server_handler_release(sh);
+	stats_handler_retire(sh->stat);
+	if (sh->mod) server_module_retire(sh->mod, !sharemod);
+	config_module_free(sh->mod);
+	lc_channel_part(sh->chan);
+	lc_channel_free(sh->chan);
+	for (int j = 0; j < sh->nchans; j++) {
+		lc_channel_part(sh->chans[j]);
+		lc_channel_free(sh->chans[j]);
+	}
+	if (sh->sock) lc_socket_close(sh->sock);
+	if (!sharectx) lc_ctx_free(sh->lctx);
+	chanidx_free(sh->idx);
+	free(sh->chans);
+	free(sh);
+}
+
+/* a retired handler is still used by a handler in the table, or by a module
+ * loaded or lingering for it */
+static int server_handler_inuse(handler_t *h)
+{
+	for (int i = 0; i < nhandlers; i++) {
+		if (handlers[i]->handler == h) return 1;
+		if (handlers[i]->mod && handlers[i]->mod->handler == h) return 1;
+	}
+	for (int i = 0; i < config.modules; i++) {
+		if (config.mods[i].handle && config.mods[i].handler == h) return 1;
+	}
+	for (server_linger_t *l = lingering; l; l = l->next) {
+		if (l->mod.handler == h) return 1;
+	}
+	return 0;
+}
+
+/* Apply the handlers in the config file.  Unchanged handlers keep their socket,
+ * module and queue.  New handlers are joined before removed ones are left, so
+ * a changed handler keeps serving throughout.  Loop threads and workers only
+ * reach a handler through epoll and the pool, never through the table, so the
+ * new table simply replaces the old.  Removed handlers are unwatched, and freed
+ * once every loop thread has been round its loop and the workers have drained
+ * them.  Everything outside handler blocks needs a restart */
+static void server_reload(void)
+{
+	server_handler_t **table = NULL, **gone = NULL, **old, *sh;
+	chanidx_t **idx = NULL;
+	handler_t *newh, *h;
+	char *kept = NULL;
+	int count = 0, n = 0, ngone = 0, j;
+
+	if (config.processes > 0) {
+		INFO("reload is not supported with processes, restart to apply changes");
+		return;
+	}
+	if (config.engine == ENGINE_URING) {
+		INFO("reload is not supported by the uring engine, restart to apply changes");
+		return;
+	}
+	INFO("reloading handlers from '%s'", config.configfile);
+	if (config_reload(&newh) == -1) {
+		ERROR("unable to reload config, keeping current handlers");
+		return;
+	}
+	for (h = newh; h; h = h->next) count++;
+	table = calloc(count + 1, sizeof(server_handler_t *));
+	gone = calloc(nhandlers + 1, sizeof(server_handler_t *));
+	kept = calloc(count + 1, 1);
+	/* each new handler may bring a mux of its own */
+	idx = calloc(nmuxes + count + 1, sizeof(chanidx_t *));
+	if (!table || !gone || !kept || !idx) {
+		ERROR("unable to reload config: %s", strerror(errno));
+		config_handlers_free(newh);
+		goto exit_err;
+	}
+	for (int i = 0; i < nhandlers; i++) {
+		sh = handlers[i];
+		for (h = newh, j = 0; h; h = h->next, j++) {
+			if (!kept[j] && !config_handler_cmp(sh->handler, h)) break;
+		}
+		if (h) {
+			kept[j] = 1;
+			table[n++] = sh;
+		}
+		else gone[ngone++] = sh;
+	}
+	for (h = newh, j = 0; h; h = h->next, j++) {
+		if (kept[j] || !h->module) continue;
+		if (!(sh = server_handler_new(h, 0))) continue;
+		INFO("adding handler on channel '%s'", h->channel);
+		sh->mod = &sh->module;
+		if (h->lazy) {
+			config_module_defer(sh->mod, h);
+			server_handler_start(sh);
+		}
+		else if (config_module_load(sh->mod, h) == -1) {
+			ERROR("unable to load module '%s'", h->module);
+			sh->mod = NULL;
+		}
+		else server_handler_start(sh);
+		table[n++] = sh;
+	}
+	for (int i = 0; i < ngone; i++) {
+		if (gone[i]->polling) server_poll_stop(gone[i]);
+		else if (gone[i]->mod && !gone[i]->mux)
+			epoll_ctl(gone[i]->epfd, EPOLL_CTL_DEL, gone[i]->fd, NULL);
+	}
+	/* muxes route by the new table, the old indexes go once unused */
+	for (int i = 0; i < nmuxes; i++) {
+		if (!(idx[i] = server_mux_index(muxes[i], table, n))) {
+			ERROR("unable to index channels for mux, keeping the old index");
+			continue;
+		}
+		idx[i] = __atomic_exchange_n(&muxes[i]->idx, idx[i], __ATOMIC_ACQ_REL);
+	}
+	old = handlers;
+	handlers = table;
+	nhandlers = n;
+	table = old;
+	server_quiesce(gone, ngone);
+	for (int i = 0; i < nmuxes; i++) chanidx_free(idx[i]);
+	for (int i = 0; i < ngone; i++) server_handler_drop(gone, ngone, i);
+	/* the loops have been round since the last reload, so only handlers and
+	 * modules can hold what it retired.  Kept handlers still point into the
+	 * old list, so it is retired in turn */
+	config_handlers_release(server_handler_inuse);
+	config_handlers_swap(newh);
+	INFO("reload complete, %i handler(s)", nhandlers);
+exit_err:
+	free(idx);
+	free(kept);
+	free(gone);
+	free(table);
+}
+
+/* Load a new copy of each module from disk and hand it new messages, leaving
+ * channels, sockets and queues as they are.  The copy is loaded alongside the
+ * old one, from a copy of its file shared by the handlers of that module.
+ * Each copy has its own request tracker, so the two are swapped together.
+ * The old copy is unloaded once calls into it have returned and its
+ * asynchronous requests have completed, see server_module_retire().  Lazy
+ * handlers yet to load theirs load the new one when first used */
+static void server_swap(void)
+{
+	module_t **old = NULL, **next = NULL;
+	server_handler_t *sh;
+	int swapped = 0, finit;
+
+	if (config.engine == ENGINE_LISTEN) {
+		INFO("module swap requires the epoll engine, restart to apply changes");
+		return;
+	}
+	old = calloc(nhandlers + 1, sizeof(module_t *));
+	next = calloc(nhandlers + 1, sizeof(module_t *));
+	if (!old || !next) {
+		ERROR("unable to swap modules: %s", strerror(errno));
+		goto exit_err;
+	}
+	INFO("swapping modules");
+	for (int i = 0; i < nhandlers; i++) {
+		module_t *peer = NULL;
+		sh = handlers[i];
+		if (!sh->mod || __atomic_load_n(&sh->ready, __ATOMIC_ACQUIRE) != 1) continue;
+		/* percore handlers each have their own copy */
+		for (int j = 0; config.engine != ENGINE_PERCORE && !peer && j < i; j++) {
+			if (next[j] && !strcmp(next[j]->name, sh->mod->name)) peer = next[j];
+		}
+		if (!(next[i] = config_module_swap(sh->mod, peer))) {
+			ERROR("unable to load new '%s' for channel '%s', keeping the old one",
+					sh->mod->name, sh->handler->channel);
+			continue;
+		}
+		next[i]->async = server_async_new(sh, next[i]);
+		old[i] = __atomic_exchange_n(&sh->mod, next[i], __ATOMIC_SEQ_CST);
+	}
+	for (int i = 0; i < nhandlers; i++) {
+		if (old[i]) config_module_wait(old[i]);
+	}
+	/* legacy modules share globals, so finit() once no handler uses them */
+	for (int i = 0; i < nhandlers; i++) {
+		if (!old[i]) continue;
+		finit = 1;
+		for (int j = 0; j < nhandlers; j++) {
+			if (j > i && old[j] && old[j]->handle == old[i]->handle) finit = 0;
+			if (!old[j] && handlers[j]->mod && handlers[j]->mod->handle == old[i]->handle)
+				finit = 0;
+		}
+		server_module_retire(old[i], finit);
+		swapped++;
+	}
+	INFO("swap complete, %i module(s) replaced", swapped);
+exit_err:
+	free(next);
+	free(old);
+}
+
+/* write a snapshot of every thread's latency histograms, merged */
+static void server_latency_dump(void)
+{
+	char path[PATH_MAX];
+	const char *file = (config.latencyfile) ? config.latencyfile : SERVER_LATENCY_FILE;
+	snprintf(path, sizeof path, "%s.%i", file, (int)getpid());
+	if (stats_dump(path) == -1) {
+		ERROR("unable to write latency to '%s': %s", path, strerror(errno));
+	}
+	else {
+		INFO("latency written to '%s'", path);
+	}
+}
+
+/* expire asynchronous requests past their handler's timeout_ms, report those
+ * open past its watchdog_ms and unload lingering modules that are done with
+ * theirs.  Returns the poll() timeout until the next check */
+static int server_async_check(void)
+{
+	const uint64_t now = server_now();
+	server_handler_t *sh;
+	async_t *async;
+	int timeout = (server_linger_run()) ? SERVER_QUIESCE_MS : -1;
+	for (int i = 0; i < nhandlers; i++) {
+		sh = handlers[i];
+		/* set by a lazy handler's first message */
+		if (!sh->mod || !(async = __atomic_load_n(&sh->mod->async, __ATOMIC_ACQUIRE)))
+			continue;
+		if (sh->handler->timeout_ms > 0) {
+			async_expire(async, now);
+			if (timeout == -1) timeout = SERVER_QUIESCE_MS;
+		}
+		if (sh->handler->watchdog_ms > 0) {
+			__atomic_store_n(&sh->overdue, async_overdue(async, now,
+					(uint64_t)sh->handler->watchdog_ms * 1000000,
+					server_overdue, sh), __ATOMIC_RELEASE);
+			timeout = WATCHDOG_INTERVAL_MS;
+		}
+	}
+	return timeout;
+}
+
+/* Serve handlers from epoll loops.  The epoll engine runs config.loopthreads
+ * threads over one epoll set.  The percore engine runs one thread per handler
+ * group, each with its own epoll set, librecast context and module instance,
+ * pinned to the group's cpuset.  The uring engine runs config.loopthreads
+ * threads each with its own io_uring instead, see server_uring_thread().  This
+ * thread stays behind to handle signals and run module timers */
+static void server_loop(void)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	const int percore = (config.engine == ENGINE_PERCORE);
+	struct signalfd_siginfo si;
+	struct pollfd pfd[3];
+	sigset_t mask;
+	int threadcount = (config.loopthreads > 0) ? config.loopthreads : 1;
+	int sfd = -1;
+	int n = 0;
+
+	if (percore) threadcount = nloops;
+	server_sigset(&mask);
+	threads = calloc(threadcount, sizeof(server_thread_t));
+	loops = calloc(nloops, sizeof(server_loop_t));
+	if (!threads || !loops
+	|| (sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1
+	|| (stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	{
+		ERROR("unable to start event loop: %s", strerror(errno));
+		goto exit_err;
+	}
+	for (server_loop_t *l = loops; l < loops + nloops; l++) {
+		l->threads = (percore) ? 1 : threadcount;
+		/* stopfd is in every set, so every thread sees it */
+		if ((l->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1
+		|| epoll_ctl(l->epfd, EPOLL_CTL_ADD, stopfd, &ev) == -1)
+		{
+			ERROR("unable to start event loop: %s", strerror(errno));
+			goto exit_err;
+		}
+	}
+	if (config.buffers > 0) {
+		const size_t bufsize = (config.bufsize > 0) ? (size_t)config.bufsize : SERVER_MSGMAX;
+		int flags = (config.hugepages) ? BUFPOOL_HUGEPAGES : 0;
+		if (!(bufpool = bufpool_create(config.buffers, bufsize, flags)))
+			ERROR("unable to create buffer pool: %s", strerror(errno));
+	}
+	if (config.workers > 0 && percore) {
+		INFO("workers are shared between threads, ignoring for percore engine");
+	}
+	else if (config.workers > 0) {
+		size_t tokens = 0;
+		for (int i = 0; i < nhandlers; i++) {
+			if (handlers[i]->mod) tokens += server_queue_size(handlers[i]->handler);
+		}
+		/* room in the pool for a token per queued job.  Handlers added by a
+		 * reload may exceed this, and are dispatched inline when it's full */
+		tokens = (tokens + config.workers - 1) / config.workers;
+		if (!(pool = pool_create(config.workers, (tokens) ? tokens : 1, server_job, server_idle)))
+			ERROR("unable to create worker pool, dispatching from loop threads");
+	}
+	for (int i = 0; i < nhandlers; i++) {
+		server_handler_t *sh = handlers[i];
+		if (percore && sh->mod) loops[sh->loop].cpuset = sh->handler->cpuset;
+		server_handler_start(sh);
+		if (!pool && (sh->handler->queue || sh->handler->deadline_ms))
+			INFO("queue and deadline_ms require workers, ignoring for channel '%s'", sh->handler->channel);
+		if (!pool && ingress_classes(sh->handler))
+			INFO("priority requires workers, ignoring for channel '%s'", sh->handler->channel);
+		if (sh->mux && sh->handler->poll != POLLMODE_BLOCK)
+			INFO("poll is per socket, ignoring with mux for channel '%s'", sh->handler->channel);
+	}
+	for (int i = 0; i < nmuxes; i++) server_mux_start(muxes[i]);
+	DEBUG("starting %i loop thread(s)", threadcount);
+	for (server_loop_t *l = loops; l < loops + nloops; l++) {
+		for (int i = 0; i < l->threads; i++, n++) {
+			threads[n].loop = l;
+			if (server_loop_thread_create(&threads[n])) {
+				ERROR("unable to create loop thread");
+				goto stop;
+			}
+		}
+	}
+	nthreads = n;
+	pfd[0].fd = sfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = stopfd;
+	pfd[1].events = POLLIN;
+	pfd[2].fd = (wheel) ? wheel_fd(wheel) : -1;
+	pfd[2].events = POLLIN;
+	while (running) {
+		if (poll(pfd, 3, server_async_check()) == -1) {
+			if (errno == EINTR) continue;
+			ERROR("poll(): %s", strerror(errno));
+			break;
+		}
+		if (pfd[1].revents) break;
+		if (pfd[2].revents) wheel_run(wheel);
+		if (read(sfd, &si, sizeof si) != sizeof si) continue;
+		if (si.ssi_signo == SIGUSR1) server_latency_dump();
+		else if (si.ssi_signo == SIGHUP) server_reload();
+		else if (si.ssi_signo == SIGUSR2) server_swap();
+		else break;
+	}
+stop:
+	server_stop();
+	while (n-- > 0) pthread_join(threads[n].thread, NULL);
+	running = 0;
+	for (int i = 0; i < nhandlers; i++) server_poll_stop(handlers[i]);
+	pool_free(pool);
+	pool = NULL;
+	watchdog_stop();
+	reply_free();
+exit_err:
+	free(threads);
+	threads = NULL;
+	nthreads = 0;
+	for (int i = 0; i < nhandlers; i++) {
+		server_handler_drain(handlers[i]);
+		server_handler_release(handlers[i]);
+	}
+	server_linger_stop();
+	for (int i = 0; i < nmuxes; i++) server_batch_free(&muxes[i]->batch);
+	bufpool_free(bufpool);
+	bufpool = NULL;
+	for (server_loop_t *l = loops; l && l < loops + nloops; l++) {
+		if (l->epfd > 0) close(l->epfd);
+	}
+	free(loops);
+	loops = NULL;
+	if (stopfd != -1) close(stopfd);
+	if (sfd != -1) {
+		while (read(sfd, &si, sizeof si) == sizeof si); /* consume */
+		close(sfd);
+	}
+	stopfd = -1;
+}
+
+/* lc_socket_listen() has no way to pass a module its context, so the listen
+ * engine reads for those modules itself.  Cancellation is held off while a
+ * message is handled */
+static void *server_listen_thread(void *arg)
+{
+	server_handler_t *sh = arg;
+	lc_message_t msg;
+	int state;
+	for (;;) {
+		if (lc_msg_recv(sh->sock, &msg) == -1) {
+			if (errno == EINTR) continue;
+			ERROR("recv on channel '%s': %s", sh->handler->channel, strerror(errno));
+			config_module_err(sh->mod, errno);
+			break;
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+		msg.chan = sh->chan;
+		if (sh->idx) chanidx_get(sh->idx, &msg.dst, (void **)&msg.chan);
+		config_module_msg(sh->mod, &msg);
+		lc_msg_free(&msg);
+		pthread_setcancelstate(state, NULL);
+	}
+	return NULL;
+}
+
+static void server_listen(void)
+{
+	struct pollfd pfd = { .fd = (wheel) ? wheel_fd(wheel) : -1, .events = POLLIN };
+	sigset_t mask, omask;
+	if (config.workers) INFO("workers require the epoll engine, ignoring");
+	if (config.buffers) INFO("buffers require the epoll engine, ignoring");
+	for (int i = 0; i < nhandlers; i++) {
+		server_handler_t *sh = handlers[i];
+		if (sh->handler->batch > 1) INFO("batch requires the epoll engine, ignoring");
+		if (sh->handler->queue || sh->handler->deadline_ms)
+			INFO("queue and deadline_ms require the epoll engine, ignoring");
+		if (sh->handler->ratelimit)
+			INFO("ratelimit requires the epoll engine, ignoring");
+		if (sh->handler->dedup_ms)
+			INFO("dedup_ms requires the epoll engine, ignoring");
+		if (sh->handler->inflight || sh->handler->timeout_ms)
+			INFO("inflight and timeout_ms require the epoll engine, ignoring");
+		if (sh->handler->poll != POLLMODE_BLOCK)
+			INFO("poll requires the epoll engine, ignoring");
+		if (sh->handler->watchdog_ms)
+			INFO("watchdog_ms requires the epoll engine, ignoring");
+		if (ingress_classes(sh->handler))
+			INFO("priority requires the epoll engine, ignoring");
+		if (!sh->mod) continue;
+		/* the listener needs the module's handlers now */
+		if (sh->mod->lazy && config_module_load(sh->mod, sh->handler) == -1) {
+			ERROR("unable to load module '%s'", sh->handler->module);
+			continue;
+		}
+		if (sh->mod->abi == MODULE_ABI_LEGACY) {
+			lc_socket_listen(sh->sock, sh->mod->handle_msg, sh->mod->handle_err);
+			continue;
+		}
+		/* leave signals to this thread */
+		sigfillset(&mask);
+		pthread_sigmask(SIG_BLOCK, &mask, &omask);
+		if (pthread_create(&sh->listener, NULL, server_listen_thread, sh)) {
+			ERROR("unable to listen on channel '%s'", sh->handler->channel);
+		}
+		else sh->listening = 1;
+		pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	}
+	while (running) {
+		/* signals interrupt the wait, as they would pause() */
+		if (poll(&pfd, 1, -1) > 0) wheel_run(wheel);
+		if (reload) INFO("reload requires the epoll engine, restart to apply changes");
+		if (dump) server_latency_dump();
+		if (swap) server_swap();
+		reload = 0;
+		dump = 0;
+		swap = 0;
+	}
+	for (int i = 0; i < nhandlers; i++) {
+		if (!handlers[i]->listening) continue;
+		pthread_cancel(handlers[i]->listener);
+		pthread_join(handlers[i]->listener, NULL);
+		handlers[i]->listening = 0;
+	}
+}
+
+/* pair loaded modules with the handlers that asked for them */
+static void server_modules_pair(void)
+{
+	for (int i = 0; i < config.modules; i++) {
+		module_t *mod = &config.mods[i];
+		for (int j = 0; (mod->handle || mod->lazy) && j < nhandlers; j++) {
+			if (handlers[j]->handler == mod->handler) handlers[j]->mod = mod;
+		}
+	}
+}
+
+static void server_startup_report(void)
+{
+	const config_timing_t *t = &config.timing;
+	INFO("startup: parse %.1fms, join %.1fms (%i channel(s)), modules %.1fms "
+		"(dlopen %.1fms, init %.1fms over %i thread(s)), %i loaded, %i deferred",
+		t->parse / 1e6, t->join / 1e6, t->joined, t->load / 1e6,
+		t->dlopen / 1e6, t->init / 1e6, t->threads, t->loaded, t->deferred);
+}
+
+int server_bind(void)
+{
+	int count = 0;
 	if (!config.handlers) {
 		INFO("No handlers configured.");
-		return;
+		return -1;
+	}
+	for (handler_t *h = config.handlers; h; h = h->next) {
+		if (h->module) count++;
+	}
+	if (!(handlers = calloc(count, sizeof(server_handler_t *)))) return -1;
+	if (config.engine != ENGINE_PERCORE) {
+		lctx = lc_ctx_new();
+		nloops = 1;
+	}
+	for (handler_t *h = config.handlers; h; h = h->next) {
+		uint64_t start;
+		DEBUG("starting handler on channel '%s'", h->channel);
+		if (!h->module) continue;
+		start = server_now();
+		if (!(handlers[nhandlers] = server_handler_new(h, 1))) {
+			server_unbind();
+			return -1;
+		}
+		config.timing.join += server_now() - start;
+		config.timing.joined += 1 + h->nchannels;
+		nhandlers++;
+	}
+	for (int i = 0; i < nmuxes; i++) {
+		if (!(muxes[i]->idx = server_mux_index(muxes[i], handlers, nhandlers))) {
+			ERROR("unable to index channels for mux");
+			server_unbind();
+			return -1;
+		}
+		DEBUG("mux serving %zu channel(s)", chanidx_count(muxes[i]->idx));
 	}
-	sigemptyset(&sa.sa_mask);
-	sigaction(SIGINT, &sa, NULL);
-	lctx = lc_ctx_new();
+	return 0;
+}
+
+void server_run(void)
+{
+	struct sigaction sa = { .sa_handler = sighandler };
+	sigset_t mask, omask;
+	/* threads started from here on, by the loader or a module's init(),
+	 * inherit the mask, leaving signals to the loop's signalfd */
+	server_sigset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	config.api = &server_api;
+	/* before modules load, so init() can set timers */
+	if (!(wheel = wheel_create(SERVER_TIMER_TICK_MS)))
+		ERROR("unable to create timer wheel: %s", strerror(errno));
+	reply_timers(wheel);
+	/* twice the handlers we start with, leaving room for reloads */
+	if (stats_open(nhandlers * 2) == -1)
+		ERROR("unable to create stats segment: %s", strerror(errno));
 	if (config_modules_load()) {
-		mod = config.mods;
-		for (handler_t *h = config.handlers; h; h = h->next) {
-			DEBUG("starting handler on channel '%s'", h->channel);
-			if (!h->module) continue;
-			if (!mod->handle_msg) continue;
-			sock = lc_socket_new(lctx);
-			chan = lc_channel_new(lctx, h->channel);
-			lc_channel_bind(sock, chan);
-			lc_channel_join(chan);
-			lc_socket_listen(sock, mod->handle_msg, mod->handle_err);
-			mod++;
-		}
-		while (running) pause();
+		server_startup_report();
+		server_modules_pair();
+		switch (config.engine) {
+		case ENGINE_URING:
+			if (uring_probe() == -1) {
+				INFO("io_uring unavailable (%s), using the epoll engine", strerror(errno));
+				config.engine = ENGINE_EPOLL;
+			}
+			/* fall through */
+		case ENGINE_EPOLL:
+		case ENGINE_PERCORE:
+			server_loop();
+			break;
+		default:
+			/* the listener waits for signals with poll() */
+			sigemptyset(&sa.sa_mask);
+			sigaction(SIGINT, &sa, NULL);
+			sigaction(SIGHUP, &sa, NULL);
+			sigaction(SIGUSR1, &sa, NULL);
+			sigaction(SIGUSR2, &sa, NULL);
+			pthread_sigmask(SIG_SETMASK, &omask, NULL);
+			server_listen();
+		}
+	}
+	/* modules loaded by a reload or swap belong to their handler */
+	for (int i = 0; i < nhandlers; i++) {
+		module_t *mod = handlers[i]->mod;
+		if (mod && (mod == &handlers[i]->module || mod->prev)) config_module_unload(mod, 1);
+		config_module_free(mod);
 	}
 	config_modules_unload();
-	lc_ctx_free(lctx);
+	reply_timers(NULL);
+	wheel_free(wheel);
+	wheel = NULL;
+	stats_close();
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+}
+
+void server_unbind(void)
+{
+	/* a percore context is shared by every handler in its group */
+	for (int i = 0; i < nhandlers; i++) {
+		int j = 0;
+		if (handlers[i]->lctx == lctx) continue;
+		while (j < i && handlers[j]->lctx != handlers[i]->lctx) j++;
+		if (j == i) lc_ctx_free(handlers[i]->lctx);
+	}
+	for (int i = 0; i < nmuxes; i++) {
+		int j = 0;
+		if (muxes[i]->lctx == lctx) continue;
+		while (j < nhandlers && handlers[j]->lctx != muxes[i]->lctx) j++;
+		if (j == nhandlers) lc_ctx_free(muxes[i]->lctx);
+	}
+	for (int i = 0; i < nhandlers; i++) {
+		chanidx_free(handlers[i]->idx);
+		free(handlers[i]->chans);
+		free(handlers[i]);
+	}
+	for (int i = 0; i < nmuxes; i++) {
+		chanidx_free(muxes[i]->idx);
+		free(muxes[i]->handler);
+		free(muxes[i]);
+	}
+	free(muxes);
+	muxes = NULL;
+	nmuxes = 0;
+	if (lctx) lc_ctx_free(lctx);
+	lctx = NULL;
+	nloops = 0;
+	free(handlers);
+	handlers = NULL;
+	nhandlers = 0;
+}
+
+void server_start(void)
+{
+	DEBUG("Starting server");
+	if (server_bind()) return;
+	server_run();
+	server_unbind();
 }
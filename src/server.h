@@ -4,7 +4,17 @@
 #ifndef _LSDM_SERVER_H
 #define _LSDM_SERVER_H 1
 
-void	server_stop();
-void	server_start();
+/* create sockets and join channels for every configured handler */
+int	server_bind(void);
+
+/* load modules and serve the bound channels until stopped */
+void	server_run(void);
+
+/* leave channels and free sockets */
+void	server_unbind(void);
+
+/* bind, run and unbind in one go */
+void	server_start(void);
+void	server_stop(void);
 
 #endif /* _LSDM_SERVER_H */
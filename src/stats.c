@@ -0,0 +1,266 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "stats.h"
+
+static stats_head_t *stats;
+static char stats_path[PATH_MAX];
+static unsigned int stats_nthreads;
+static __thread int stats_thread = -1;
+static __thread int stats_current = -1;
+
+/* latency histograms are private to the process.  Each thread block has a
+ * table of handlers * (STATS_OPS + 1), and both are allocated on first use */
+static hist_t **stats_hist[STATS_THREADS];
+
+static int stats_tid(void)
+{
+	if (stats_thread == -1)
+		stats_thread = __atomic_fetch_add(&stats_nthreads, 1, __ATOMIC_RELAXED) % STATS_THREADS;
+	return stats_thread;
+}
+
+/* our thread's counters for h, or NULL if we aren't counting it */
+static stats_counters_t *stats_mine(int h)
+{
+	if (!stats || h < 0) return NULL;
+	return stats_counters(stats, stats_tid(), h);
+}
+
+/* install *p, allocated on first use.  Threads sharing a block may race to do
+ * so, in which case the loser frees its copy */
+static void *stats_alloc(void **p, size_t size)
+{
+	void *mem = __atomic_load_n(p, __ATOMIC_ACQUIRE), *expect = NULL;
+	if (mem) return mem;
+	if (!(mem = calloc(1, size))) return NULL;
+	if (__atomic_compare_exchange_n(p, &expect, mem, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return mem;
+	free(mem);
+	return expect;
+}
+
+void stats_add(int h, int stat, uint64_t n)
+{
+	stats_counters_t *c;
+	if (stat < 0 || stat >= STAT_COUNT || !(c = stats_mine(h))) return;
+	__atomic_fetch_add(&c->stat[stat], n, __ATOMIC_RELAXED);
+}
+
+void stats_op(int h, unsigned int op)
+{
+	stats_counters_t *c;
+	if (op >= STATS_OPS || !(c = stats_mine(h))) return;
+	__atomic_fetch_add(&c->op[op], 1, __ATOMIC_RELAXED);
+}
+
+void stats_depth(int h, uint64_t depth)
+{
+	if (!stats || h < 0) return;
+	__atomic_store_n(&stats_handler_slot(stats, h)->depth, depth, __ATOMIC_RELAXED);
+}
+
+void stats_inflight(int h, uint64_t inflight)
+{
+	if (!stats || h < 0) return;
+	__atomic_store_n(&stats_handler_slot(stats, h)->inflight, inflight, __ATOMIC_RELAXED);
+}
+
+void stats_enter(int h)
+{
+	stats_current = h;
+}
+
+void stats_time(int h, unsigned int op, uint64_t ns)
+{
+	hist_t **table, *hist;
+	if (!stats || h < 0 || op > STATS_OP_MSG) return;
+	table = stats_alloc((void **)&stats_hist[stats_tid()],
+			stats->handlers * (STATS_OPS + 1) * sizeof(hist_t *));
+	if (!table) return;
+	hist = stats_alloc((void **)&table[h * (STATS_OPS + 1) + op], sizeof(hist_t));
+	if (hist) hist_record(hist, ns);
+}
+
+void stats_time_op(unsigned int op, uint64_t ns)
+{
+	stats_time(stats_current, op, ns);
+}
+
+uint64_t stats_latency(int h, unsigned int op, hist_t *hist)
+{
+	hist_t **table, *src;
+	memset(hist, 0, sizeof(hist_t));
+	if (!stats || h < 0 || op > STATS_OP_MSG) return 0;
+	for (int t = 0; t < STATS_THREADS; t++) {
+		if (!(table = __atomic_load_n(&stats_hist[t], __ATOMIC_ACQUIRE))) continue;
+		src = __atomic_load_n(&table[h * (STATS_OPS + 1) + op], __ATOMIC_ACQUIRE);
+		if (src) hist_merge(hist, src);
+	}
+	return hist->count;
+}
+
+int stats_dump(const char *path)
+{
+	char tmp[PATH_MAX];
+	const uint32_t used = (stats) ? stats->used : 0;
+	stats_handler_t *slot;
+	hist_t *hist;
+	FILE *f;
+	int ret = 0;
+	if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (!(hist = malloc(sizeof(hist_t)))) return -1;
+	if (!(f = fopen(tmp, "w"))) {
+		free(hist);
+		return -1;
+	}
+	fprintf(f, "# pid %i, %lli, latency in nanoseconds\n", (int)getpid(), (long long)time(NULL));
+	fprintf(f, "# %s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
+			"channel", "module", "op", "count", "p50", "p99", "p999", "max");
+	for (uint32_t h = 0; h < used; h++) {
+		slot = stats_handler_slot(stats, h);
+		if (slot->retired) continue;
+		/* the whole message first, then each opcode */
+		for (unsigned int i = 0; i <= STATS_OPS; i++) {
+			const unsigned int op = (i) ? i - 1 : STATS_OP_MSG;
+			if (!stats_latency(h, op, hist)) continue;
+			if (op == STATS_OP_MSG) fprintf(f, "%s\t%s\tmsg", slot->channel, slot->module);
+			else fprintf(f, "%s\t%s\t%u", slot->channel, slot->module, op);
+			fprintf(f, "\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+					(unsigned long long)hist->count,
+					(unsigned long long)hist_percentile(hist, 50.0),
+					(unsigned long long)hist_percentile(hist, 99.0),
+					(unsigned long long)hist_percentile(hist, 99.9),
+					(unsigned long long)hist->max);
+		}
+	}
+	free(hist);
+	if (fclose(f) == EOF) ret = -1;
+	if (!ret && rename(tmp, path) == -1) ret = -1;
+	if (ret) unlink(tmp);
+	return ret;
+}
+
+void stats_count(int stat, uint64_t n)
+{
+	stats_add(stats_current, stat, n);
+}
+
+void stats_count_op(unsigned int op)
+{
+	stats_op(stats_current, op);
+}
+
+int stats_handler(const char *channel, const char *module)
+{
+	stats_handler_t *slot;
+	int h;
+	if (!stats || stats->used == stats->handlers) return -1;
+	h = stats->used;
+	slot = stats_handler_slot(stats, h);
+	snprintf(slot->channel, STATS_NAMELEN, "%s", (channel) ? channel : "");
+	snprintf(slot->module, STATS_NAMELEN, "%s", (module) ? module : "");
+	/* publish the names before the slot */
+	__atomic_store_n(&stats->used, h + 1, __ATOMIC_RELEASE);
+	return h;
+}
+
+void stats_handler_retire(int h)
+{
+	if (!stats || h < 0) return;
+	__atomic_store_n(&stats_handler_slot(stats, h)->retired, 1, __ATOMIC_RELAXED);
+}
+
+int stats_open(int handlers)
+{
+	const uint32_t n = (handlers > STATS_HANDLERS) ? (uint32_t)handlers : STATS_HANDLERS;
+	const size_t len = stats_size(n);
+	void *map;
+	int fd;
+	if (stats) return 0;
+	snprintf(stats_path, sizeof stats_path, STATS_PATH, (int)getpid());
+	if ((fd = open(stats_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) return -1;
+	/* tmpfs allocates pages as they are touched, so unused slots are free */
+	if (ftruncate(fd, len) == -1) goto err_unlink;
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) goto err_unlink;
+	close(fd);
+	stats = map;
+	stats->version = STATS_VERSION;
+	stats->threads = STATS_THREADS;
+	stats->handlers = n;
+	stats->pid = getpid();
+	stats->started = time(NULL);
+	__atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+err_unlink:
+	close(fd);
+	unlink(stats_path);
+	return -1;
+}
+
+void stats_close(void)
+{
+	if (!stats) return;
+	for (int t = 0; t < STATS_THREADS; t++) {
+		if (!stats_hist[t]) continue;
+		for (size_t i = 0; i < stats->handlers * (STATS_OPS + 1); i++) free(stats_hist[t][i]);
+		free(stats_hist[t]);
+		stats_hist[t] = NULL;
+	}
+	munmap(stats, stats_size(stats->handlers));
+	unlink(stats_path);
+	stats = NULL;
+}
+
+void stats_remove(pid_t pid)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof path, STATS_PATH, (int)pid);
+	unlink(path);
+}
+
+stats_head_t *stats_attach(pid_t pid)
+{
+	char path[PATH_MAX];
+	stats_head_t *head;
+	struct stat sb;
+	int fd;
+	snprintf(path, sizeof path, STATS_PATH, (int)pid);
+	if ((fd = open(path, O_RDONLY)) == -1) return NULL;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(stats_head_t)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	head = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (head == MAP_FAILED) return NULL;
+	if (__atomic_load_n(&head->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC
+	|| head->version != STATS_VERSION || head->threads != STATS_THREADS
+	|| stats_size(head->handlers) != (size_t)sb.st_size)
+	{
+		munmap(head, sb.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	return head;
+}
+
+void stats_detach(stats_head_t *head)
+{
+	if (head) munmap(head, stats_size(head->handlers));
+}
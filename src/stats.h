@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_STATS_H
+#define _LSDM_STATS_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "hist.h"
+
+/* Counters live in a shared memory segment, STATS_PATH, which lsdbd-stat maps
+ * read-only.  Each thread has its own cache line aligned block of counters for
+ * every handler, so updating one is an uncontended relaxed atomic add.  A
+ * reader sums the blocks */
+#define STATS_PATH "/dev/shm/lsdbd.%i"
+#define STATS_MAGIC UINT64_C(0x6c736462642d7374) /* "lsdbd-st" */
+#define STATS_VERSION 5
+
+/* blocks per handler.  Threads beyond this share, which is still correct */
+#define STATS_THREADS 64
+
+/* minimum handler slots, leaving room for handlers added on reload */
+#define STATS_HANDLERS 256
+
+/* per-opcode counters, enough for AUTH_OPCODES */
+#define STATS_OPS 16
+
+#define STATS_NAMELEN 64
+
+/* latency histograms are kept per handler for each opcode and for the whole
+ * of handle_msg(), STATS_OP_MSG */
+#define STATS_OP_MSG STATS_OPS
+
+#define STATS_COUNTERS(X) \
+	X(STAT_PACKETS,	"pkts") \
+	X(STAT_BYTES,	"bytes") \
+	X(STAT_DROPS,	"drops") \
+	X(STAT_KDROPS,	"kdrops") /* by the kernel, socket buffer full */ \
+	X(STAT_DUPS,	"dups")	  /* suppressed by dedup_ms */ \
+	X(STAT_STALLS,	"stalls") /* module calls over watchdog_ms */ \
+	X(STAT_ERRORS,	"errors")
+#undef X
+
+#define STATS_COUNTER_ENUM(id, text) id,
+enum {
+	STATS_COUNTERS(STATS_COUNTER_ENUM)
+	STAT_COUNT
+};
+
+typedef struct stats_head_s stats_head_t;
+struct stats_head_s {
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	threads;
+	uint32_t	handlers;	/* slots */
+	uint32_t	used;		/* slots handed out */
+	int64_t		pid;
+	uint64_t	started;	/* seconds since the epoch */
+} __attribute__((aligned(64)));
+
+/* a handler's slot, never reused, so rates stay meaningful across reloads */
+typedef struct stats_handler_s stats_handler_t;
+struct stats_handler_s {
+	char		channel[STATS_NAMELEN];
+	char		module[STATS_NAMELEN];
+	uint64_t	depth;		/* jobs in the ingress queue */
+	uint64_t	inflight;	/* requests accepted by handle_async() */
+	uint64_t	retired;	/* removed on reload */
+} __attribute__((aligned(64)));
+
+typedef struct stats_counters_s stats_counters_t;
+struct stats_counters_s {
+	uint64_t	stat[STAT_COUNT];
+	uint64_t	op[STATS_OPS];
+} __attribute__((aligned(64)));
+
+/* segment layout: head, handler slots, then threads * handlers counters */
+static inline stats_handler_t *stats_handler_slot(stats_head_t *head, int h)
+{
+	return (stats_handler_t *)(head + 1) + h;
+}
+
+static inline stats_counters_t *stats_counters(stats_head_t *head, int thread, int h)
+{
+	stats_counters_t *base = (stats_counters_t *)stats_handler_slot(head, head->handlers);
+	return base + (size_t)thread * head->handlers + h;
+}
+
+static inline size_t stats_size(uint32_t handlers)
+{
+	return sizeof(stats_head_t) + handlers * sizeof(stats_handler_t)
+		+ (size_t)STATS_THREADS * handlers * sizeof(stats_counters_t);
+}
+
+/* create and map the segment for this process with room for at least
+ * handlers, replacing any left by a previous process with our pid */
+int	stats_open(int handlers);
+
+/* unmap and remove the segment */
+void	stats_close(void);
+
+/* remove the segment of process pid, which has exited without closing it */
+void	stats_remove(pid_t pid);
+
+/* hand out a slot for a handler.  Returns -1 if there is no segment or it is
+ * full, in which case counting for the handler is a no-op */
+int	stats_handler(const char *channel, const char *module);
+
+/* mark slot h as removed */
+void	stats_handler_retire(int h);
+
+/* the calling thread is working for handler h, for stats_count() */
+void	stats_enter(int h);
+
+/* add n to a counter of handler h */
+void	stats_add(int h, int stat, uint64_t n);
+
+/* count an opcode for handler h */
+void	stats_op(int h, unsigned int op);
+
+/* set the ingress queue depth of handler h */
+void	stats_depth(int h, uint64_t depth);
+
+/* set the number of asynchronous requests handler h has in flight */
+void	stats_inflight(int h, uint64_t inflight);
+
+/* add n to a counter, or count an opcode, for the handler the calling thread
+ * last entered.  These are exported to modules through config.api */
+void	stats_count(int stat, uint64_t n);
+void	stats_count_op(unsigned int op);
+
+/* record a latency in nanoseconds for an opcode, or STATS_OP_MSG, of handler
+ * h in the calling thread's histogram */
+void	stats_time(int h, unsigned int op, uint64_t ns);
+
+/* as stats_time() for the handler the calling thread last entered, exported to
+ * modules through config.api */
+void	stats_time_op(unsigned int op, uint64_t ns);
+
+/* merge every thread's histogram for an opcode of handler h into hist, which
+ * is zeroed first.  Returns the number of values recorded */
+uint64_t stats_latency(int h, unsigned int op, hist_t *hist);
+
+/* write the latency percentiles of every handler and opcode to path, replacing
+ * it atomically.  Returns -1 on error */
+int	stats_dump(const char *path);
+
+/* map the segment of process pid read-only.  Returns NULL on error */
+stats_head_t *stats_attach(pid_t pid);
+void	stats_detach(stats_head_t *head);
+
+#endif /* _LSDM_STATS_H */
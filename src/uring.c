@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "uring.h"
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags,
+		void *arg, size_t argsz)
+{
+	return (int)syscall(SYS_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static void *uring_map(int fd, size_t size, off_t off)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+int uring_init(uring_t *r, unsigned int entries)
+{
+	struct io_uring_params p = {0};
+	memset(r, 0, sizeof(uring_t));
+	r->fd = -1;
+	/* only this thread submits, and it collects completions itself */
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	if ((r->fd = uring_setup(entries, &p)) == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof p);
+		r->fd = uring_setup(entries, &p);
+	}
+	if (r->fd == -1) return -1;
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = EINVAL; /* no timeout on wait, kernel < 5.11 */
+		goto exit_err;
+	}
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+		r->cq_size = 0;
+	}
+	if (!(r->sq_ring = uring_map(r->fd, r->sq_size, IORING_OFF_SQ_RING))) goto exit_err;
+	if (r->cq_size) {
+		if (!(r->cq_ring = uring_map(r->fd, r->cq_size, IORING_OFF_CQ_RING))) goto exit_err;
+	}
+	else r->cq_ring = r->sq_ring;
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (!(r->sqes = uring_map(r->fd, r->sqes_size, IORING_OFF_SQES))) goto exit_err;
+	r->sq_head = (unsigned int *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned int *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)((char *)r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned int *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned int *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+	r->sq_entries = p.sq_entries;
+	/* slot n of the ring always holds sqe n */
+	for (unsigned int i = 0; i < r->sq_entries; i++) r->sq_array[i] = i;
+	return 0;
+exit_err:
+	uring_free(r);
+	return -1;
+}
+
+int uring_bufs(uring_t *r, unsigned int count, size_t size)
+{
+	struct io_uring_buf_reg reg = {0};
+	if (!count || (count & (count - 1)) || count > 32768) {
+		errno = EINVAL;
+		return -1;
+	}
+	r->br_size = count * sizeof(struct io_uring_buf);
+	r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->br == MAP_FAILED) {
+		r->br = NULL;
+		return -1;
+	}
+	if (!(r->bufs = malloc(count * size))) return -1;
+	reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+	reg.ring_entries = count;
+	reg.bgid = 0;
+	if (syscall(SYS_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return -1;
+	r->nbufs = count;
+	r->bufsize = size;
+	for (unsigned int i = 0; i < count; i++) uring_buf_put(r, i);
+	return 0;
+}
+
+void *uring_buf(uring_t *r, unsigned short bid)
+{
+	return r->bufs + (size_t)bid * r->bufsize;
+}
+
+void uring_buf_put(uring_t *r, unsigned short bid)
+{
+	struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (r->nbufs - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring_buf(r, bid);
+	buf->len = r->bufsize;
+	buf->bid = bid;
+	__atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_submit(uring_t *r, unsigned int wait, int timeout_ms)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+	};
+	struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+	const unsigned int submit = r->queued;
+	__atomic_store_n(r->sq_tail, *r->sq_tail + r->queued, __ATOMIC_RELEASE);
+	r->queued = 0;
+	if (!wait) return uring_enter(r->fd, submit, 0, 0, NULL, 0);
+	return uring_enter(r->fd, submit, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			&arg, sizeof arg);
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *r->sq_tail + r->queued;
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		if (uring_submit(r, 0, 0) == -1) return NULL;
+		tail = *r->sq_tail;
+		if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	sqe = &r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->queued++;
+	return sqe;
+}
+
+int uring_wait(uring_t *r, int timeout_ms)
+{
+	return (uring_submit(r, 1, timeout_ms) == -1) ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_cqe(uring_t *r)
+{
+	const unsigned int head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* post a multishot recvmsg on an unbound socket, where it can only wait.
+ * Kernels without multishot recvmsg (< 6.0) fail it straight away */
+static int uring_probe_recv(uring_t *r)
+{
+	struct msghdr hdr = {0};
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int s, ret = 0;
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1) return -1;
+	if (!(sqe = uring_sqe(r))) {
+		close(s);
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = s;
+	sqe->addr = (uint64_t)(uintptr_t)&hdr;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	if (uring_wait(r, 1) == -1 && errno != ETIME) ret = -1;
+	else if ((cqe = uring_cqe(r))) {
+		errno = (cqe->res < 0) ? -cqe->res : EINVAL;
+		ret = -1;
+	}
+	/* the receive still posted goes with the ring */
+	close(s);
+	return ret;
+}
+
+int uring_probe(void)
+{
+	uring_t r;
+	int ret;
+	if (uring_init(&r, 4) == -1) return -1;
+	ret = uring_bufs(&r, 2, 64);
+	if (!ret) ret = uring_probe_recv(&r);
+	uring_free(&r);
+	return ret;
+}
+
+void uring_free(uring_t *r)
+{
+	if (r->fd != -1) close(r->fd);
+	if (r->sqes) munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_size);
+	if (r->sq_ring) munmap(r->sq_ring, r->sq_size);
+	if (r->br) munmap(r->br, r->br_size);
+	free(r->bufs);
+	memset(r, 0, sizeof(uring_t));
+	r->fd = -1;
+}
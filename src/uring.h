@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_URING_H
+#define _LSDM_URING_H 1
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/* Just enough io_uring, through the raw syscalls, for multishot receives into
+ * a ring of provided buffers.  A ring belongs to the thread that set it up */
+typedef struct uring_s uring_t;
+struct uring_s {
+	int			fd;
+	unsigned int *		sq_head;
+	unsigned int *		sq_tail;
+	unsigned int *		sq_mask;
+	unsigned int *		sq_array;
+	unsigned int *		cq_head;
+	unsigned int *		cq_tail;
+	unsigned int *		cq_mask;
+	struct io_uring_sqe *	sqes;
+	struct io_uring_cqe *	cqes;
+	void *			sq_ring;
+	void *			cq_ring;
+	size_t			sq_size;
+	size_t			cq_size;
+	size_t			sqes_size;
+	unsigned int		sq_entries;
+	unsigned int		queued;	/* sqes not yet submitted */
+	/* provided buffers, group 0 */
+	struct io_uring_buf_ring *br;
+	unsigned char *		bufs;
+	size_t			br_size;
+	size_t			bufsize;
+	unsigned int		nbufs;
+	unsigned short		br_tail;
+};
+
+/* set up ring r with at least entries submission slots.  Returns -1 on error,
+ * with errno ENOSYS or EPERM if the kernel won't give us one */
+int	uring_init(uring_t *r, unsigned int entries);
+
+/* provide count buffers (a power of two) of size bytes as buffer group 0.
+ * Returns -1 on error, EINVAL if the kernel has no buffer rings */
+int	uring_bufs(uring_t *r, unsigned int count, size_t size);
+
+/* buffer bid, and hand it back to the kernel once done with */
+void	*uring_buf(uring_t *r, unsigned short bid);
+void	uring_buf_put(uring_t *r, unsigned short bid);
+
+/* next free submission entry, zeroed, submitting the queue first if it is
+ * full.  Returns NULL on error */
+struct io_uring_sqe *uring_sqe(uring_t *r);
+
+/* submit queued entries and wait for at least one completion, or up to
+ * timeout_ms.  Returns -1 on error, ETIME if we timed out */
+int	uring_wait(uring_t *r, int timeout_ms);
+
+/* next completion or NULL, and mark it consumed */
+struct io_uring_cqe *uring_cqe(uring_t *r);
+void	uring_cqe_seen(uring_t *r);
+
+/* can this kernel run uring_init() and uring_bufs() (5.19), and multishot
+ * recvmsg (6.0)?  Returns -1 if not, EINVAL if it is too old */
+int	uring_probe(void);
+
+void	uring_free(uring_t *r);
+
+#endif /* _LSDM_URING_H */
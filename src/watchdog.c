@@ -0,0 +1,216 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "watchdog.h"
+
+enum {
+	WATCHDOG_IDLE,
+	WATCHDOG_CALL,
+	WATCHDOG_STALLED,	/* reported */
+};
+
+#define WATCHDOG_STATE 3
+
+/* call is the number of the thread's latest call, shifted up by two, and its
+ * state.  Numbering calls stops the watchdog mistaking the next one for the
+ * one it looked at.  The rest only changes while the thread is idle */
+typedef struct watchdog_slot_s watchdog_slot_t;
+struct watchdog_slot_s {
+	uint64_t	call;
+	uint64_t	start;
+	uint64_t	budget;
+	void *		arg;
+	pthread_t	thread;
+	void *		frames[WATCHDOG_FRAMES];
+	int		nframes;
+	int		capture;	/* stack wanted, cleared once taken */
+	int		used;
+	unsigned char	op;
+} __attribute__((aligned(64)));
+
+static watchdog_slot_t slots[WATCHDOG_SLOTS];
+static int nslots;	/* high water */
+static __thread watchdog_slot_t *self;
+static __thread int unwatched;
+/* held while a thread is signalled, so it can't exit and give up its slot */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static pthread_t watcher;
+static int running;
+static uint64_t passes;
+static void (*report)(watchdog_stall_t *st);
+
+static uint64_t watchdog_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* thread exit */
+static void watchdog_release(void *arg)
+{
+	watchdog_slot_t *s = arg;
+	pthread_mutex_lock(&lock);
+	__atomic_store_n(&s->used, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&lock);
+}
+
+static void watchdog_key(void)
+{
+	pthread_key_create(&key, watchdog_release);
+}
+
+static watchdog_slot_t *watchdog_claim(void)
+{
+	int expect, high;
+	if (unwatched) return NULL;
+	pthread_once(&once, watchdog_key);
+	for (int i = 0; i < WATCHDOG_SLOTS; i++) {
+		expect = 0;
+		if (!__atomic_compare_exchange_n(&slots[i].used, &expect, 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue;
+		slots[i].thread = pthread_self();
+		pthread_setspecific(key, &slots[i]);
+		high = __atomic_load_n(&nslots, __ATOMIC_RELAXED);
+		while (high <= i && !__atomic_compare_exchange_n(&nslots, &high, i + 1, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		return self = &slots[i];
+	}
+	unwatched = 1;
+	return NULL;
+}
+
+/* backtrace() is loaded beforehand by watchdog_start(), so doesn't allocate */
+static void watchdog_signal(int sig)
+{
+	watchdog_slot_t *s = self;
+	const int err = errno;
+	(void)sig;
+	if (s && __atomic_load_n(&s->capture, __ATOMIC_ACQUIRE)) {
+		s->nframes = backtrace(s->frames, WATCHDOG_FRAMES);
+		__atomic_store_n(&s->capture, 0, __ATOMIC_RELEASE);
+	}
+	errno = err;
+}
+
+/* take the stack of s's thread if it is still in call */
+static void watchdog_capture(watchdog_slot_t *s, uint64_t call, watchdog_stall_t *st)
+{
+	pthread_mutex_lock(&lock);
+	if (__atomic_load_n(&s->used, __ATOMIC_ACQUIRE)
+	&& __atomic_load_n(&s->call, __ATOMIC_ACQUIRE) == call)
+	{
+		__atomic_store_n(&s->capture, 1, __ATOMIC_RELEASE);
+		if (!pthread_kill(s->thread, WATCHDOG_SIGNAL)) {
+			for (int ms = 0; ms < WATCHDOG_CAPTURE_MS; ms++) {
+				if (!__atomic_load_n(&s->capture, __ATOMIC_ACQUIRE)) break;
+				usleep(1000);
+			}
+		}
+		/* less the frame of our signal handler */
+		if (!__atomic_exchange_n(&s->capture, 0, __ATOMIC_ACQ_REL) && s->nframes > 1) {
+			st->nframes = s->nframes - 1;
+			memcpy(st->frames, s->frames + 1, sizeof(void *) * st->nframes);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void watchdog_check(watchdog_slot_t *s)
+{
+	watchdog_stall_t st = {0};
+	uint64_t call = __atomic_load_n(&s->call, __ATOMIC_ACQUIRE), start;
+	if ((call & WATCHDOG_STATE) != WATCHDOG_CALL) return;
+	start = __atomic_load_n(&s->start, __ATOMIC_RELAXED);
+	st.budget = __atomic_load_n(&s->budget, __ATOMIC_RELAXED);
+	st.arg = __atomic_load_n(&s->arg, __ATOMIC_RELAXED);
+	st.op = __atomic_load_n(&s->op, __ATOMIC_RELAXED);
+	st.elapsed = watchdog_now() - start;
+	if (st.elapsed <= st.budget) return;
+	/* fails if the call has ended, and the fields may be from the next */
+	if (!__atomic_compare_exchange_n(&s->call, &call,
+				(call & ~(uint64_t)WATCHDOG_STATE) | WATCHDOG_STALLED, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+	watchdog_capture(s, (call & ~(uint64_t)WATCHDOG_STATE) | WATCHDOG_STALLED, &st);
+	report(&st);
+}
+
+static void *watchdog_thread(void *arg)
+{
+	const struct timespec ts = { .tv_nsec = WATCHDOG_INTERVAL_MS * 1000000 };
+	sigset_t mask;
+	(void)arg;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		const int n = __atomic_load_n(&nslots, __ATOMIC_ACQUIRE);
+		for (int i = 0; i < n; i++) watchdog_check(&slots[i]);
+		__atomic_add_fetch(&passes, 1, __ATOMIC_RELEASE);
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+int watchdog_start(void (*stall)(watchdog_stall_t *st))
+{
+	struct sigaction sa = { .sa_handler = watchdog_signal, .sa_flags = SA_RESTART };
+	void *frame;
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return 0;
+	backtrace(&frame, 1);
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(WATCHDOG_SIGNAL, &sa, NULL) == -1) return -1;
+	report = stall;
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	if ((errno = pthread_create(&watcher, NULL, watchdog_thread, NULL))) {
+		__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+		return -1;
+	}
+	return 0;
+}
+
+void watchdog_enter(void *arg, uint64_t budget, unsigned char op)
+{
+	watchdog_slot_t *s = self;
+	uint64_t call;
+	if (!s && !(s = watchdog_claim())) return;
+	call = __atomic_load_n(&s->call, __ATOMIC_RELAXED) & ~(uint64_t)WATCHDOG_STATE;
+	__atomic_store_n(&s->arg, arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->budget, budget, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->op, op, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->start, watchdog_now(), __ATOMIC_RELAXED);
+	__atomic_store_n(&s->call, call + (WATCHDOG_STATE + 1) + WATCHDOG_CALL, __ATOMIC_RELEASE);
+}
+
+int watchdog_leave(void)
+{
+	watchdog_slot_t *s = self;
+	uint64_t call;
+	if (!s) return 0;
+	call = __atomic_load_n(&s->call, __ATOMIC_RELAXED) & ~(uint64_t)WATCHDOG_STATE;
+	return (__atomic_exchange_n(&s->call, call, __ATOMIC_ACQ_REL) & WATCHDOG_STATE) == WATCHDOG_STALLED;
+}
+
+void watchdog_sync(void)
+{
+	const uint64_t seen = __atomic_load_n(&passes, __ATOMIC_ACQUIRE);
+	while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)
+	&& __atomic_load_n(&passes, __ATOMIC_ACQUIRE) < seen + 2)
+		usleep(1000);
+}
+
+void watchdog_stop(void)
+{
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	pthread_join(watcher, NULL);
+}
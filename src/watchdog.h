@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_WATCHDOG_H
+#define _LSDM_WATCHDOG_H 1
+
+#include <signal.h>
+#include <stdint.h>
+
+/* Watchdog for calls that run too long.  A thread marks the start and end of
+ * each call to be watched in a slot of its own, so that costs it a couple of
+ * uncontended stores.  The watchdog thread looks over the slots every
+ * WATCHDOG_INTERVAL_MS and reports each call over its budget once, with the
+ * stack of the thread making it, taken by signalling that thread with
+ * WATCHDOG_SIGNAL.  Threads blocking the signal are reported without.  The
+ * handler is SA_RESTART, but a stuck thread in sleep or poll will see EINTR */
+#define WATCHDOG_SLOTS 256	/* threads watched, any beyond go unwatched */
+#define WATCHDOG_FRAMES 32
+#define WATCHDOG_INTERVAL_MS 10
+#define WATCHDOG_CAPTURE_MS 100	/* how long to wait for a stack */
+#define WATCHDOG_SIGNAL (SIGRTMIN + 1)
+
+typedef struct watchdog_stall_s watchdog_stall_t;
+struct watchdog_stall_s {
+	void *		arg;		/* as passed to watchdog_enter() */
+	uint64_t	budget;		/* ns */
+	uint64_t	elapsed;	/* ns, when noticed */
+	void *		frames[WATCHDOG_FRAMES];
+	int		nframes;	/* 0 if the stack wasn't taken */
+	unsigned char	op;
+};
+
+/* start the watchdog thread, calling stall from it for each call found over
+ * budget.  Does nothing if it is already running */
+int	watchdog_start(void (*stall)(watchdog_stall_t *st));
+
+/* the calling thread starts a call on behalf of arg, which it has budget ns
+ * to finish */
+void	watchdog_enter(void *arg, uint64_t budget, unsigned char op);
+
+/* the call has finished.  Returns 1 if it was reported */
+int	watchdog_leave(void);
+
+/* wait for the watchdog to make a full pass, after which it holds no arg from
+ * a call that had finished when this was called */
+void	watchdog_sync(void);
+
+void	watchdog_stop(void);
+
+#endif /* _LSDM_WATCHDOG_H */
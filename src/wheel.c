@@ -0,0 +1,309 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_WORDS (WHEEL_SLOTS / 64)
+#define WHEEL_RANGE ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_NEVER UINT64_MAX
+
+enum {
+	WHEEL_IDLE,
+	WHEEL_PENDING,
+	WHEEL_RUNNING,	/* periodic, in its callback */
+};
+
+/* slot lists are linked through a pointer back to whatever points at each
+ * timer, so one is unlinked without knowing its slot.  used marks slots that
+ * have had timers since they were last found empty */
+struct wheel_s {
+	pthread_mutex_t	lock;
+	pthread_cond_t	done;	/* a callback has returned */
+	wheel_timer_t *	slot[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t	used[WHEEL_LEVELS][WHEEL_WORDS];
+	uint64_t	base;	/* clock at tick 0, ns */
+	uint64_t	tick;	/* ns */
+	uint64_t	now;	/* last tick run */
+	uint64_t	wake;	/* tick the timerfd is set for */
+	unsigned long	count;
+	wheel_timer_t *	running;
+	pthread_t	runner;
+	int		stop;	/* running was cancelled, leave it alone */
+	int		fd;
+};
+
+static uint64_t wheel_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the tick we are in */
+static uint64_t wheel_now(wheel_t *w)
+{
+	return (wheel_clock() - w->base) / w->tick;
+}
+
+/* first tick to start at or after ms from now */
+static uint64_t wheel_ticks(wheel_t *w, uint64_t ms)
+{
+	return (wheel_clock() - w->base + ms * 1000000 + w->tick - 1) / w->tick;
+}
+
+/* set the timerfd for tick, or disarm it.  Call with lock held */
+static void wheel_arm(wheel_t *w, uint64_t tick)
+{
+	struct itimerspec its = {0};
+	uint64_t ns;
+	w->wake = tick;
+	if (tick != WHEEL_NEVER) {
+		ns = w->base + tick * w->tick;
+		its.it_value.tv_sec = ns / 1000000000;
+		its.it_value.tv_nsec = ns % 1000000000;
+	}
+	timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* call with lock held */
+static void wheel_insert(wheel_t *w, wheel_timer_t *t, unsigned int level, unsigned int slot)
+{
+	t->next = w->slot[level][slot];
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = &w->slot[level][slot];
+	w->slot[level][slot] = t;
+	w->used[level][slot / 64] |= (uint64_t)1 << (slot % 64);
+	t->state = WHEEL_PENDING;
+	w->count++;
+}
+
+/* call with lock held */
+static void wheel_link(wheel_t *w, wheel_timer_t *t)
+{
+	unsigned int level = 0;
+	uint64_t e;
+	if (t->expires <= w->now) t->expires = w->now + 1;
+	e = (t->expires - w->now < WHEEL_RANGE) ? t->expires : w->now + WHEEL_RANGE - 1;
+	while (level < WHEEL_LEVELS - 1 && e - w->now >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+		level++;
+	wheel_insert(w, t, level, (e >> (WHEEL_BITS * level)) & WHEEL_MASK);
+}
+
+/* call with lock held */
+static void wheel_unlink(wheel_t *w, wheel_timer_t *t)
+{
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	w->count--;
+}
+
+/* steps round level from its current slot to the next with timers, clearing
+ * marks left by cancelled timers.  Returns 0 if there are none */
+static unsigned int wheel_next_slot(wheel_t *w, unsigned int level)
+{
+	const unsigned int cur = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	unsigned int slot, bit;
+	uint64_t bits;
+	for (unsigned int step = 1; step <= WHEEL_SLOTS; ) {
+		slot = (cur + step) & WHEEL_MASK;
+		bits = w->used[level][slot / 64] >> (slot % 64);
+		if (!bits) {
+			step += 64 - slot % 64;
+			continue;
+		}
+		bit = __builtin_ctzll(bits);
+		step += bit;
+		if (step > WHEEL_SLOTS) break;
+		slot += bit;
+		if (w->slot[level][slot]) return step;
+		w->used[level][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+		step++;
+	}
+	return 0;
+}
+
+/* next tick with work to do: a level 0 slot to fire, or a later slot to
+ * cascade.  Call with lock held */
+static uint64_t wheel_next(wheel_t *w)
+{
+	uint64_t next = WHEEL_NEVER, tick;
+	unsigned int step, shift;
+	if (!w->count) return WHEEL_NEVER;
+	for (unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+		if (!(step = wheel_next_slot(w, level))) continue;
+		shift = WHEEL_BITS * level;
+		tick = ((w->now >> shift) + step) << shift;
+		if (tick < next) next = tick;
+	}
+	return next;
+}
+
+/* move the timers of each level whose slot comes round at this tick down
+ * to where they now belong.  Those due this tick go in its level 0 slot, for
+ * wheel_fire() to run next.  Call with lock held */
+static void wheel_cascade(wheel_t *w)
+{
+	wheel_timer_t *t, *next;
+	unsigned int slot;
+	for (unsigned int level = 1; level < WHEEL_LEVELS; level++) {
+		if (w->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) break;
+		slot = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		t = w->slot[level][slot];
+		w->slot[level][slot] = NULL;
+		for (; t; t = next) {
+			next = t->next;
+			w->count--;
+			if (t->expires <= w->now) wheel_insert(w, t, 0, w->now & WHEEL_MASK);
+			else wheel_link(w, t);
+		}
+	}
+}
+
+/* fire the timers in this tick's slot.  The lock is dropped for each
+ * callback, and a timer is only touched afterwards if it is periodic and
+ * wasn't cancelled meanwhile */
+static int wheel_fire(wheel_t *w)
+{
+	const unsigned int slot = w->now & WHEEL_MASK;
+	wheel_timer_t *t;
+	uint64_t period;
+	int fired = 0;
+	while ((t = w->slot[0][slot])) {
+		wheel_unlink(w, t);
+		period = t->period;
+		t->state = (period) ? WHEEL_RUNNING : WHEEL_IDLE;
+		w->running = t;
+		w->stop = 0;
+		pthread_mutex_unlock(&w->lock);
+		t->fn(t->arg);
+		pthread_mutex_lock(&w->lock);
+		if (!w->stop && period && t->state == WHEEL_RUNNING) {
+			t->expires = w->now + period;
+			wheel_link(w, t);
+		}
+		w->running = NULL;
+		pthread_cond_broadcast(&w->done);
+		fired++;
+	}
+	return fired;
+}
+
+wheel_t *wheel_create(unsigned int tick_ms)
+{
+	wheel_t *w;
+	if (!tick_ms) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!(w = calloc(1, sizeof(wheel_t)))) return NULL;
+	if ((w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		free(w);
+		return NULL;
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->done, NULL);
+	w->tick = (uint64_t)tick_ms * 1000000;
+	w->base = wheel_clock();
+	w->wake = WHEEL_NEVER;
+	return w;
+}
+
+int wheel_fd(wheel_t *w)
+{
+	return w->fd;
+}
+
+int wheel_add(wheel_t *w, wheel_timer_t *t, uint64_t ms, uint64_t period_ms,
+		void (*fn)(void *arg), void *arg)
+{
+	const uint64_t tick_ms = w->tick / 1000000;
+	if (!fn) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&w->lock);
+	if (t->state == WHEEL_PENDING) {
+		pthread_mutex_unlock(&w->lock);
+		errno = EBUSY;
+		return -1;
+	}
+	/* an idle wheel may be far behind, with nothing to catch up on */
+	if (!w->count && !w->running) w->now = wheel_now(w);
+	t->fn = fn;
+	t->arg = arg;
+	t->period = (period_ms) ? (period_ms + tick_ms - 1) / tick_ms : 0;
+	t->expires = wheel_ticks(w, ms);
+	wheel_link(w, t);
+	if (t->expires < w->wake) wheel_arm(w, t->expires);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+int wheel_cancel(wheel_t *w, wheel_timer_t *t)
+{
+	int ret = -1;
+	pthread_mutex_lock(&w->lock);
+	if (t->state == WHEEL_PENDING) {
+		wheel_unlink(w, t);
+		t->state = WHEEL_IDLE;
+		ret = 0;
+	}
+	if (w->running == t && !w->stop) {
+		w->stop = 1;
+		t->state = WHEEL_IDLE;
+		ret = 0;
+	}
+	if (!pthread_equal(w->runner, pthread_self())) {
+		while (w->running == t) pthread_cond_wait(&w->done, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (ret) errno = ENOENT;
+	return ret;
+}
+
+int wheel_run(wheel_t *w)
+{
+	uint64_t target, next, n;
+	int fired = 0;
+	if (read(w->fd, &n, sizeof n) == -1 && errno != EAGAIN) return -1;
+	target = wheel_now(w);
+	pthread_mutex_lock(&w->lock);
+	w->runner = pthread_self();
+	while ((next = wheel_next(w)) <= target) {
+		w->now = next;
+		wheel_cascade(w);
+		fired += wheel_fire(w);
+	}
+	if (target > w->now) w->now = target;
+	wheel_arm(w, wheel_next(w));
+	pthread_mutex_unlock(&w->lock);
+	return fired;
+}
+
+unsigned long wheel_count(wheel_t *w)
+{
+	unsigned long n;
+	pthread_mutex_lock(&w->lock);
+	n = w->count;
+	pthread_mutex_unlock(&w->lock);
+	return n;
+}
+
+void wheel_free(wheel_t *w)
+{
+	if (!w) return;
+	close(w->fd);
+	pthread_cond_destroy(&w->done);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
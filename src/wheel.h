@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _LSDM_WHEEL_H
+#define _LSDM_WHEEL_H 1
+
+#include <stdint.h>
+
+/* Hierarchical timer wheel.  WHEEL_LEVELS wheels of WHEEL_SLOTS slots each
+ * cover 2^32 ticks, later timers waiting in the last level until they come
+ * into range.  Adding and cancelling a timer is O(1), and timers are kept in
+ * storage belonging to the caller so the wheel never allocates */
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_s wheel_t;
+typedef struct wheel_timer_s wheel_timer_t;
+
+/* zero before first use.  Fields belong to the wheel while it is pending */
+struct wheel_timer_s {
+	wheel_timer_t *	next;
+	wheel_timer_t **pprev;	/* whatever points at us */
+	void (*		fn)(void *arg);
+	void *		arg;
+	uint64_t	expires;	/* tick */
+	uint64_t	period;		/* ticks, 0 if it fires once */
+	int		state;
+};
+
+/* create a wheel advancing every tick_ms, with a timerfd to poll for
+ * wheel_run().  Returns NULL on error */
+wheel_t *wheel_create(unsigned int tick_ms);
+
+/* descriptor that becomes readable when wheel_run() has timers to fire */
+int	wheel_fd(wheel_t *w);
+
+/* call fn(arg) from wheel_run() after ms, then every period_ms if that isn't
+ * 0.  Returns -1 with EBUSY if t is already pending.  Any thread may add */
+int	wheel_add(wheel_t *w, wheel_timer_t *t, uint64_t ms, uint64_t period_ms,
+		void (*fn)(void *arg), void *arg);
+
+/* stop t.  Once this returns its callback isn't running, unless this was
+ * called from it, and won't be called again.  Returns -1 with ENOENT if t
+ * wasn't pending */
+int	wheel_cancel(wheel_t *w, wheel_timer_t *t);
+
+/* fire the timers that are due, from the one thread driving the wheel, and
+ * rearm the timerfd for the next.  Returns the number fired */
+int	wheel_run(wheel_t *w);
+
+/* timers pending */
+unsigned long wheel_count(wheel_t *w);
+
+/* free w.  Pending timers are forgotten, not fired */
+void	wheel_free(wheel_t *w);
+
+#endif /* _LSDM_WHEEL_H */
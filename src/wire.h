@@ -9,6 +9,23 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+/* header librecast prepends to every datagram sent with lc_msg_send().  A copy
+ * of lc_message_head_t from librecast's private librecast_pvt.h (librecast 0.3),
+ * which isn't installed.  If librecast changes it, the size check below may not
+ * notice, but test 0000-0040, which decodes what lc_msg_send() puts on the
+ * wire, will.  All fields are big-endian */
+typedef struct wire_msghead_s wire_msghead_t;
+struct wire_msghead_s {
+	uint64_t	timestamp;
+	uint64_t	seq;
+	uint64_t	rnd;
+	uint8_t		op;
+	uint64_t	len;
+} __attribute__((__packed__));
+
+#define WIRE_MSGHEAD_SIZE 33
+_Static_assert(sizeof(wire_msghead_t) == WIRE_MSGHEAD_SIZE, "wire_msghead_t must match librecast's header");
+
 ssize_t wire_pack(struct iovec *data, const struct iovec iovs[], int iov_count,
 		uint8_t op, uint8_t flags);
 ssize_t wire_pack_7bit(struct iovec *data, const struct iovec iovs[], int iov_count, size_t offset);
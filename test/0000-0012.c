@@ -71,7 +71,7 @@ void runtests()
 	for (int i = 0; i < p.fieldcount; i++) {
 		test_expectiov(iovs[i], &fields[i]);
 	}
-	free(p.data);
+	auth_payload_free(&p);
 	free(pkt.iov_base);
 	free(data.iov_base);
 }
@@ -120,7 +120,7 @@ void *testthread(void *arg)
 	for (int i = 0; i < reply.fieldcount; i++) {
 		test_log("%.*s", (int)reply.fields[i].iov_len, (char*)reply.fields[i].iov_base);
 	}
-	free(reply.data);
+	auth_payload_free(&reply);
 	lc_msg_free(&msg_repl);
 
 	/* TODO: (7) handle response/error */
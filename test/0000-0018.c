@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+#include "../src/server.h"
+#include <librecast.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+void *testthread(void *arg)
+{
+	test_sleep(0, 99999999); /* give the event loop a chance to start */
+	server_stop();
+	pthread_exit(arg);
+}
+
+int main()
+{
+	test_name("start/stop server (epoll engine)");
+	config_include("./0000-0018.conf");
+	test_assert(config.engine == ENGINE_EPOLL, "engine set from config file");
+	test_assert(config.loopthreads == 2, "loopthreads set from config file");
+	test_assert(config.workers == 4, "workers set from config file");
+	test_assert(config.handlers->batch == 16, "handler batch set from config file");
+	test_assert(config.handlers->next->batch == 0, "handler batch defaults to 0");
+	test_assert(config.handlers->queue == 256, "handler queue set from config file");
+	test_assert(config.handlers->drop == DROP_OLDEST, "handler drop set from config file");
+	test_assert(config.handlers->deadline_ms == 50, "handler deadline_ms set from config file");
+	test_assert(config.handlers->next->drop == DROP_NEWEST, "handler drop defaults to newest");
+	test_assert(config_drop("bogus") == -1, "config_drop() - unknown policy");
+	test_assert(config.handlers->ratelimit == 100, "handler ratelimit set from config file");
+	test_assert(config.handlers->ratelimit_burst == 200, "handler ratelimit burst set from config file");
+	test_assert(config.handlers->ratelimit_by == RATEKEY_ADDR, "handler ratelimit_by set from config file");
+	test_assert(config.handlers->rcvbuf == 1048576, "handler rcvbuf set from config file");
+	test_assert(config.handlers->sndbuf == 262144, "handler sndbuf set from config file");
+	test_assert(config.handlers->next->rcvbuf == 0, "handler rcvbuf defaults to 0");
+	test_assert(config_engine("listen") == ENGINE_LISTEN, "config_engine(\"listen\")");
+	test_assert(config_engine("bogus") == -1, "config_engine() - unknown engine");
+	test_assert(!config_handler_cmp(config.handlers, config.handlers), "config_handler_cmp() - same handler");
+	test_assert(config_handler_cmp(config.handlers, config.handlers->next), "config_handler_cmp() - different handler");
+
+	/* create thread to stop server */
+	pthread_t thread;
+	pthread_attr_t attr = {0};
+	pthread_attr_init(&attr);
+	pthread_create(&thread, &attr, testthread, NULL);
+	server_start();
+	pthread_join(thread, NULL);
+	config_free();
+
+	return fails;
+}
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/pool.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define ITEMS 100000
+
+static unsigned int processed;
+static unsigned int sum;
+static unsigned int idled;
+
+void job(void *arg)
+{
+	__atomic_add_fetch(&sum, (unsigned int)(uintptr_t)arg, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&processed, 1, __ATOMIC_RELAXED);
+}
+
+void idle(void *arg)
+{
+	(void)arg;
+	__atomic_add_fetch(&idled, 1, __ATOMIC_RELAXED);
+}
+
+void slowjob(void *arg)
+{
+	(void)arg;
+	usleep(1000);
+	__atomic_add_fetch(&processed, 1, __ATOMIC_RELAXED);
+}
+
+int main()
+{
+	pool_t *pool;
+	unsigned int expected = 0;
+	int pushed = 0;
+
+	test_name("worker pool with work-stealing deques");
+
+	errno = 0;
+	test_assert(pool_create(0, 16, job, NULL) == NULL && errno == EINVAL, "pool_create() - no workers");
+
+	pool = pool_create(4, 64, job, idle);
+	test_assert(pool != NULL, "pool_create()");
+	for (unsigned int i = 1; i <= ITEMS; i++) {
+		while (pool_push(pool, (void *)(uintptr_t)i) == -1) {
+			test_assert(errno == EAGAIN, "pool_push() - EAGAIN when full");
+			sched_yield();
+		}
+		expected += i;
+	}
+	pool_free(pool);
+	test_assert(processed == ITEMS, "all items processed (%u)", processed);
+	test_assert(sum == expected, "each item processed exactly once");
+	test_assert(idled > 0, "idle callback called");
+
+	/* tiny deques fill up: push returns EAGAIN rather than blocking */
+	processed = 0;
+	pool = pool_create(2, 1, slowjob, NULL);
+	test_assert(pool != NULL, "pool_create() - slow jobs");
+	test_assert(pool_push(pool, NULL) == -1 && errno == EINVAL, "pool_push() - NULL item");
+	for (int i = 0; i < 16; i++) {
+		if (!pool_push(pool, pool)) pushed++;
+	}
+	test_assert(pushed < 16, "pool_push() refuses when every deque is full");
+	pool_free(pool);
+	test_assert(processed == (unsigned int)pushed, "queued items drained on free (%u/%i)", processed, pushed);
+
+	return fails;
+}
@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/reply.h"
+#include "../src/wheel.h"
+#include <errno.h>
+#include <librecast.h>
+#include <poll.h>
+
+int main()
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan;
+	lc_message_t msg;
+	char *data[] = { "one", "two", "three" };
+	const int count = sizeof data / sizeof data[0];
+	char big[REPLY_ARENA + 1];
+	struct pollfd pfd[2] = {{ .events = POLLIN }, { .events = POLLIN }};
+	wheel_t *w;
+
+	test_name("reply batching with sendmmsg()");
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, "0000-0020");
+	lc_channel_bind(sock, chan);
+	lc_channel_join(chan);
+
+	test_assert(reply_flush() == 0, "reply_flush() - nothing queued");
+	errno = 0;
+	test_assert(reply_enqueue(NULL, "x", 1) == -1 && errno == EINVAL,
+			"reply_enqueue() - no channel");
+	errno = 0;
+	test_assert(reply_enqueue(chan, big, sizeof big) == -1 && errno == EMSGSIZE,
+			"reply_enqueue() - too big");
+
+	/* deferred replies wait for reply_flush() */
+	reply_defer(1);
+	for (int i = 0; i < count; i++) {
+		test_assert(reply_enqueue(chan, data[i], strlen(data[i])) == 0, "reply_enqueue()");
+	}
+	test_assert(reply_flush() == count, "reply_flush() sent batch");
+	for (int i = 0; i < count; i++) {
+		test_assert(lc_msg_recv(sock, &msg) > 0, "lc_msg_recv()");
+		test_expectn(data[i], msg.data, msg.len);
+		lc_msg_free(&msg);
+	}
+
+	/* without defer, replies go straight out */
+	reply_defer(0);
+	test_assert(reply_enqueue(chan, data[0], strlen(data[0])) == 0, "reply_enqueue() - immediate");
+	test_assert(reply_flush() == 0, "nothing left to flush");
+	test_assert(lc_msg_recv(sock, &msg) > 0, "lc_msg_recv() - immediate");
+	test_expectn(data[0], msg.data, msg.len);
+	lc_msg_free(&msg);
+
+	/* a deferred reply goes on its timer, with nothing else to flush it */
+	w = wheel_create(1);
+	reply_timers(w);
+	reply_defer(1);
+	test_assert(reply_enqueue(chan, data[1], strlen(data[1])) == 0, "reply_enqueue() - deferred");
+	pfd[0].fd = lc_socket_raw(sock);
+	pfd[1].fd = wheel_fd(w);
+	for (int i = 0; i < 100 && !pfd[0].revents; i++) {
+		if (poll(pfd, 2, 10) > 0 && pfd[1].revents) wheel_run(w);
+	}
+	test_assert(pfd[0].revents & POLLIN, "sent within REPLY_DELAY by timer");
+	if (pfd[0].revents & POLLIN) {
+		test_assert(lc_msg_recv(sock, &msg) > 0, "lc_msg_recv() - timer");
+		test_expectn(data[1], msg.data, msg.len);
+		lc_msg_free(&msg);
+	}
+	test_assert(reply_flush() == 0, "nothing left after timer");
+
+	reply_free();
+	reply_timers(NULL);
+	wheel_free(w);
+	lc_ctx_free(lctx);
+	return fails;
+}
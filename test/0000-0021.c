@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+#include "../src/server.h"
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main()
+{
+	pid_t pid[2];
+	int status;
+
+	test_name("serve bound channels from forked worker processes");
+	config_include("./0000-0021.conf");
+	test_assert(config.processes == 2, "processes set from config file");
+	test_assert(server_bind() == 0, "server_bind()");
+	for (int i = 0; i < config.processes; i++) {
+		if (!(pid[i] = fork())) {
+			close(1); /* prevent server messing up test output */
+			server_run();
+			_exit(EXIT_SUCCESS);
+		}
+		test_assert(pid[i] != -1, "fork()");
+	}
+	test_sleep(0, 99999999); /* give workers a chance to start */
+	for (int i = 0; i < config.processes; i++) {
+		test_assert(waitpid(pid[i], &status, WNOHANG) == 0, "worker %i running", i);
+		kill(pid[i], SIGINT);
+		test_assert(waitpid(pid[i], &status, 0) == pid[i], "waitpid()");
+		test_assert(WIFEXITED(status) && !WEXITSTATUS(status), "worker %i exited cleanly", i);
+	}
+	server_unbind();
+	config_free();
+	return fails;
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+#include "../src/server.h"
+#include <pthread.h>
+#include <unistd.h>
+
+void *testthread(void *arg)
+{
+	test_sleep(0, 99999999); /* give loop threads a chance to start */
+	server_stop();
+	pthread_exit(arg);
+}
+
+int main()
+{
+	handler_t *h;
+
+	test_name("start/stop server (percore engine)");
+	config_include("./0000-0022.conf");
+	test_assert(config.engine == ENGINE_PERCORE, "engine set from config file");
+	h = config.handlers;
+	test_expect("0", h->cpuset);
+	h = h->next;
+	test_expect("0", h->cpuset);
+	h = h->next;
+	test_assert(h->cpuset == NULL, "cpuset defaults to NULL");
+
+	pthread_t thread;
+	pthread_attr_t attr = {0};
+	pthread_attr_init(&attr);
+	pthread_create(&thread, &attr, testthread, NULL);
+	server_start();
+	pthread_join(thread, NULL);
+	config_free();
+
+	return fails;
+}
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/bufpool.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BUFFERS 64
+#define THREADS 4
+#define ROUNDS 100000
+
+static bufpool_t *pool;
+static unsigned int corrupt;
+
+/* each thread stamps the buffers it holds, so a buffer handed out twice
+ * shows up as a stamp changing underneath us */
+void *thread_buffers(void *arg)
+{
+	uintptr_t id = (uintptr_t)arg;
+	uintptr_t *buf;
+	for (int i = 0; i < ROUNDS; i++) {
+		if (!(buf = bufpool_get(pool))) continue;
+		*(volatile uintptr_t *)buf = id;
+		sched_yield();
+		if (*(volatile uintptr_t *)buf != id) __atomic_add_fetch(&corrupt, 1, __ATOMIC_RELAXED);
+		bufpool_put(pool, buf);
+	}
+	return NULL;
+}
+
+int main()
+{
+	void *buf[BUFFERS];
+	pthread_t thread[THREADS];
+	int unique = 1;
+
+	test_name("receive buffer pool");
+
+	errno = 0;
+	test_assert(bufpool_create(0, 100, 0) == NULL && errno == EINVAL, "bufpool_create() - no buffers");
+
+	pool = bufpool_create(BUFFERS, 100, BUFPOOL_HUGEPAGES);
+	test_assert(pool != NULL, "bufpool_create()");
+	test_assert(bufpool_size(pool) == 128, "size rounded up to cache line (%zu)", bufpool_size(pool));
+	test_assert(bufpool_avail(pool) == BUFFERS, "all buffers available");
+	for (int i = 0; i < BUFFERS; i++) {
+		buf[i] = bufpool_get(pool);
+		test_assert(buf[i] != NULL, "bufpool_get() %i", i);
+		test_assert(((uintptr_t)buf[i] % BUFPOOL_ALIGN) == 0, "buffer %i aligned", i);
+		memset(buf[i], i, bufpool_size(pool));
+	}
+	for (int i = 0; i < BUFFERS; i++) {
+		for (int j = i + 1; j < BUFFERS; j++) {
+			if (buf[i] == buf[j]) unique = 0;
+		}
+	}
+	test_assert(unique, "buffers are distinct");
+	test_assert(bufpool_get(pool) == NULL, "bufpool_get() - NULL when exhausted");
+	test_assert(bufpool_avail(pool) == 0, "none available");
+	bufpool_put(pool, buf[7]);
+	test_assert(bufpool_get(pool) == buf[7], "returned buffer reused");
+	for (int i = 0; i < BUFFERS; i++) bufpool_put(pool, buf[i]);
+	test_assert(bufpool_avail(pool) == BUFFERS, "all buffers returned");
+
+	for (uintptr_t i = 0; i < THREADS; i++) {
+		pthread_create(&thread[i], NULL, thread_buffers, (void *)(i + 1));
+	}
+	for (int i = 0; i < THREADS; i++) pthread_join(thread[i], NULL);
+	test_assert(corrupt == 0, "no buffer handed out twice");
+	test_assert(bufpool_avail(pool) == BUFFERS, "all buffers returned after threads");
+	bufpool_free(pool);
+
+	return fails;
+}
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/ratelimit.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#define THREADS 4
+#define KEYS 10000
+
+static ratelimit_t *rl;
+static unsigned int allowed;
+
+void *thread_check(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 1000; i++) {
+		if (!ratelimit_check(rl, "shared", 6))
+			__atomic_add_fetch(&allowed, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int main()
+{
+	unsigned char key[32];
+	pthread_t thread[THREADS];
+	int ok = 0;
+
+	test_name("per-sender token bucket rate limiter");
+
+	errno = 0;
+	test_assert(ratelimit_create(16, 0, 1) == NULL && errno == EINVAL, "ratelimit_create() - zero rate");
+
+	/* 10 per second with a burst of 5 */
+	rl = ratelimit_create(64, 10, 5);
+	test_assert(rl != NULL, "ratelimit_create()");
+	memset(key, 1, sizeof key);
+	for (int i = 0; i < 5; i++) {
+		test_assert(ratelimit_check(rl, key, sizeof key) == 0, "burst %i allowed", i);
+	}
+	test_assert(ratelimit_check(rl, key, sizeof key) == -1, "over burst refused");
+	test_assert(ratelimit_limited(rl) == 1, "refusal counted");
+	memset(key, 2, sizeof key);
+	test_assert(ratelimit_check(rl, key, sizeof key) == 0, "other sender unaffected");
+	memset(key, 1, sizeof key);
+	test_sleep(0, 250000000);
+	test_assert(ratelimit_check(rl, key, sizeof key) == 0, "bucket refills over time");
+	ratelimit_free(rl);
+
+	/* across the clock's wrap, 44 bits of microseconds */
+	rl = ratelimit_create(64, 10, 5);
+	ratelimit_clock(rl, (UINT64_C(1) << 44) - 100000);
+	for (int i = 0; i < 5; i++) {
+		test_assert(ratelimit_check(rl, key, sizeof key) == 0, "wrap - burst %i allowed", i);
+	}
+	test_assert(ratelimit_check(rl, key, sizeof key) == -1, "wrap - over burst refused");
+	test_sleep(0, 250000000);
+	test_assert(ratelimit_check(rl, key, sizeof key) == 0, "wrap - bucket refills after wrap");
+	/* a bucket left for half the clock's range seems to be ahead of now */
+	for (int i = 0; i < 5; i++) ratelimit_check(rl, key, sizeof key);
+	ratelimit_clock(rl, (UINT64_C(1) << 43) + 1000000);
+	test_assert(ratelimit_check(rl, key, sizeof key) == 0, "wrap - stale bucket is full");
+	ratelimit_free(rl);
+	test_assert(ratelimit_create(16, 1, UINT32_MAX) == NULL && errno == EINVAL,
+			"ratelimit_create() - burst beyond the clock");
+
+	/* more senders than buckets: memory stays fixed and new senders share
+	 * the limit of whoever they displace rather than getting a free pass */
+	rl = ratelimit_create(64, 1, 1);
+	for (int i = 0; i < KEYS; i++) {
+		memcpy(key, &i, sizeof i);
+		if (!ratelimit_check(rl, key, sizeof key)) ok++;
+	}
+	test_assert(ok < KEYS, "flood of senders limited (%i/%i allowed)", ok, KEYS);
+	ratelimit_free(rl);
+
+	/* concurrent checks on one key never allow more than the burst */
+	rl = ratelimit_create(64, 1, 100);
+	for (int i = 0; i < THREADS; i++) pthread_create(&thread[i], NULL, thread_check, NULL);
+	for (int i = 0; i < THREADS; i++) pthread_join(thread[i], NULL);
+	test_assert(allowed >= 100 && allowed <= 101, "concurrent burst (%u allowed)", allowed);
+	ratelimit_free(rl);
+
+	return fails;
+}
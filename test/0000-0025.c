@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define THREADS 4
+#define COUNT 10000
+
+static int h;
+
+void *thread_count(void *arg)
+{
+	(void)arg;
+	stats_enter(h);
+	for (int i = 0; i < COUNT; i++) {
+		stats_add(h, STAT_PACKETS, 1);
+		stats_add(h, STAT_BYTES, 100);
+		stats_count_op(i % 3);
+	}
+	return NULL;
+}
+
+static uint64_t sum(stats_head_t *head, int h, int stat)
+{
+	uint64_t n = 0;
+	for (uint32_t t = 0; t < head->threads; t++) n += stats_counters(head, t, h)->stat[stat];
+	return n;
+}
+
+static uint64_t sum_op(stats_head_t *head, int h, unsigned int op)
+{
+	uint64_t n = 0;
+	for (uint32_t t = 0; t < head->threads; t++) n += stats_counters(head, t, h)->op[op];
+	return n;
+}
+
+int main()
+{
+	pthread_t thread[THREADS];
+	stats_head_t *head;
+	char path[64];
+
+	test_name("shared memory stats");
+
+	test_assert(stats_handler("none", "none.so") == -1, "stats_handler() - no segment");
+	stats_add(0, STAT_PACKETS, 1); /* no segment, no-op */
+
+	test_assert(stats_open(2) == 0, "stats_open()");
+	snprintf(path, sizeof path, STATS_PATH, (int)getpid());
+	test_assert(access(path, F_OK) == 0, "segment created");
+
+	h = stats_handler("chan0", "/usr/lib/auth.so");
+	test_assert(h == 0, "stats_handler() - first slot");
+	test_assert(stats_handler("chan1", "echo.so") == 1, "stats_handler() - second slot");
+
+	for (int i = 0; i < THREADS; i++) pthread_create(&thread[i], NULL, thread_count, NULL);
+	for (int i = 0; i < THREADS; i++) pthread_join(thread[i], NULL);
+	stats_add(1, STAT_DROPS, 3);
+	stats_add(1, STAT_COUNT, 1); /* out of range, ignored */
+	stats_op(1, STATS_OPS);      /* out of range, ignored */
+	stats_depth(1, 42);
+	stats_handler_retire(0);
+
+	head = stats_attach(getpid());
+	test_assert(head != NULL, "stats_attach()");
+	if (head) {
+		test_assert(head->pid == getpid(), "pid recorded");
+		test_assert(head->handlers == STATS_HANDLERS, "minimum handler slots");
+		test_assert(head->used == 2, "used slots");
+		test_strcmp(stats_handler_slot(head, 0)->channel, "chan0", "channel name");
+		test_strcmp(stats_handler_slot(head, 0)->module, "/usr/lib/auth.so", "module name");
+		test_assert(sum(head, 0, STAT_PACKETS) == THREADS * COUNT, "packets counted across threads");
+		test_assert(sum(head, 0, STAT_BYTES) == THREADS * COUNT * 100, "bytes counted across threads");
+		test_assert(sum_op(head, 0, 1) == THREADS * ((COUNT + 1) / 3), "opcodes counted");
+		test_assert(sum(head, 1, STAT_DROPS) == 3, "drops counted");
+		test_assert(sum(head, 1, STAT_PACKETS) == 0, "handlers counted separately");
+		test_assert(stats_handler_slot(head, 1)->depth == 42, "queue depth");
+		test_assert(stats_handler_slot(head, 0)->retired, "slot retired");
+		stats_detach(head);
+	}
+
+	stats_close();
+	test_assert(access(path, F_OK) == -1 && errno == ENOENT, "segment removed");
+	test_assert(stats_attach(getpid()) == NULL, "stats_attach() - no segment");
+
+	return fails;
+}
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/hist.h"
+#include "../src/stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define THREADS 4
+
+static int h;
+
+/* each thread records 1..1000us once, and a fast opcode */
+void *thread_time(void *arg)
+{
+	(void)arg;
+	stats_enter(h);
+	for (uint64_t i = 1; i <= 1000; i++) {
+		stats_time(h, STATS_OP_MSG, i * 1000);
+		stats_time_op(8, 10);
+	}
+	return NULL;
+}
+
+static int within(uint64_t got, uint64_t want)
+{
+	return got >= want && got <= want + want / 16;
+}
+
+int main()
+{
+	pthread_t thread[THREADS];
+	hist_t *hist = calloc(1, sizeof(hist_t));
+	hist_t *sum = calloc(1, sizeof(hist_t));
+	char path[64], line[256];
+	FILE *f;
+	int lines = 0;
+
+	test_name("latency histograms");
+
+	/* buckets are exact for small values and monotonic above */
+	for (uint64_t v = 0; v < 64; v++) {
+		test_assert(hist_bucket_max(hist_bucket(v)) == v, "exact bucket for %llu", (unsigned long long)v);
+	}
+	for (uint64_t v = 64; v < (UINT64_C(1) << 20); v = v * 3 / 2) {
+		const int b = hist_bucket(v);
+		test_assert(b < HIST_BUCKETS, "bucket in range for %llu", (unsigned long long)v);
+		test_assert(hist_bucket_max(b) >= v && hist_bucket_max(b) - v <= v / 32,
+				"value %llu within 1/32 of bucket max", (unsigned long long)v);
+	}
+	test_assert(hist_bucket(UINT64_MAX) == HIST_BUCKETS - 1, "huge value in last bucket");
+
+	test_assert(hist_percentile(hist, 50.0) == 0, "empty histogram");
+	for (uint64_t i = 1; i <= 100; i++) hist_record(hist, i);
+	test_assert(hist->count == 100 && hist->max == 100, "count and max");
+	test_assert(hist_percentile(hist, 50.0) == 50, "p50 exact");
+	test_assert(hist_percentile(hist, 99.0) == 99, "p99 exact");
+	test_assert(hist_percentile(hist, 100.0) == 100, "p100");
+	hist_merge(sum, hist);
+	hist_merge(sum, hist);
+	test_assert(sum->count == 200 && hist_percentile(sum, 50.0) == 50, "merge");
+
+	/* per thread histograms through the stats API */
+	test_assert(stats_open(1) == 0, "stats_open()");
+	h = stats_handler("chan0", "auth.so");
+	for (int i = 0; i < THREADS; i++) pthread_create(&thread[i], NULL, thread_time, NULL);
+	for (int i = 0; i < THREADS; i++) pthread_join(thread[i], NULL);
+	stats_time(h, STATS_OP_MSG, 5000000000); /* 5s */
+
+	test_assert(stats_latency(h, STATS_OP_MSG, hist) == THREADS * 1000 + 1, "threads merged");
+	test_assert(within(hist_percentile(hist, 50.0), 500000), "p50");
+	test_assert(within(hist_percentile(hist, 99.0), 990000), "p99");
+	test_assert(hist->max == 5000000000, "max keeps the outlier");
+	test_assert(stats_latency(h, 8, hist) == THREADS * 1000, "opcode recorded");
+	test_assert(hist_percentile(hist, 99.9) == 10, "opcode p999");
+	test_assert(stats_latency(h, 1, hist) == 0, "unused opcode empty");
+	test_assert(stats_latency(h, STATS_OP_MSG + 1, hist) == 0, "invalid opcode");
+
+	snprintf(path, sizeof path, "/tmp/lsdbd-test-latency.%i", (int)getpid());
+	test_assert(stats_dump(path) == 0, "stats_dump()");
+	test_assert((f = fopen(path, "r")) != NULL, "dump written");
+	if (f) {
+		while (fgets(line, sizeof line, f)) {
+			if (line[0] == '#') continue;
+			lines++;
+			test_assert(!strncmp(line, "chan0\tauth.so\t", 14), "dump line names handler");
+		}
+		fclose(f);
+		unlink(path);
+	}
+	test_assert(lines == 2, "dump has msg and opcode lines");
+
+	stats_close();
+	free(hist);
+	free(sum);
+
+	return fails;
+}
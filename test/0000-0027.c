@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+
+int main()
+{
+	module_t *mod;
+
+	test_name("module ABI and per handler context");
+	config_include("./0000-0027.conf");
+	test_assert(config.modules == 3, "three modules configured");
+	test_assert(config_modules_load() == 3, "config_modules_load()");
+	mod = config.mods;
+
+	test_assert(mod[0].abi == MODULE_ABI_VERSION, "auth.so declares module_abi");
+	test_assert(mod[1].abi == MODULE_ABI_VERSION, "second auth.so instance");
+	test_assert(mod[0].handler == config.handlers, "first handler");
+	test_assert(mod[1].handler == config.handlers->next, "second handler");
+	test_assert(mod[0].ctx && mod[1].ctx, "contexts created");
+	test_assert(mod[0].ctx != mod[1].ctx, "one context per handler");
+	test_assert(mod[0].handle_msg_ctx == mod[1].handle_msg_ctx, "module code shared");
+
+	test_assert(mod[2].abi == MODULE_ABI_LEGACY, "echo.so uses legacy ABI");
+	test_assert(mod[2].ctx == NULL, "no context for legacy module");
+	test_assert(mod[2].handle_msg != NULL, "legacy handle_msg()");
+
+	config_modules_unload();
+	config_free();
+
+	return fails;
+}
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/async.h"
+#include "../src/stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+static int freed;
+
+static void msgfree(lc_message_t *msg)
+{
+	(void)msg;
+	freed++;
+}
+
+static int overdue;
+
+static void report(void *arg, lc_message_t *msg, uint64_t elapsed)
+{
+	(void)msg;
+	overdue++;
+	*(uint64_t *)arg = elapsed;
+}
+
+/* complete from a thread other than the one that started the request, timing
+ * an opcode for its handler on the way */
+void *thread_complete(void *arg)
+{
+	async_enter(arg);
+	stats_time_op(7, 1000);
+	async_complete(arg, 0);
+	return NULL;
+}
+
+static uint64_t stat_sum(stats_head_t *head, int h, int stat)
+{
+	uint64_t n = 0;
+	for (uint32_t t = 0; t < head->threads; t++) n += stats_counters(head, t, h)->stat[stat];
+	return n;
+}
+
+int main()
+{
+	char data[] = "payload";
+	lc_message_t msg = { .data = data, .len = sizeof data };
+	module_req_t *req[3];
+	stats_head_t *head;
+	pthread_t thread;
+	uint64_t elapsed = 0;
+	async_t *a;
+	hist_t *hist = calloc(1, sizeof(hist_t));
+	int h;
+
+	test_name("asynchronous requests");
+
+	test_assert(async_create(0, 0, -1, msgfree) == NULL, "async_create() - max required");
+	test_assert(stats_open(1) == 0, "stats_open()");
+	h = stats_handler("chan0", "auth.so");
+	a = async_create(2, 1000, h, msgfree);
+	test_assert(a != NULL, "async_create()");
+
+	req[0] = async_start(a, &msg, 1, 0);
+	test_assert(req[0] != NULL, "async_start()");
+	test_assert(async_msg(req[0])->data != data, "payload copied");
+	test_expectn(data, async_msg(req[0])->data, sizeof data);
+	data[0] = 'X';
+	test_assert(((char *)async_msg(req[0])->data)[0] == 'p', "copy kept");
+	req[1] = async_start(a, &msg, 0, 500);
+	test_assert(async_msg(req[1])->data == data, "payload taken as is");
+	errno = 0;
+	test_assert(async_start(a, &msg, 0, 500) == NULL && errno == EBUSY, "max in flight");
+	test_assert(async_inflight(a) == 2, "async_inflight()");
+
+	head = stats_attach(getpid());
+	test_assert(head && stats_handler_slot(head, h)->inflight == 2, "inflight published");
+
+	/* requests open past a watchdog budget are reported once, while in flight */
+	test_assert(async_overdue(a, 400, 300, report, &elapsed) == 1, "async_overdue()");
+	test_assert(overdue == 1 && elapsed == 400, "overdue reported");
+	test_assert(async_overdue(a, 900, 300, report, &elapsed) == 2, "both overdue");
+	test_assert(overdue == 2 && elapsed == 400, "each reported once");
+
+	/* only the first has passed its timeout */
+	test_assert(async_expire(a, 1200) == 1, "async_expire()");
+	test_assert(async_cancelled(req[0]), "expired request cancelled");
+	test_assert(!async_cancelled(req[1]), "later request not expired");
+	test_assert(async_inflight(a) == 2, "expired request still in flight");
+	test_assert(async_expire(a, 1200) == 0, "expired once");
+	test_assert(async_overdue(a, 1200, 300, report, &elapsed) == 1, "expired not watched");
+	async_complete(req[0], ETIMEDOUT);
+	test_assert(freed == 1, "message freed on completion");
+
+	pthread_create(&thread, NULL, thread_complete, req[1]);
+	pthread_join(thread, NULL);
+	test_assert(freed == 2 && async_inflight(a) == 0, "completed from another thread");
+	if (head) {
+		test_assert(stats_handler_slot(head, h)->inflight == 0, "inflight cleared");
+		test_assert(stat_sum(head, h, STAT_DROPS) == 1, "expiry counted as drop");
+		test_assert(stat_sum(head, h, STAT_ERRORS) == 1, "error counted");
+	}
+	test_assert(stats_latency(h, STATS_OP_MSG, hist) == 2, "latency recorded on completion");
+	test_assert(stats_latency(h, 7, hist) == 1, "opcode timed by the completing thread");
+
+	/* cancel, then free with a request outstanding */
+	req[2] = async_start(a, &msg, 1, 0);
+	async_cancel(a);
+	test_assert(async_cancelled(req[2]), "async_cancel()");
+	async_free(a);
+	async_complete(req[2], 0); /* frees a, see valgrind */
+	test_assert(freed == 3, "last completion after free");
+
+	stats_detach(head);
+	stats_close();
+	free(hist);
+
+	return fails;
+}
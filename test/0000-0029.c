@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/uring.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BUFFERS 8
+#define ROUNDS 5
+#define PACKETS 6 /* per round, fewer than BUFFERS */
+
+int main()
+{
+	struct sockaddr_in6 sa = { .sin6_family = AF_INET6 };
+	socklen_t salen = sizeof sa;
+	struct msghdr hdr = { .msg_namelen = sizeof(struct sockaddr_in6) };
+	struct io_uring_recvmsg_out *out;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	char data[] = "multishot";
+	uring_t ring;
+	int s, c, got = 0, more = 1;
+
+	if (uring_probe() == -1) return test_skip("io_uring multishot receive");
+	test_name("io_uring multishot receive");
+
+	test_assert(uring_init(&ring, 16) == 0, "uring_init()");
+	test_assert(uring_bufs(&ring, 3, 64) == -1 && errno == EINVAL, "buffer count must be a power of two");
+	test_assert(uring_bufs(&ring, BUFFERS, 256) == 0, "uring_bufs()");
+
+	s = socket(AF_INET6, SOCK_DGRAM, 0);
+	c = socket(AF_INET6, SOCK_DGRAM, 0);
+	sa.sin6_addr = in6addr_loopback;
+	test_assert(bind(s, (struct sockaddr *)&sa, sizeof sa) == 0, "bind()");
+	getsockname(s, (struct sockaddr *)&sa, &salen);
+
+	sqe = uring_sqe(&ring);
+	test_assert(sqe != NULL, "uring_sqe()");
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = s;
+	sqe->addr = (uint64_t)(uintptr_t)&hdr;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->user_data = 42;
+
+	/* buffers are handed back each round, so one receive serves them all */
+	for (int round = 0; round < ROUNDS; round++) {
+		for (int i = 0; i < PACKETS; i++)
+			sendto(c, data, sizeof data, 0, (struct sockaddr *)&sa, sizeof sa);
+		for (int n = 0; n < PACKETS; ) {
+			if (uring_wait(&ring, 1000) == -1) break;
+			while ((cqe = uring_cqe(&ring))) {
+				test_assert(cqe->user_data == 42, "user_data");
+				if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+					const unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+					out = uring_buf(&ring, bid);
+					if (out->payloadlen == sizeof data
+					&& !memcmp((char *)(out + 1) + hdr.msg_namelen, data, sizeof data))
+						got++;
+					uring_buf_put(&ring, bid);
+				}
+				more = more && (cqe->flags & IORING_CQE_F_MORE);
+				uring_cqe_seen(&ring);
+				n++;
+			}
+		}
+	}
+	test_assert(got == ROUNDS * PACKETS, "received %i/%i", got, ROUNDS * PACKETS);
+	test_assert(more, "receive still armed");
+	test_assert(uring_wait(&ring, 10) == -1 && errno == ETIME, "uring_wait() - timeout");
+
+	close(c);
+	close(s);
+	uring_free(&ring);
+
+	return fails;
+}
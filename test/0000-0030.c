@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+
+int main()
+{
+	module_t *mod;
+	handler_t *h;
+
+	test_name("parallel and lazy module loading");
+	config_include("./0000-0030.conf");
+	test_assert(config.loadthreads == 4, "loadthreads");
+	test_assert(config.handlers->next->lazy, "lazy");
+	test_assert(config_modules_load() == 4, "config_modules_load() - loaded or deferred");
+	mod = config.mods;
+	h = config.handlers;
+
+	/* slots follow handler order, whichever thread loaded them */
+	for (int i = 0; i < 4; i++, h = h->next) {
+		test_assert(mod[i].handler == h, "slot %i is handler %i", i, i);
+	}
+	test_assert(mod[0].handle && mod[2].handle, "loaded");
+	test_assert(!mod[1].handle && mod[1].lazy, "auth.so deferred");
+	test_assert(!mod[3].handle && mod[3].lazy, "echo.so deferred");
+	test_assert(config.timing.loaded == 2, "timing.loaded");
+	test_assert(config.timing.deferred == 2, "timing.deferred");
+	test_assert(config.timing.threads == 2, "timing.threads - no more than modules to load");
+	test_assert(config.timing.load > 0, "timing.load");
+
+	/* as the server does on the first message */
+	test_assert(config_module_load(&mod[1], mod[1].handler) == 0, "load deferred module");
+	test_assert(mod[1].ctx && mod[1].ctx != mod[0].ctx, "own context");
+	test_assert(!mod[1].lazy, "no longer lazy");
+
+	config_modules_unload();
+	config_free();
+
+	return fails;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+#include "../src/server.h"
+#include <librecast.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+void *testthread(void *arg)
+{
+	test_sleep(0, 99999999); /* let the pollers spin */
+	server_stop();
+	pthread_exit(arg);
+}
+
+int main()
+{
+	handler_t *h;
+
+	test_name("start/stop server (busy and adaptive polling)");
+	config_include("./0000-0031.conf");
+	h = config.handlers;
+	test_assert(h->poll == POLLMODE_BUSY, "handler poll busy");
+	test_assert(h->next->poll == POLLMODE_ADAPTIVE, "handler poll adaptive");
+	test_assert(h->next->poll_window_us == 500, "handler poll_window_us");
+	test_assert(h->next->next->poll == POLLMODE_BLOCK, "handler poll defaults to block");
+	test_assert(config_pollmode("block") == POLLMODE_BLOCK, "config_pollmode(\"block\")");
+	test_assert(config_pollmode("bogus") == -1, "config_pollmode() - unknown mode");
+	test_assert(config_handler_cmp(h, h->next), "config_handler_cmp() - poll differs");
+
+	/* pollers must be joined on the way out */
+	pthread_t thread;
+	pthread_attr_t attr = {0};
+	pthread_attr_init(&attr);
+	pthread_create(&thread, &attr, testthread, NULL);
+	server_start();
+	pthread_join(thread, NULL);
+	config_free();
+
+	return fails;
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/chanidx.h"
+#include "../src/config.h"
+#include <arpa/inet.h>
+#include <errno.h>
+
+#define CHANNELS 1000
+
+int main()
+{
+	struct in6_addr grp, miss;
+	chanidx_t *idx;
+	handler_t *h;
+	int handler[2], chan[CHANNELS];
+	void *c = NULL;
+	int found = 0;
+
+	test_name("channel index and multiple channels per handler");
+
+	config_include("./0000-0032.conf");
+	h = config.handlers;
+	test_assert(config.mux, "mux set from config file");
+	test_expect("0000-0032a", h->channel);
+	test_assert(h->nchannels == 2, "further channels listed");
+	test_expect("0000-0032b", h->channels[0]);
+	test_expect("ff1e::32", h->channels[1]);
+	test_assert(h->next->nchannels == 0, "single channel");
+	test_assert(!config_handler_cmp(h, h), "config_handler_cmp() - same channels");
+	test_assert(config_handler_cmp(h, h->next), "config_handler_cmp() - different channels");
+	config_free();
+
+	/* neighbouring addresses, as configured groups often are */
+	idx = chanidx_create(CHANNELS);
+	test_assert(idx != NULL, "chanidx_create()");
+	inet_pton(AF_INET6, "ff1e::", &grp);
+	for (int i = 0; i < CHANNELS; i++) {
+		grp.s6_addr[14] = i >> 8;
+		grp.s6_addr[15] = i & 0xff;
+		if (!chanidx_add(idx, &grp, &handler[i % 2], &chan[i])) found++;
+	}
+	test_assert(found == CHANNELS, "chanidx_add()");
+	test_assert(chanidx_count(idx) == CHANNELS, "chanidx_count()");
+	errno = 0;
+	test_assert(chanidx_add(idx, &grp, &handler[0], NULL) == -1 && errno == EEXIST,
+			"chanidx_add() - already indexed");
+	test_assert(chanidx_add(idx, &grp, NULL, NULL) == -1 && errno == EINVAL,
+			"chanidx_add() - handler required");
+
+	found = 0;
+	for (int i = 0; i < CHANNELS; i++) {
+		grp.s6_addr[14] = i >> 8;
+		grp.s6_addr[15] = i & 0xff;
+		if (chanidx_get(idx, &grp, &c) == &handler[i % 2] && c == &chan[i]) found++;
+	}
+	test_assert(found == CHANNELS, "chanidx_get()");
+	inet_pton(AF_INET6, "ff1e::1:0", &miss);
+	c = NULL;
+	test_assert(chanidx_get(idx, &miss, &c) == NULL && c == NULL, "chanidx_get() - not indexed");
+	chanidx_free(idx);
+
+	return fails;
+}
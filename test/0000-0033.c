@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/dedup.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#define THREADS 4
+#define DATAGRAMS 10000
+
+static dedup_t *d;
+static unsigned int passed;
+
+void *thread_check(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 1000; i++) {
+		if (!dedup_check(d, "retried", 7))
+			__atomic_add_fetch(&passed, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int main()
+{
+	unsigned char pkt[100];
+	pthread_t thread[THREADS];
+	int ok = 0;
+
+	test_name("duplicate datagram suppression");
+
+	errno = 0;
+	test_assert(dedup_create(16, 0) == NULL && errno == EINVAL, "dedup_create() - zero window");
+
+	d = dedup_create(64, 100);
+	test_assert(d != NULL, "dedup_create()");
+	memset(pkt, 1, sizeof pkt);
+	test_assert(dedup_check(d, pkt, sizeof pkt) == 0, "first copy passes");
+	test_assert(dedup_check(d, pkt, sizeof pkt) == -1, "second copy dropped");
+	test_assert(dedup_check(d, pkt, sizeof pkt - 1) == 0, "shorter datagram differs");
+	pkt[sizeof pkt - 1] = 2;
+	test_assert(dedup_check(d, pkt, sizeof pkt) == 0, "last byte differs");
+	test_assert(dedup_dropped(d) == 1, "duplicate counted");
+	pkt[sizeof pkt - 1] = 1;
+	test_sleep(0, 150000000);
+	test_assert(dedup_check(d, pkt, sizeof pkt) == 0, "passes again after the window");
+	dedup_free(d);
+
+	/* more datagrams than buckets: memory stays fixed, and distinct
+	 * datagrams are never taken for duplicates */
+	d = dedup_create(64, 10000);
+	for (int i = 0; i < DATAGRAMS; i++) {
+		memcpy(pkt, &i, sizeof i);
+		if (!dedup_check(d, pkt, sizeof pkt)) ok++;
+	}
+	test_assert(ok == DATAGRAMS, "distinct datagrams pass (%i/%i)", ok, DATAGRAMS);
+	dedup_free(d);
+
+	/* copies arriving on several threads at once pass once */
+	d = dedup_create(64, 10000);
+	for (int i = 0; i < THREADS; i++) pthread_create(&thread[i], NULL, thread_check, NULL);
+	for (int i = 0; i < THREADS; i++) pthread_join(thread[i], NULL);
+	test_assert(passed == 1, "concurrent copies (%u passed)", passed);
+	dedup_free(d);
+
+	return fails;
+}
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+
+static int one, batches, batched;
+static void *lastctx;
+
+static void msg_one(lc_message_t *msg)
+{
+	(void)msg;
+	one++;
+}
+
+static void msg_one_ctx(void *ctx, lc_message_t *msg)
+{
+	lastctx = ctx;
+	msg_one(msg);
+}
+
+static void msgv(lc_message_t *msgs[], int n)
+{
+	(void)msgs;
+	batches++;
+	batched += n;
+}
+
+static void msgv_ctx(void *ctx, lc_message_t *msgs[], int n)
+{
+	lastctx = ctx;
+	msgv(msgs, n);
+}
+
+int main()
+{
+	lc_message_t msg[3] = {0};
+	lc_message_t *msgs[3] = { &msg[0], &msg[1], &msg[2] };
+	module_t mod = { .abi = MODULE_ABI_LEGACY, .handle_msg = msg_one };
+	int ctx;
+
+	test_name("vectored message handler");
+
+	/* no handle_msgv(), one at a time */
+	test_assert(!config_module_vectored(&mod), "legacy - not vectored");
+	config_module_msgv(&mod, msgs, 3);
+	test_assert(one == 3 && !batches, "legacy - handle_msg() per message");
+
+	mod.handle_msgv = msgv;
+	test_assert(config_module_vectored(&mod), "legacy - vectored");
+	config_module_msgv(&mod, msgs, 3);
+	test_assert(one == 3 && batches == 1 && batched == 3, "legacy - handle_msgv()");
+
+	/* the context ABI passes ctx first */
+	mod = (module_t){ .abi = MODULE_ABI_VERSION, .ctx = &ctx, .handle_msg_ctx = msg_one_ctx };
+	config_module_msgv(&mod, msgs, 2);
+	test_assert(one == 5 && lastctx == &ctx, "ctx - handle_msg() per message");
+	mod.handle_msgv_ctx = msgv_ctx;
+	lastctx = NULL;
+	test_assert(config_module_vectored(&mod), "ctx - vectored");
+	config_module_msgv(&mod, msgs, 2);
+	test_assert(batches == 2 && batched == 5 && lastctx == &ctx, "ctx - handle_msgv()");
+
+	/* the symbol is optional */
+	config_include("./0000-0034.conf");
+	test_assert(config_modules_load() == 2, "config_modules_load()");
+	test_assert(config_module_vectored(&config.mods[0]), "echo.so exports handle_msgv()");
+	test_assert(!config_module_vectored(&config.mods[1]), "auth.so doesn't");
+	config_modules_unload();
+	config_free();
+
+	return fails;
+}
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+#include <pthread.h>
+#include <unistd.h>
+
+static module_t *slot;
+static int left;
+
+/* hold the module across the swap, as a worker would mid-call */
+void *thread_call(void *arg)
+{
+	module_t *mod = config_module_enter(&slot);
+	(void)arg;
+	usleep(100000);
+	__atomic_store_n(&left, 1, __ATOMIC_RELEASE);
+	config_module_leave(mod);
+	return NULL;
+}
+
+int main()
+{
+	module_t *mod, *next, *peer, *copy;
+	pthread_t thread;
+	int i;
+
+	test_name("module swap");
+	config_include("./0000-0035.conf");
+	test_assert(config_modules_load() == 2, "config_modules_load()");
+	mod = &config.mods[0];
+
+	next = config_module_swap(mod, NULL);
+	test_assert(next != NULL, "config_module_swap()");
+	test_assert(next->handle && next->handle != mod->handle, "new copy alongside the old");
+	test_assert(next->prev == mod && next->handler == mod->handler, "replaces mod");
+	test_assert(next->handle_msg && next->handle_msg != mod->handle_msg, "own handle_msg()");
+
+	/* handlers of the same module share the new copy */
+	peer = config_module_swap(&config.mods[1], next);
+	test_assert(peer && peer->handle == next->handle, "shares peer's copy");
+
+	/* a copy is swapped from the module's file, as often as we like */
+	for (i = 0; i < 20 && (copy = config_module_swap(next, NULL)); i++) {
+		config_module_unload(copy, 1);
+		free(copy);
+	}
+	test_assert(i == 20, "swap a copy, repeatedly");
+
+	/* the old copy waits for calls in progress */
+	slot = mod;
+	pthread_create(&thread, NULL, thread_call, NULL);
+	usleep(10000);
+	test_assert(__atomic_exchange_n(&slot, next, __ATOMIC_SEQ_CST) == mod, "swapped");
+	config_module_wait(mod);
+	test_assert(__atomic_load_n(&left, __ATOMIC_ACQUIRE), "config_module_wait()");
+	pthread_join(thread, NULL);
+	test_assert(config_module_enter(&slot) == next, "config_module_enter() - new copy");
+	config_module_leave(next);
+
+	config_module_unload(mod, 1);
+	config_module_unload(&config.mods[1], 1);
+	test_assert(next->prev == mod, "config_module_unload() keeps prev");
+	config_module_unload(next, 1);
+	config_module_unload(peer, 1);
+	config_module_free(next);
+	config_module_free(peer);
+	config_modules_unload();
+	config_free();
+
+	return fails;
+}
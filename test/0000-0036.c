@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/wheel.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMERS 100000
+#define SPREAD_MS 600 /* past the first level of a 1ms wheel */
+
+typedef struct {
+	wheel_timer_t	timer;
+	uint64_t	due;
+	int		fired;
+} tick_t;
+
+static wheel_t *w;
+static int early, periodic;
+static wheel_timer_t self;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void fire(void *arg)
+{
+	tick_t *t = arg;
+	if (now_ms() < t->due) early++;
+	t->fired++;
+}
+
+/* a periodic timer stopping itself on its third call */
+static void fire_periodic(void *arg)
+{
+	(void)arg;
+	if (++periodic == 3) wheel_cancel(w, &self);
+}
+
+/* run the wheel until timers stop firing, for up to ms */
+static int run(int ms)
+{
+	struct pollfd pfd = { .fd = wheel_fd(w), .events = POLLIN };
+	const uint64_t end = now_ms() + ms;
+	int n = 0;
+	while (now_ms() < end && wheel_count(w)) {
+		if (poll(&pfd, 1, 10) > 0) n += wheel_run(w);
+	}
+	return n;
+}
+
+/* as run(), counting the wakeups that fired nothing */
+static int run_idle(int ms)
+{
+	struct pollfd pfd = { .fd = wheel_fd(w), .events = POLLIN };
+	const uint64_t end = now_ms() + ms;
+	int idle = 0;
+	while (now_ms() < end && wheel_count(w)) {
+		if (poll(&pfd, 1, 10) > 0) idle += !wheel_run(w);
+	}
+	return idle;
+}
+
+int main()
+{
+	tick_t *t = calloc(TIMERS, sizeof(tick_t));
+	wheel_timer_t once = {0};
+	int fired = 0, cancelled = 0;
+
+	test_name("timer wheel");
+	test_assert(wheel_create(0) == NULL && errno == EINVAL, "wheel_create() - tick required");
+	w = wheel_create(1);
+	test_assert(w != NULL, "wheel_create()");
+
+	srand(42);
+	for (int i = 0; i < TIMERS; i++) {
+		const uint64_t ms = rand() % SPREAD_MS;
+		t[i].due = now_ms() + ms;
+		test_assert(wheel_add(w, &t[i].timer, ms, 0, fire, &t[i]) == 0, "wheel_add() %i", i);
+	}
+	test_assert(wheel_count(w) == TIMERS, "wheel_count()");
+	test_assert(wheel_add(w, &t[0].timer, 1, 0, fire, &t[0]) == -1 && errno == EBUSY,
+			"wheel_add() - already pending");
+	/* every other one is cancelled, O(1) from anywhere in the wheel */
+	for (int i = 0; i < TIMERS; i += 2) cancelled += !wheel_cancel(w, &t[i].timer);
+	test_assert(cancelled == TIMERS / 2, "wheel_cancel()");
+	test_assert(wheel_cancel(w, &t[0].timer) == -1 && errno == ENOENT, "cancel once");
+
+	fired = run(SPREAD_MS + 1000);
+	test_assert(fired == TIMERS / 2, "fired %i/%i", fired, TIMERS / 2);
+	for (int i = 0; i < TIMERS; i++) {
+		if (t[i].fired != i % 2) {
+			test_assert(0, "timer %i fired %i time(s)", i, t[i].fired);
+			break;
+		}
+	}
+	test_assert(!early, "none early");
+
+	/* beyond the second level, cascading down */
+	t[0].due = now_ms() + 70000;
+	test_assert(wheel_add(w, &t[0].timer, 70000, 0, fire, &t[0]) == 0, "wheel_add() - 70s");
+	test_assert(wheel_add(w, &once, 20, 0, fire, &t[1]) == 0, "wheel_add() - 20ms");
+	test_assert(run(1000) == 1 && t[1].fired == 2, "only the near one fires");
+	test_assert(wheel_cancel(w, &t[0].timer) == 0, "cancel 70s");
+
+	/* one timer due every tick, so some expire exactly on a level 1
+	 * boundary.  They are cascaded at the tick they are due and must fire
+	 * there, not a tick late after a wakeup that fires nothing */
+	for (int i = 0; i < SPREAD_MS; i++) {
+		t[i].fired = 0;
+		t[i].due = now_ms() + 300 + i;
+		test_assert(wheel_add(w, &t[i].timer, 300 + i, 0, fire, &t[i]) == 0, "wheel_add() %i", i);
+	}
+	test_assert(run_idle(SPREAD_MS + 1300) == 0, "none a tick late at a level boundary");
+	test_assert(wheel_count(w) == 0, "all fired");
+
+	test_assert(wheel_add(w, &self, 5, 5, fire_periodic, NULL) == 0, "wheel_add() - periodic");
+	run(1000);
+	test_assert(periodic == 3, "periodic stopped from its callback");
+	test_assert(wheel_count(w) == 0, "nothing pending");
+
+	wheel_free(w);
+	free(t);
+
+	return fails;
+}
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/watchdog.h"
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUDGET_MS 20
+#define STUCK_MS 300
+
+static watchdog_stall_t last;
+static int stalls;
+static int tag, quick;
+
+static void stall(watchdog_stall_t *st)
+{
+	memcpy(&last, st, sizeof last);
+	__atomic_add_fetch(&stalls, 1, __ATOMIC_RELEASE);
+}
+
+/* sleep through the signal taking our stack */
+static void stuck(void)
+{
+	struct timespec ts = { .tv_nsec = STUCK_MS * 1000000 }, rem;
+	while (nanosleep(&ts, &rem) == -1) ts = rem;
+}
+
+static void *call(void *arg)
+{
+	sigset_t mask;
+	if (arg) {
+		sigemptyset(&mask);
+		sigaddset(&mask, WATCHDOG_SIGNAL);
+		pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	}
+	watchdog_enter(&tag, BUDGET_MS * 1000000, 0x2a);
+	stuck();
+	return (void *)(long)watchdog_leave();
+}
+
+int main()
+{
+	pthread_t t;
+	void *ret;
+
+	test_name("watchdog");
+	test_assert(watchdog_start(stall) == 0, "watchdog_start()");
+	test_assert(watchdog_start(stall) == 0, "watchdog_start() - already running");
+
+	pthread_create(&t, NULL, call, NULL);
+	pthread_join(t, &ret);
+	watchdog_sync(); /* the report may still be on its way */
+	test_assert(ret == (void *)1, "watchdog_leave() - reported");
+	test_assert(stalls == 1, "stall reported once, %i", stalls);
+	test_assert(last.arg == &tag && last.op == 0x2a, "arg and op");
+	test_assert(last.elapsed >= BUDGET_MS * 1000000 && last.budget == BUDGET_MS * 1000000,
+			"over budget");
+	test_assert(last.nframes > 0, "stack taken");
+
+	watchdog_enter(&quick, 1000000000, 1);
+	test_assert(watchdog_leave() == 0, "watchdog_leave() - in budget");
+	watchdog_sync();
+	test_assert(stalls == 1, "in budget not reported");
+
+	/* a thread blocking the signal is still reported */
+	pthread_create(&t, NULL, call, &t);
+	pthread_join(t, &ret);
+	watchdog_sync();
+	test_assert(ret == (void *)1 && stalls == 2, "reported with the signal blocked");
+	test_assert(last.nframes == 0, "no stack");
+
+	watchdog_stop();
+
+	return fails;
+}
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+#include "../src/ingress.h"
+#include "../src/server.h"
+#include <librecast.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static int dropped[8];
+static int ndropped;
+
+static void drop(ingress_job_t *job)
+{
+	dropped[ndropped++] = job->msg.seq;
+	free(job);
+}
+
+/* queue job number id with opcode op */
+static void push(ingress_t *q, int id, unsigned char op, int policy)
+{
+	ingress_job_t *job = calloc(1, sizeof(ingress_job_t) + 1);
+	job->msg.seq = id;
+	job->msg.data = job->data;
+	job->msg.len = 1;
+	job->data[0] = op;
+	ingress_push(q, job, policy);
+}
+
+/* take everything, checking it comes out as expect, terminated by 0 */
+static void take(ingress_t *q, const int expect[], const char *sched)
+{
+	ingress_job_t *jobs[16];
+	int n = ingress_take(q, jobs, 16, 0), i;
+	for (i = 0; i < n && expect[i]; i++) {
+		test_assert(jobs[i]->msg.seq == (uint64_t)expect[i], "%s: job %i is %i, expected %i",
+				sched, i, (int)jobs[i]->msg.seq, expect[i]);
+	}
+	test_assert(i == n && !expect[i], "%s: took %i jobs", sched, n);
+	for (i = 0; i < n; i++) free(jobs[i]);
+}
+
+void *testthread(void *arg)
+{
+	test_sleep(0, 99999999);
+	server_stop();
+	pthread_exit(arg);
+}
+
+int main()
+{
+	handler_t *h;
+
+	test_name("priority classes");
+	config_include("./0000-0038.conf");
+	h = config.handlers;
+	test_assert(h->opclass[8] == 1 && h->opclass[0] == 2 && h->opclass[4] == 2,
+			"priority - opcode to class");
+	test_assert(h->opclass[1] == 4, "priority - last class");
+	test_assert(h->opclass[9] == 0, "priority - class out of range ignored");
+	test_assert(h->opclass[2] == 0, "priority - unmapped opcode");
+	test_assert(h->schedule == SCHED_STRICT, "schedule defaults to strict");
+	test_assert(h->next->schedule == SCHED_WEIGHTED, "schedule weighted");
+	test_assert(h->next->weight[0] == 8, "weight");
+	test_assert(h->next->weight[3] == 0, "weight - must be positive");
+	test_assert(config_sched("strict") == SCHED_STRICT, "config_sched(\"strict\")");
+	test_assert(config_sched("bogus") == -1, "config_sched() - unknown schedule");
+	test_assert(config_handler_cmp(h, h->next), "config_handler_cmp() - classes differ");
+
+	/* strict: every job of a class before any of the next */
+	ingress_t q = {0};
+	test_assert(ingress_classes(h) && !ingress_classes(&(handler_t){0}), "ingress_classes()");
+	test_assert(ingress_init(&q, h, 8, -1, drop) == 0, "ingress_init() - strict");
+	push(&q, 1, 1, DROP_OLDEST);
+	push(&q, 2, 0, DROP_OLDEST);
+	push(&q, 3, 8, DROP_OLDEST);
+	push(&q, 4, 1, DROP_OLDEST);
+	push(&q, 5, 4, DROP_OLDEST);
+	push(&q, 6, 8, DROP_OLDEST);
+	take(&q, (int []){ 3, 6, 2, 5, 1, 4, 0 }, "strict");
+	ingress_free(&q);
+
+	/* weighted: 8 from the first class for each of the last (weight 0 is
+	 * ignored, leaving its default of 1) */
+	test_assert(ingress_init(&q, h->next, 16, -1, drop) == 0, "ingress_init() - weighted");
+	for (int i = 1; i <= 10; i++) push(&q, i, 8, DROP_OLDEST);
+	for (int i = 11; i <= 13; i++) push(&q, i, 1, DROP_OLDEST);
+	take(&q, (int []){ 1, 2, 3, 4, 5, 6, 7, 8, 11, 9, 10, 12, 13, 0 }, "weighted");
+	ingress_free(&q);
+
+	/* a full queue drops from the last class queued, never for a later one */
+	test_assert(ingress_init(&q, h, 3, -1, drop) == 0, "ingress_init() - eviction");
+	push(&q, 1, 1, DROP_OLDEST);
+	push(&q, 2, 8, DROP_OLDEST);
+	push(&q, 3, 8, DROP_OLDEST);
+	push(&q, 4, 0, DROP_OLDEST);
+	test_assert(ndropped == 1 && dropped[0] == 1, "lower class evicted for a higher");
+	push(&q, 5, 1, DROP_OLDEST);
+	test_assert(ndropped == 2 && dropped[1] == 5, "lower class turned away when full");
+	push(&q, 6, 8, DROP_NEWEST);
+	test_assert(ndropped == 3 && dropped[2] == 4, "newest of the lowest class dropped");
+	take(&q, (int []){ 2, 3, 6, 0 }, "eviction");
+	ingress_free(&q);
+
+	pthread_t thread;
+	pthread_attr_t attr = {0};
+	pthread_attr_init(&attr);
+	pthread_create(&thread, &attr, testthread, NULL);
+	server_start();
+	pthread_join(thread, NULL);
+	config_free();
+
+	return fails;
+}
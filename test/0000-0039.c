@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+#include "../src/server.h"
+#include "../src/stats.h"
+#include <librecast.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FLOOD 256 /* datagrams, far more than a 4k rcvbuf holds */
+
+static lc_channel_t *chan;
+
+static void send_one(void)
+{
+	char data[128] = "kdrops";
+	lc_message_t msg;
+	lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+	lc_msg_send(chan, &msg);
+}
+
+static uint64_t stat_sum(stats_head_t *head, int h, int stat)
+{
+	uint64_t n = 0;
+	for (uint32_t t = 0; t < head->threads; t++) n += stats_counters(head, t, h)->stat[stat];
+	return n;
+}
+
+void *testthread(void *arg)
+{
+	stats_head_t *head;
+	test_sleep(0, 99999999); /* let the server drain what was queued */
+	/* the kernel's drop total comes with the next datagram it queues */
+	send_one();
+	test_sleep(0, 99999999);
+	head = stats_attach(getpid());
+	test_assert(head != NULL, "stats_attach()");
+	if (head) {
+		test_assert(stat_sum(head, 0, STAT_KDROPS) > 0, "kdrops read from SO_RXQ_OVFL");
+		test_assert(stat_sum(head, 0, STAT_KDROPS) < FLOOD, "only what didn't fit dropped");
+		stats_detach(head);
+	}
+	server_stop();
+	pthread_exit(arg);
+}
+
+int main()
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	pthread_t thread;
+	int opt = 1;
+
+	test_name("kernel drops counted from SO_RXQ_OVFL");
+	config_include("./0000-0039.conf");
+	test_assert(config.handlers->rcvbuf == 4096, "handler rcvbuf set from config file");
+	test_assert(server_bind() == 0, "server_bind()");
+
+	/* overflow the handler's socket before anything reads it */
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	lc_socket_setopt(sock, IPV6_MULTICAST_LOOP, &opt, sizeof(opt));
+	chan = lc_channel_new(lctx, config.handlers->channel);
+	lc_channel_bind(sock, chan);
+	for (int i = 0; i < FLOOD; i++) send_one();
+
+	pthread_create(&thread, NULL, testthread, NULL);
+	server_run();
+	pthread_join(thread, NULL);
+	server_unbind();
+
+	lc_ctx_free(lctx);
+	config_free();
+
+	return fails;
+}
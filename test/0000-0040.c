@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/wire.h"
+#include <endian.h>
+#include <librecast.h>
+#include <string.h>
+#include <sys/socket.h>
+
+int main()
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan;
+	lc_message_t msg;
+	wire_msghead_t head = {0};
+	char data[] = "decoded from the wire";
+	char buf[sizeof data * 2] = {0};
+	struct iovec iov[2] = {
+		{ .iov_base = &head, .iov_len = sizeof head },
+		{ .iov_base = buf, .iov_len = sizeof buf },
+	};
+	struct msghdr hdr = { .msg_iov = iov, .msg_iovlen = 2 };
+	ssize_t n;
+
+	test_name("librecast header decoded as wire_msghead_t");
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, "0000-0040");
+	lc_channel_bind(sock, chan);
+	lc_channel_join(chan);
+
+	/* read it as the server does, header and payload into their own iovecs */
+	lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+	test_assert(lc_msg_send(chan, &msg) > 0, "lc_msg_send()");
+	n = recvmsg(lc_socket_raw(sock), &hdr, 0);
+	test_assert(n == (ssize_t)(sizeof head + sizeof data), "header is %zi bytes, expected %zu",
+			n - (ssize_t)sizeof data, sizeof head);
+	test_assert(!(hdr.msg_flags & MSG_TRUNC), "not truncated");
+	test_assert(be64toh(head.len) == sizeof data, "len decoded");
+	test_assert(head.op == LC_OP_DATA, "op decoded");
+	test_expectn(data, buf, sizeof data);
+
+	lc_ctx_free(lctx);
+	return fails;
+}
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/ingress.h"
+#include <stdlib.h>
+
+#define MS 1000000 /* nanoseconds */
+
+static int dropped[8];
+static int ndropped;
+
+static void drop(ingress_job_t *job)
+{
+	dropped[ndropped++] = job->msg.seq;
+	free(job);
+}
+
+/* job number id, queued at ms */
+static ingress_job_t *job(int id, uint64_t ms)
+{
+	ingress_job_t *job = calloc(1, sizeof(ingress_job_t) + 1);
+	job->msg.seq = id;
+	job->msg.data = job->data;
+	job->msg.len = 1;
+	job->queued = ms * MS;
+	return job;
+}
+
+/* take everything, checking it comes out as expect, terminated by 0 */
+static void take(ingress_t *q, uint64_t ms, const int expect[], const char *policy)
+{
+	ingress_job_t *jobs[8];
+	int n = ingress_take(q, jobs, 8, ms * MS), i;
+	for (i = 0; i < n && expect[i]; i++) {
+		test_assert(jobs[i]->msg.seq == (uint64_t)expect[i], "%s: job %i is %i, expected %i",
+				policy, i, (int)jobs[i]->msg.seq, expect[i]);
+	}
+	test_assert(i == n && !expect[i], "%s: took %i jobs", policy, n);
+	for (i = 0; i < n; i++) free(jobs[i]);
+}
+
+int main()
+{
+	handler_t h = {0};
+	ingress_t q = {0};
+	int tokens = 0;
+
+	test_name("ingress queue drop policies and deadline");
+
+	/* a full queue turns the newest away */
+	h.drop = DROP_NEWEST;
+	test_assert(ingress_init(&q, &h, 3, -1, drop) == 0, "ingress_init()");
+	for (int i = 1; i <= 3; i++) tokens += ingress_push(&q, job(i, 0), h.drop);
+	test_assert(tokens == 3, "a token for each job");
+	test_assert(ingress_push(&q, job(4, 0), h.drop) == 0, "no token when full");
+	test_assert(ndropped == 1 && dropped[0] == 4, "drop-newest: new job dropped");
+	test_assert(q.dropped_newest == 1 && q.count == 3, "drop-newest: counted");
+	take(&q, 0, (int []){ 1, 2, 3, 0 }, "drop-newest");
+	ingress_free(&q);
+
+	/* or evicts the oldest to make room */
+	ndropped = 0;
+	h.drop = DROP_OLDEST;
+	test_assert(ingress_init(&q, &h, 3, -1, drop) == 0, "ingress_init()");
+	for (int i = 1; i <= 3; i++) ingress_push(&q, job(i, 0), h.drop);
+	test_assert(ingress_push(&q, job(4, 0), h.drop) == 0, "no token for the replacement");
+	test_assert(ndropped == 1 && dropped[0] == 1, "drop-oldest: oldest job dropped");
+	test_assert(q.dropped_oldest == 1 && q.count == 3, "drop-oldest: counted");
+	take(&q, 0, (int []){ 2, 3, 4, 0 }, "drop-oldest");
+	ingress_free(&q);
+
+	/* jobs past deadline_ms are dropped when taken, and make way on push */
+	ndropped = 0;
+	h.drop = DROP_NEWEST;
+	h.deadline_ms = 10;
+	test_assert(ingress_init(&q, &h, 3, -1, drop) == 0, "ingress_init()");
+	ingress_push(&q, job(1, 0), h.drop);
+	ingress_push(&q, job(2, 5), h.drop);
+	take(&q, 12, (int []){ 2, 0 }, "deadline");
+	test_assert(ndropped == 1 && dropped[0] == 1, "deadline: expired job dropped on take");
+	for (int i = 3; i <= 5; i++) ingress_push(&q, job(i, 20), h.drop);
+	test_assert(q.count == 3, "deadline: full");
+	ingress_push(&q, job(6, 31), h.drop);
+	test_assert(ndropped == 4 && dropped[1] == 3 && dropped[3] == 5,
+			"deadline: expired jobs make way on push");
+	test_assert(q.count == 1 && !q.dropped_newest, "deadline: new job queued");
+	take(&q, 35, (int []){ 6, 0 }, "deadline");
+	test_assert(q.dropped_expired == 4, "deadline: counted");
+	/* tokens left over find the queue empty */
+	while (q.tokens) take(&q, 35, (int []){ 0 }, "leftover token");
+	test_assert(!ingress_busy(&q), "ingress_busy() - drained");
+	ingress_free(&q);
+
+	return fails;
+}
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2020 Brett Sheffield <bacs@librecast.net> */
+
+#include "test.h"
+#include "../src/config.h"
+#include "../src/server.h"
+#include "../src/stats.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char conf[] = "0000-0042.tmp.XXXXXX";
+
+/* handlers on channels a and b, or after the change a and c.  The globals of
+ * the new file only take effect on restart */
+static int conf_write(const char *second, int loglevel)
+{
+	FILE *f = fopen(conf, "w");
+	if (!f) return -1;
+	fprintf(f, "loglevel\t%i\nengine\t\tepoll\n", loglevel);
+	fprintf(f, "handler {\n\tchannel\t\tSHA3(\"0000-0042a\")\n\tmodule\t\t../modules/echo.so\n}\n");
+	fprintf(f, "handler {\n\tchannel\t\tSHA3(\"0000-0042%s\")\n\tmodule\t\t../modules/echo.so\n}\n", second);
+	return fclose(f);
+}
+
+static stats_handler_t *slot(stats_head_t *head, const char *channel)
+{
+	for (uint32_t h = 0; h < head->used; h++) {
+		if (!strncmp(stats_handler_slot(head, h)->channel, channel, STATS_NAMELEN - 1))
+			return stats_handler_slot(head, h);
+	}
+	return NULL;
+}
+
+void *testthread(void *arg)
+{
+	stats_head_t *head;
+	stats_handler_t *a, *b, *c;
+	char *chan[3];
+	test_sleep(0, 99999999);
+	chan[0] = strdup(config.handlers->channel);
+	chan[1] = strdup(config.handlers->next->channel);
+	test_assert(conf_write("c", 0) == 0, "config file changed");
+	kill(getpid(), SIGHUP);
+	test_sleep(0, 499999999);
+	chan[2] = (config.handlers->next) ? strdup(config.handlers->next->channel) : NULL;
+	head = stats_attach(getpid());
+	test_assert(head != NULL, "stats_attach()");
+	if (head && chan[2]) {
+		a = slot(head, chan[0]);
+		b = slot(head, chan[1]);
+		c = slot(head, chan[2]);
+		test_assert(head->used == 3, "one handler added, %u slots", head->used);
+		test_assert(a && !a->retired, "unchanged handler kept");
+		test_assert(b && b->retired, "handler gone from the file removed");
+		test_assert(c && !c->retired, "new handler added");
+	}
+	test_assert(config.loglevel == 127, "globals left for a restart");
+	if (head) stats_detach(head);
+	for (int i = 0; i < 3; i++) free(chan[i]);
+	server_stop();
+	pthread_exit(arg);
+}
+
+int main()
+{
+	pthread_t thread;
+	sigset_t mask;
+	int fd;
+
+	test_name("reload handlers on SIGHUP");
+	test_assert((fd = mkstemp(conf)) != -1, "mkstemp()");
+	close(fd);
+	test_assert(conf_write("b", 127) == 0, "config file written");
+	config.configfile = strdup(conf);
+	config_include(conf);
+	test_assert(server_bind() == 0, "server_bind()");
+
+	/* for the server's signalfd, not the test thread */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	pthread_create(&thread, NULL, testthread, NULL);
+	server_run();
+	pthread_join(thread, NULL);
+	server_unbind();
+
+	config_free();
+	unlink(conf);
+
+	return fails;
+}